@@ -3,10 +3,70 @@
 #include <array>
 #include <atomic>
 #include <bit>
+#include <chrono>
 #include <cstddef>
+#include <cstring>
+#include <limits>
+#include <semaphore>
+#include <span>
+#include <thread>
 #include <type_traits>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86) || defined(_M_ARM64))
+#include <intrin.h>
+#endif
 
-template <typename T, std::size_t C>
+inline void cpu_relax()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+    __yield();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+/**
+ * Waiting policy for the blocking queue operations: poll with pause instructions, then yield the timeslice, and only
+ * then park the thread in the kernel. Most handoffs between the scene, render and builder threads complete within the
+ * spin window, which avoids a futex round-trip on both sides.
+ */
+template <unsigned Spins = 256, unsigned Yields = 8>
+struct SpinThenPark {
+    template <typename F>
+    static bool relax(F&& ready)
+    {
+        for (unsigned i = 0; i < Spins; i++) {
+            if (ready())
+                return true;
+            cpu_relax();
+        }
+        for (unsigned i = 0; i < Yields; i++) {
+            if (ready())
+                return true;
+            std::this_thread::yield();
+        }
+        return ready();
+    }
+
+    template <typename A>
+    static void wait(const std::atomic<A>& atom, A old)
+    {
+        if (relax([&atom, old]() { return atom.load(std::memory_order_acquire) != old; }) == false)
+            atom.wait(old, std::memory_order_seq_cst);
+    }
+};
+using ParkImmediately = SpinThenPark<0, 0>;
+
+enum class QueueStatus {
+    Ok,
+    Timeout,
+    Closed,
+};
+
+template <typename T, std::size_t C, typename Wait = SpinThenPark<>>
 class MPMCQ {
 public:
     constexpr static size_t hardware_interference_size = 64;
@@ -16,43 +76,172 @@ public:
     struct Slot {
         alignas(std::max(hardware_interference_size, alignof(T))) std::array<std::byte, sizeof(T)> data;
         std::atomic_size_t turn;
+        std::atomic_uint32_t sleepers;
+        // std::atomic::wait cannot time out, so bounded waits park here instead, and are woken whenever turn changes.
+        std::atomic_uint32_t timed_sleepers;
+        std::counting_semaphore<> timed_wakeup { 0 };
     };
     alignas(hardware_interference_size) std::atomic_size_t m_head;
     alignas(hardware_interference_size) std::atomic_size_t m_tail;
     alignas(hardware_interference_size) std::array<Slot, C> m_slots;
     static_assert(sizeof(Slot) % hardware_interference_size == 0);
 
+private:
+    // close() sets this bit on every turn, so that no waiter's turn can come up and parked threads see the value change.
+    constexpr static size_t CLOSED_BIT = size_t(1) << (std::numeric_limits<size_t>::digits - 1);
+    alignas(hardware_interference_size) std::atomic_bool m_closed;
+
+    bool await_turn(Slot& slot, size_t turn)
+    {
+        size_t current_turn;
+        if (Wait::relax([&slot, turn]() { return slot.turn.load(std::memory_order_acquire) == turn; }))
+            return true;
+        while ((current_turn = slot.turn.load(std::memory_order_acquire)) != turn) {
+            if (m_closed.load(std::memory_order_seq_cst))
+                return false;
+
+            // Announce ourselves on the slot before parking, so that publishers only wake threads waiting on it.
+            slot.sleepers.fetch_add(1, std::memory_order_seq_cst);
+            slot.turn.wait(current_turn, std::memory_order_seq_cst);
+            slot.sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+    template <typename F, typename Rep, typename Period>
+    QueueStatus retry_for(F&& attempt, const std::atomic_size_t& index, size_t parity, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (m_closed.load(std::memory_order_acquire) == false) {
+            if (attempt())
+                return QueueStatus::Ok;
+
+            // Wait for the slot under the index to change hands without claiming a ticket, so giving up on a timeout
+            // leaves the queue intact.
+            size_t i = index.load(std::memory_order_acquire);
+            auto& slot = m_slots[i % C];
+            auto ready = [this, &slot, &index, i, parity]() {
+                return slot.turn.load(std::memory_order_acquire) == (i / C) * 2 + parity
+                    || index.load(std::memory_order_relaxed) != i
+                    || m_closed.load(std::memory_order_relaxed);
+            };
+            if (Wait::relax(ready))
+                continue;
+
+            // A wakeup may be left over from a waiter that timed out; then ready() is false and we park again.
+            slot.timed_sleepers.fetch_add(1, std::memory_order_seq_cst);
+            bool woken = ready() || slot.timed_wakeup.try_acquire_until(deadline);
+            slot.timed_sleepers.fetch_sub(1, std::memory_order_relaxed);
+            if (woken == false && ready() == false)
+                return QueueStatus::Timeout;
+        }
+        return QueueStatus::Closed;
+    }
+    static void wake(Slot& slot)
+    {
+        uint32_t sleepers = slot.sleepers.load(std::memory_order_seq_cst);
+        if (sleepers == 1)
+            slot.turn.notify_one();
+        else if (sleepers > 1)
+            slot.turn.notify_all();
+        if (uint32_t timed_sleepers = slot.timed_sleepers.load(std::memory_order_seq_cst))
+            slot.timed_wakeup.release(timed_sleepers);
+    }
+    void notify_range(size_t begin, size_t end)
+    {
+        for (size_t i = begin; i != end && i - begin < C; i++) {
+            // A single sleeper must be the one waiting for this turn. Several sleepers can only happen when more than C
+            // operations are outstanding, and they may be waiting on different laps of the ring.
+            wake(m_slots[i % C]);
+        }
+    }
+
 public:
     MPMCQ()
         : m_head(0)
         , m_tail(0)
+        , m_closed(false)
     {
     }
     MPMCQ(const MPMCQ&) = delete;
     MPMCQ& operator=(const MPMCQ&) = delete;
 
-    void push(const T& item)
+    /**
+     * Wake every blocked producer and consumer and make all later operations fail. Items still in the queue are
+     * discarded. A closed queue cannot be reopened.
+     */
+    void close()
+    {
+        m_closed.store(true, std::memory_order_seq_cst);
+        for (auto it = m_slots.begin(); it != m_slots.end(); ++it) {
+            it->turn.fetch_or(CLOSED_BIT, std::memory_order_seq_cst);
+            it->turn.notify_all();
+            if (uint32_t timed_sleepers = it->timed_sleepers.load(std::memory_order_seq_cst))
+                it->timed_wakeup.release(timed_sleepers);
+        }
+    }
+    bool closed() const
+    {
+        return m_closed.load(std::memory_order_acquire);
+    }
+
+    /** @return false if the queue was closed before the item could be pushed. */
+    bool push(const T& item)
     {
+        if (m_closed.load(std::memory_order_relaxed))
+            return false;
+
         size_t head = m_head.fetch_add(1, std::memory_order_relaxed);
         auto& slot = m_slots[head % C];
-        size_t turn = (head / C) * 2, current_turn;
-        while ((current_turn = slot.turn.load(std::memory_order_acquire)) != turn)
-            slot.turn.wait(current_turn, std::memory_order_relaxed);
+        if (await_turn(slot, (head / C) * 2) == false)
+            return false;
 
         memcpy(slot.data.data(), &item, sizeof(T));
-        slot.turn.store((head / C) * 2 + 1, std::memory_order_release);
-        slot.turn.notify_one();
+        slot.turn.store((head / C) * 2 + 1, std::memory_order_seq_cst);
+        notify_range(head, head + 1);
+        return true;
+    }
+    bool push_n(std::span<const T> items)
+    {
+        if (items.empty() || m_closed.load(std::memory_order_relaxed))
+            return items.empty();
+
+        // Claim the whole range of tickets at once. Consumers are only woken once the batch is published, unless we
+        // have to wait for a slot ourselves; then everything published so far is flushed first so nobody deadlocks.
+        size_t head = m_head.fetch_add(items.size(), std::memory_order_relaxed), notified = head;
+        for (size_t i = 0; i < items.size(); i++) {
+            auto& slot = m_slots[(head + i) % C];
+            size_t turn = ((head + i) / C) * 2;
+            if (slot.turn.load(std::memory_order_acquire) != turn) {
+                notify_range(notified, head + i);
+                notified = head + i;
+                if (await_turn(slot, turn) == false)
+                    return false;
+            }
+
+            memcpy(slot.data.data(), &items[i], sizeof(T));
+            slot.turn.store(turn + 1, std::memory_order_seq_cst);
+        }
+        notify_range(notified, head + items.size());
+        return true;
+    }
+    template <typename Rep, typename Period>
+    QueueStatus push_for(const T& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return retry_for([this, &item]() { return try_push(item); }, m_head, 0, timeout);
     }
     bool try_push(const T& item)
     {
+        if (m_closed.load(std::memory_order_relaxed))
+            return false;
+
         size_t head = m_head.load(std::memory_order_acquire);
         while (true) {
             auto& slot = m_slots[head % C];
             if ((head / C) * 2 == slot.turn.load(std::memory_order_acquire)) {
                 if (m_head.compare_exchange_strong(head, head + 1)) {
                     memcpy(slot.data.data(), &item, sizeof(T));
-                    slot.turn.store((head / C) * 2 + 1, std::memory_order_release);
-                    slot.turn.notify_one();
+                    slot.turn.store((head / C) * 2 + 1, std::memory_order_seq_cst);
+                    notify_range(head, head + 1);
                     return true;
                 } // else try again asap; the slot is correct but someone else pushed ahead of us
             } else {
@@ -63,28 +252,40 @@ public:
             }
         }
     }
-    void pop(T& item)
+    /** @return false if the queue was closed before an item arrived. */
+    bool pop(T& item)
     {
+        if (m_closed.load(std::memory_order_relaxed))
+            return false;
+
         size_t tail = m_tail.fetch_add(1, std::memory_order_relaxed);
         auto& slot = m_slots[tail % C];
-        size_t turn = (tail / C) * 2 + 1, current_turn;
-        while ((current_turn = slot.turn.load(std::memory_order_acquire)) != turn)
-            slot.turn.wait(current_turn, std::memory_order_relaxed);
+        if (await_turn(slot, (tail / C) * 2 + 1) == false)
+            return false;
 
         memcpy(&item, slot.data.data(), sizeof(T));
-        slot.turn.store((tail / C) * 2 + 2, std::memory_order_release);
-        slot.turn.notify_all();
+        slot.turn.store((tail / C) * 2 + 2, std::memory_order_seq_cst);
+        notify_range(tail, tail + 1);
+        return true;
+    }
+    template <typename Rep, typename Period>
+    QueueStatus pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return retry_for([this, &item]() { return try_pop(item); }, m_tail, 1, timeout);
     }
     bool try_pop(T& item)
     {
+        if (m_closed.load(std::memory_order_relaxed))
+            return false;
+
         size_t tail = m_tail.load(std::memory_order_acquire);
         while (true) {
             auto& slot = m_slots[tail % C];
             if ((tail / C) * 2 + 1 == slot.turn.load(std::memory_order_acquire)) {
                 if (m_tail.compare_exchange_strong(tail, tail + 1)) {
                     memcpy(&item, slot.data.data(), sizeof(T));
-                    slot.turn.store((tail / C) * 2 + 2, std::memory_order_release);
-                    slot.turn.notify_all();
+                    slot.turn.store((tail / C) * 2 + 2, std::memory_order_seq_cst);
+                    notify_range(tail, tail + 1);
                     return true;
                 }
             } else {
@@ -95,8 +296,163 @@ public:
             }
         }
     }
+    size_t try_pop_n(std::span<T> items)
+    {
+        if (m_closed.load(std::memory_order_relaxed))
+            return 0;
+
+        size_t tail = m_tail.load(std::memory_order_acquire), count;
+        while (true) {
+            // Count the run of published slots starting at the tail, then claim all of them with one CAS.
+            count = 0;
+            while (count < items.size() && m_slots[(tail + count) % C].turn.load(std::memory_order_acquire) == ((tail + count) / C) * 2 + 1)
+                count++;
+            if (count == 0) {
+                const size_t prev_tail = tail;
+                tail = m_tail.load(std::memory_order_acquire);
+                if (tail == prev_tail)
+                    return 0;
+            } else if (m_tail.compare_exchange_strong(tail, tail + count)) {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            auto& slot = m_slots[(tail + i) % C];
+            memcpy(&items[i], slot.data.data(), sizeof(T));
+            slot.turn.store(((tail + i) / C) * 2 + 2, std::memory_order_seq_cst);
+        }
+        notify_range(tail, tail + count);
+        return count;
+    }
     bool empty() const
     {
         return m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed) <= 0;
     }
 };
+
+template <typename T, std::size_t C, typename Wait = SpinThenPark<>>
+class SPSCQ {
+public:
+    constexpr static size_t hardware_interference_size = 64;
+    static_assert(std::is_trivially_copyable<T>::value);
+    static_assert(std::has_single_bit(C));
+
+private:
+    // Each side keeps a private copy of the other side's index, and only reloads the shared one when the copy says the
+    // queue is full (producer) or empty (consumer). In steady state neither side touches the other's cache line.
+    alignas(hardware_interference_size) std::atomic_size_t m_head;
+    size_t m_cached_tail;
+    alignas(hardware_interference_size) std::atomic_size_t m_tail;
+    size_t m_cached_head;
+    alignas(hardware_interference_size) std::atomic_bool m_producer_sleeping, m_consumer_sleeping;
+    alignas(std::max(hardware_interference_size, alignof(T))) std::array<std::array<std::byte, sizeof(T)>, C> m_slots;
+
+    size_t writable()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_cached_tail == C)
+            m_cached_tail = m_tail.load(std::memory_order_acquire);
+        return C - (head - m_cached_tail);
+    }
+    size_t readable()
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (m_cached_head == tail)
+            m_cached_head = m_head.load(std::memory_order_acquire);
+        return m_cached_head - tail;
+    }
+    static void sleep_on(std::atomic_size_t& index, size_t seen, std::atomic_bool& sleeping)
+    {
+        if (Wait::relax([&index, seen]() { return index.load(std::memory_order_acquire) != seen; }))
+            return;
+        sleeping.store(true, std::memory_order_seq_cst);
+        index.wait(seen, std::memory_order_seq_cst);
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+    static void publish(std::atomic_size_t& index, size_t value, std::atomic_bool& sleeping)
+    {
+        index.store(value, std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_seq_cst))
+            index.notify_one();
+    }
+
+public:
+    SPSCQ()
+        : m_head(0)
+        , m_cached_tail(0)
+        , m_tail(0)
+        , m_cached_head(0)
+        , m_producer_sleeping(false)
+        , m_consumer_sleeping(false)
+    {
+    }
+    SPSCQ(const SPSCQ&) = delete;
+    SPSCQ& operator=(const SPSCQ&) = delete;
+
+    void push(const T& item)
+    {
+        while (writable() == 0)
+            sleep_on(m_tail, m_cached_tail, m_producer_sleeping);
+        size_t head = m_head.load(std::memory_order_relaxed);
+        memcpy(m_slots[head % C].data(), &item, sizeof(T));
+        publish(m_head, head + 1, m_consumer_sleeping);
+    }
+    bool try_push(const T& item)
+    {
+        if (writable() == 0)
+            return false;
+        size_t head = m_head.load(std::memory_order_relaxed);
+        memcpy(m_slots[head % C].data(), &item, sizeof(T));
+        publish(m_head, head + 1, m_consumer_sleeping);
+        return true;
+    }
+    size_t try_push_n(std::span<const T> items)
+    {
+        size_t count = std::min(items.size(), writable()), head = m_head.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++)
+            memcpy(m_slots[(head + i) % C].data(), &items[i], sizeof(T));
+        if (count > 0)
+            publish(m_head, head + count, m_consumer_sleeping);
+        return count;
+    }
+    void push_n(std::span<const T> items)
+    {
+        while (items.empty() == false) {
+            size_t count = try_push_n(items);
+            if (count == 0)
+                sleep_on(m_tail, m_cached_tail, m_producer_sleeping);
+            items = items.subspan(count);
+        }
+    }
+    void pop(T& item)
+    {
+        while (readable() == 0)
+            sleep_on(m_head, m_cached_head, m_consumer_sleeping);
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        memcpy(&item, m_slots[tail % C].data(), sizeof(T));
+        publish(m_tail, tail + 1, m_producer_sleeping);
+    }
+    bool try_pop(T& item)
+    {
+        if (readable() == 0)
+            return false;
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        memcpy(&item, m_slots[tail % C].data(), sizeof(T));
+        publish(m_tail, tail + 1, m_producer_sleeping);
+        return true;
+    }
+    size_t try_pop_n(std::span<T> items)
+    {
+        size_t count = std::min(items.size(), readable()), tail = m_tail.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++)
+            memcpy(&items[i], m_slots[(tail + i) % C].data(), sizeof(T));
+        if (count > 0)
+            publish(m_tail, tail + count, m_producer_sleeping);
+        return count;
+    }
+    bool empty() const
+    {
+        return m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Layout of a .pk2 pack as written by twogame-pack. A pack is an ordinary zip archive, so it still mounts through
+ * PhysicsFS, but every entry is stored uncompressed at an aligned offset: large entries on a page boundary, the rest on
+ * a 16-byte one. Entries can then be memory-mapped and copied straight out of the page cache.
+ *
+ * The archive also carries a prebuilt directory index as its last entry, so the runtime can find an entry without
+ * walking the zip central directory. The zip comment is a Trailer pointing at it.
+ */
+namespace twogame::pk2 {
+
+static_assert(std::endian::native == std::endian::little);
+
+constexpr uint32_t TRAILER_MAGIC = 0x4b504754; // "TGPK"
+constexpr uint32_t INDEX_MAGIC = 0x49504754; // "TGPI"
+constexpr uint32_t VERSION = 1;
+constexpr uint64_t PAGE_ALIGNMENT = 4096;
+constexpr uint64_t ENTRY_ALIGNMENT = 16;
+constexpr std::string_view INDEX_NAME = ".pk2index";
+
+struct Trailer {
+    uint32_t magic, version;
+    uint64_t index_offset, index_size; // from the start of the file
+};
+static_assert(sizeof(Trailer) == 24);
+
+// The index is a header, then one entry per file sorted by name (bytewise), then the names.
+struct IndexHeader {
+    uint32_t magic, version;
+    uint32_t entry_count, names_size;
+};
+static_assert(sizeof(IndexHeader) == 16);
+
+struct IndexEntry {
+    uint64_t offset, size; // of the entry's data, from the start of the file
+    uint32_t name_offset, name_size; // into the names, which follow the entries
+};
+static_assert(sizeof(IndexEntry) == 24);
+
+}
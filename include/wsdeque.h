@@ -0,0 +1,90 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+/**
+ * Chase-Lev work-stealing deque with a fixed capacity, following the weak memory model formulation of Le et al. The
+ * owning thread pushes and pops at the bottom; any number of thieves steal from the top.
+ */
+template <typename T, std::size_t C>
+class WSDeque {
+public:
+    constexpr static size_t hardware_interference_size = 64;
+    static_assert(std::atomic<T>::is_always_lock_free);
+    static_assert(std::has_single_bit(C));
+
+private:
+    alignas(hardware_interference_size) std::atomic_int64_t m_top;
+    alignas(hardware_interference_size) std::atomic_int64_t m_bottom;
+    alignas(hardware_interference_size) std::array<std::atomic<T>, C> m_items;
+
+public:
+    WSDeque()
+        : m_top(0)
+        , m_bottom(0)
+    {
+    }
+    WSDeque(const WSDeque&) = delete;
+    WSDeque& operator=(const WSDeque&) = delete;
+
+    /** Owner only. @return false if the deque is full. */
+    bool push(T item)
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_acquire);
+        if (bottom - top >= static_cast<int64_t>(C))
+            return false;
+
+        m_items[bottom % C].store(item, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /** Owner only. Takes the most recently pushed item. */
+    std::optional<T> pop()
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+        if (top > bottom) {
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+
+        T item = m_items[bottom % C].load(std::memory_order_relaxed);
+        if (top == bottom) {
+            // Last item: race the thieves for it.
+            bool won = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            if (won == false)
+                return std::nullopt;
+        }
+        return item;
+    }
+
+    /** Any thread. Takes the oldest item. Returns nothing if the deque is empty or another thread won the race. */
+    std::optional<T> steal()
+    {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+            return std::nullopt;
+
+        T item = m_items[top % C].load(std::memory_order_relaxed);
+        if (m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed) == false)
+            return std::nullopt;
+        return item;
+    }
+
+    bool empty() const
+    {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+};
@@ -6,30 +6,59 @@
 layout(set = 2, binding = 0) uniform sampler2D picture_book[];
 
 layout(buffer_reference, std430) buffer PerObjectData {
-    uint nothing;
+    uint material[];
 };
 
 layout(buffer_reference, std430) buffer Models {
     mat4 model[];
 };
 
-layout(buffer_reference, std430) buffer MaterialInfo {
+struct MaterialData {
     uint base_color_texture;
 };
 
+layout(buffer_reference, std430) buffer MaterialInfo {
+    MaterialData materials[];
+};
+
+layout(buffer_reference, std430) buffer MipFeedback {
+    uint needed_level[];
+};
+
 layout(std430, push_constant) uniform PC {
     PerObjectData object;
     Models model;
     MaterialInfo material;
+    MipFeedback mip_feedback;
 };
 
 layout(location = 0) in vec3 in_normal;
 layout(location = 1) in vec2 in_uv;
+layout(location = 2) flat in uint in_material;
 layout(location = 0) out vec4 out_color;
 
+// Report the finest level the image is sampled at, relative to its finest resident one and biased by 16 so that
+// levels it is missing come out below that. The scene streams those in. textureQueryLod() would clamp at the resident
+// level, so the footprint is measured from derivatives against the resident level's size.
+void report_lod(uint image, vec2 uv)
+{
+    vec2 texels = uv * vec2(textureSize(picture_book[nonuniformEXT(image)], 0));
+    float lod = log2(max(length(dFdx(texels)), length(dFdy(texels))));
+    uint level = uint(clamp(floor(lod) + 16.0, 0.0, 31.0));
+    if (level < mip_feedback.needed_level[image])
+        atomicMin(mip_feedback.needed_level[image], level);
+}
+
 void main()
 {
-    vec4 base_color = vec4(texture(picture_book[material.base_color_texture], in_uv).xyz, 1.0);
+    // Draws of different materials come from the same indirect command, so the texture can differ between them.
+    // A material without a texture is plain white.
+    uint base_color_texture = material.materials[in_material].base_color_texture;
+    vec4 base_color = vec4(1.0);
+    if (base_color_texture != 0xffffffffu) {
+        report_lod(base_color_texture, in_uv);
+        base_color = vec4(texture(picture_book[nonuniformEXT(base_color_texture)], in_uv).xyz, 1.0);
+    }
     float lighting = 0.3 + clamp(1.5 * dot(in_normal, vec3(1.0, 0.0, 0.0)), 0.0, 0.7);
     out_color = vec4(base_color.xyz * lighting, 1.0);
 }
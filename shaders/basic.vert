@@ -8,21 +8,30 @@ layout(set = 0, binding = 0) uniform PerFrameData {
 };
 
 layout(buffer_reference, std430) buffer PerObjectData {
-    uint nothing;
+    uint material[];
 };
 
 layout(buffer_reference, std430) buffer Models {
     mat4 model[];
 };
 
-layout(buffer_reference, std430) buffer MaterialInfo {
+struct MaterialData {
     uint base_color_texture;
 };
 
+layout(buffer_reference, std430) buffer MaterialInfo {
+    MaterialData materials[];
+};
+
+layout(buffer_reference, std430) buffer MipFeedback {
+    uint needed_level[];
+};
+
 layout(std430, push_constant) uniform PC {
     PerObjectData object;
     Models model;
     MaterialInfo material;
+    MipFeedback mip_feedback;
 };
 
 layout(location = 0) in vec3 in_position;
@@ -30,10 +39,12 @@ layout(location = 1) in vec3 in_normal;
 layout(location = 2) in vec2 in_uv;
 layout(location = 0) out vec3 out_normal;
 layout(location = 1) out vec2 out_uv;
+layout(location = 2) flat out uint out_material;
 
 void main()
 {
     gl_Position = proj * view * model.model[gl_InstanceIndex] * vec4(in_position, 1.0);
     out_normal = in_normal;
     out_uv = in_uv;
+    out_material = object.material[gl_InstanceIndex];
 }
@@ -0,0 +1,312 @@
+#include "asyncio.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <SDL3/SDL_assert.h>
+#include <SDL3/SDL_log.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace twogame {
+
+std::unique_ptr<AsyncIO> AsyncIO::s_self;
+
+namespace {
+
+    constexpr unsigned RING_ENTRIES = 256;
+
+    void read_blocking(const AsyncIO::Read& read)
+    {
+#ifdef _WIN32
+        // AssetFile never hands out descriptors on Windows.
+        SDL_assert_release(false && "no asynchronous reads on this platform");
+#else
+        uint8_t* dst = static_cast<uint8_t*>(read.dst);
+        for (size_t done = 0; done < read.size;) {
+            ssize_t rs = pread(read.fd, dst + done, read.size - done, read.offset + done);
+            if (rs < 0 && errno == EINTR)
+                continue;
+            SDL_assert_release(rs > 0 && "read failed");
+            done += rs;
+        }
+#endif
+    }
+
+}
+
+struct AsyncIO::Batch {
+    std::atomic_size_t remaining;
+    JobSystem::JobRef done;
+};
+
+struct AsyncIO::Request {
+    Batch* batch; // null for the request that stops the reaper
+    Read read;
+};
+
+#ifdef __linux__
+struct AsyncIO::Ring {
+    int fd = -1;
+    void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    uint32_t *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail;
+    uint32_t sq_mask, cq_mask;
+    io_uring_cqe* cqes;
+
+    // Requests are only pushed while there is a free slot, so neither ring can overflow.
+    std::counting_semaphore<RING_ENTRIES> slots { 0 };
+    std::atomic_size_t reads_in_flight = 0; // a read continued after a short read still counts once
+    std::mutex submit_lock;
+    uint32_t unsubmitted = 0;
+    std::thread reaper;
+
+    bool setup()
+    {
+        io_uring_params params {};
+        fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if (fd < 0)
+            return false;
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else if ((cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+            return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            return false;
+
+        uint8_t* sq = static_cast<uint8_t*>(sq_ptr);
+        uint8_t* cq = static_cast<uint8_t*>(cq_ptr);
+        sq_head = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        slots.release(std::min(params.sq_entries, RING_ENTRIES));
+        return true;
+    }
+
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+        if (fd >= 0)
+            close(fd);
+    }
+};
+#else
+struct AsyncIO::Ring { };
+#endif
+
+AsyncIO::AsyncIO()
+{
+#ifdef __linux__
+    // io_uring may be missing from the kernel, or blocked by a sandbox. Either way the job system picks up the reads.
+    auto ring = std::make_unique<Ring>();
+    if (ring->setup()) {
+        m_ring = std::move(ring);
+        m_ring->reaper = std::thread(&AsyncIO::reap, this);
+    }
+#endif
+    SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "asynchronous reads: %s", m_ring ? "io_uring" : "job system");
+}
+
+AsyncIO::~AsyncIO()
+{
+#ifdef __linux__
+    if (m_ring) {
+        // The stop request drains the ring, so it completes after every read submitted before it. Reads continued past
+        // that point are still reaped: the reaper stops once it has seen this one and nothing is left in flight.
+        m_ring->slots.acquire();
+        std::lock_guard lock(m_ring->submit_lock);
+        push(new Request { nullptr, { -1, 0, nullptr, 0 } });
+        flush();
+    }
+    if (m_ring)
+        m_ring->reaper.join();
+#endif
+}
+
+void AsyncIO::init()
+{
+    SDL_assert(!s_self);
+    s_self = std::unique_ptr<AsyncIO> { new AsyncIO };
+}
+
+void AsyncIO::drop()
+{
+    SDL_assert(s_self);
+    s_self.reset();
+}
+
+void AsyncIO::push(Request* request)
+{
+#ifdef __linux__
+    // Only called with the submit lock held and a slot acquired.
+    uint32_t tail = *m_ring->sq_tail;
+    uint32_t index = tail & m_ring->sq_mask;
+    io_uring_sqe* sqe = &m_ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (request->batch) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = request->read.fd;
+        sqe->off = request->read.offset;
+        sqe->addr = reinterpret_cast<uint64_t>(request->read.dst);
+        sqe->len = request->read.size;
+    } else {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->flags = IOSQE_IO_DRAIN;
+    }
+    sqe->user_data = reinterpret_cast<uint64_t>(request);
+    m_ring->sq_array[index] = index;
+    std::atomic_ref(*m_ring->sq_tail).store(tail + 1, std::memory_order_release);
+    m_ring->unsubmitted++;
+#endif
+}
+
+void AsyncIO::flush()
+{
+#ifdef __linux__
+    while (m_ring->unsubmitted > 0) {
+        int submitted = syscall(__NR_io_uring_enter, m_ring->fd, m_ring->unsubmitted, 0, 0, nullptr, 0);
+        if (submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+            continue;
+        SDL_assert_release(submitted > 0 && "io_uring_enter failed");
+        m_ring->unsubmitted -= submitted;
+    }
+#endif
+}
+
+void AsyncIO::reap()
+{
+#ifdef __linux__
+    bool stopping = false;
+    while (stopping == false || m_ring->reads_in_flight.load(std::memory_order_acquire) > 0) {
+        int waited = syscall(__NR_io_uring_enter, m_ring->fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        SDL_assert_release(waited >= 0 || errno == EINTR);
+
+        uint32_t head = *m_ring->cq_head;
+        uint32_t tail = std::atomic_ref(*m_ring->cq_tail).load(std::memory_order_acquire);
+        std::vector<Request*> resubmit;
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = m_ring->cqes[head & m_ring->cq_mask];
+            Request* request = reinterpret_cast<Request*>(cqe.user_data);
+            int res = cqe.res;
+            if (request->batch == nullptr) {
+                stopping = true;
+                delete request;
+                m_ring->slots.release();
+                continue;
+            }
+
+            // Short reads are continued from where they stopped, keeping their slot.
+            if (res == -EINTR || res == -EAGAIN) {
+                resubmit.push_back(request);
+                continue;
+            }
+            if (res <= 0) {
+                SDL_LogCritical(SDL_LOG_CATEGORY_SYSTEM, "read of %zu bytes at %llu failed: %s", request->read.size,
+                    static_cast<unsigned long long>(request->read.offset), res < 0 ? strerror(-res) : "unexpected end of file");
+                SDL_assert_release(false && "read failed");
+            }
+            if (static_cast<size_t>(res) < request->read.size) {
+                request->read.offset += res;
+                request->read.dst = static_cast<uint8_t*>(request->read.dst) + res;
+                request->read.size -= res;
+                resubmit.push_back(request);
+                continue;
+            }
+
+            Batch* batch = request->batch;
+            delete request;
+            m_ring->reads_in_flight.fetch_sub(1, std::memory_order_release);
+            m_ring->slots.release();
+            if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                complete(batch);
+        }
+        std::atomic_ref(*m_ring->cq_head).store(head, std::memory_order_release);
+
+        if (resubmit.empty() == false) {
+            std::lock_guard lock(m_ring->submit_lock);
+            for (auto it = resubmit.begin(); it != resubmit.end(); ++it)
+                push(*it);
+            flush();
+        }
+    }
+#endif
+}
+
+void AsyncIO::complete(Batch* batch)
+{
+    JobSystem::submit(batch->done);
+    delete batch;
+}
+
+JobSystem::JobRef AsyncIO::read(std::vector<Read>&& reads)
+{
+    JobSystem::JobRef done = JobSystem::create([]() { });
+    if (reads.empty()) {
+        JobSystem::submit(done);
+        return done;
+    }
+
+    if (s_self->m_ring == nullptr) {
+        for (auto it = reads.begin(); it != reads.end(); ++it) {
+            JobSystem::JobRef job = JobSystem::create([read = *it]() { read_blocking(read); });
+            JobSystem::depend(done, job);
+            JobSystem::submit(job);
+        }
+        JobSystem::submit(done);
+        return done;
+    }
+
+#ifdef __linux__
+    Ring* ring = s_self->m_ring.get();
+    Batch* batch = new Batch { reads.size(), done };
+    std::unique_lock lock(ring->submit_lock);
+    for (auto it = reads.begin(); it != reads.end(); ++it) {
+        SDL_assert(it->size <= UINT32_MAX);
+
+        // With the ring full, hand what is queued to the kernel and let go of the lock while waiting for a slot: the
+        // reaper needs it to continue short reads.
+        if (ring->slots.try_acquire() == false) {
+            s_self->flush();
+            lock.unlock();
+            ring->slots.acquire();
+            lock.lock();
+        }
+        ring->reads_in_flight.fetch_add(1, std::memory_order_relaxed);
+        s_self->push(new Request { batch, *it });
+    }
+    s_self->flush();
+#endif
+    return done;
+}
+
+}
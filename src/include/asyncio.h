@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "jobs.h"
+
+namespace twogame {
+
+/**
+ * Batched asynchronous file reads. On Linux the reads go through an io_uring, so a whole scene's worth can be in flight
+ * at once; elsewhere, or where io_uring is unavailable, each read runs as a job on the job system.
+ *
+ * A batch completes as a job, so work that needs the data can depend on it or wait for it like any other job.
+ */
+class AsyncIO final {
+    static std::unique_ptr<AsyncIO> s_self;
+
+public:
+    struct Read {
+        int fd;
+        uint64_t offset;
+        void* dst;
+        size_t size;
+    };
+
+private:
+    struct Batch;
+    struct Request;
+    struct Ring;
+    std::unique_ptr<Ring> m_ring; // null if reads fall back to the job system
+
+    AsyncIO();
+    void push(Request* request);
+    void flush();
+    void reap();
+    static void complete(Batch* batch);
+
+public:
+    static void init();
+    static void drop();
+    ~AsyncIO();
+
+    static inline bool uses_io_uring() { return s_self->m_ring != nullptr; }
+
+    /**
+     * Start a batch of reads, which may complete in any order. Every read must succeed in full.
+     * @return A job that finishes once every read in the batch has.
+     */
+    static JobSystem::JobRef read(std::vector<Read>&& reads);
+};
+
+}
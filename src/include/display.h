@@ -6,6 +6,7 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <span>
 #include <vector>
 #include <cglm/struct.h>
@@ -38,6 +39,9 @@ namespace twogame {
 
 class IRenderer;
 class DisplayHost;
+namespace asset {
+    class Mesh;
+}
 class SceneHost;
 
 class DisplayHost final {
@@ -121,27 +125,118 @@ class IRenderer {
 
 public:
     constexpr static int SIMULTANEOUS_FRAMES = DisplayHost::SIMULTANEOUS_FRAMES;
-    constexpr static int PICTUREBOOK_CAPACITY = 16; // This is as high as we can go without using Metal argument buffers, which are enabled with the update-after-bind flag.
+    // Room for every texture a few scenes keep resident at once, while keeping each frame's copy of the set small. The
+    // renderer clamps it to the device's update-after-bind limits.
+    constexpr static uint32_t PICTUREBOOK_CAPACITY = 4096;
     enum class GraphicsPipeline {
         GPass,
         MAX_VALUE,
     };
     enum class ComputePipeline {
+        Cull,
         MAX_VALUE,
     };
+    constexpr static uint32_t CULL_GROUP_SIZE = 64;
+    constexpr static VkDeviceSize TRANSIENT_CAPACITY = 4 * 1024 * 1024; // per frame in flight
+
+    /** Memory handed out by allocate_transient(): where to write it, and where the GPU finds it. */
+    struct Transient {
+        std::span<std::byte> data;
+        VkDeviceAddress address;
+        uint32_t offset; // into transient_buffer(), for dynamic descriptors
+    };
 
 private:
-    VkBuffer m_uniform_buffer;
-    VmaAllocation m_uniform_buffer_mem;
-    std::byte* m_uniform_buffer_ptr;
+    static IRenderer* s_self;
+
+    // These are laid out like their namesakes in cull.comp.
+    struct CullInstance {
+        vec4s model[4]; // by column; a mat4s may be aligned to more than the shader's 16 bytes
+        uint32_t batch;
+    };
+    static_assert(sizeof(CullInstance) == 80);
+    struct CullBatch {
+        vec4s bounds_min, bounds_max; // in model space; w is ignored
+        uint32_t first_index, index_count;
+        int32_t vertex_offset;
+        uint32_t material;
+        uint32_t first_instance; // where the batch's visible instances go in models and objects
+        uint32_t run, first_draw; // the mesh the batch is drawn with, and where that mesh's draws go
+    };
+    static_assert(sizeof(CullBatch) == 64);
+    struct CullParams {
+        VkDeviceAddress instances, batches, draws, counts, models, objects;
+        uint32_t instance_count, batch_count, pass;
+    };
+
+    /** A buffer that only ever grows. Host buffers are persistently mapped, and keep their contents as they grow. */
+    struct GrowableBuffer {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VmaAllocation mem = VK_NULL_HANDLE;
+        std::byte* ptr = nullptr;
+        VkDeviceSize capacity = 0;
+        VkDeviceAddress address = 0;
+    };
+
+    /**
+     * Instances pushed for one frame in flight. Each is written straight into the arena with the batch it belongs to;
+     * batches are laid out when the cull pass is recorded, consecutive per mesh so that each mesh is drawn once.
+     * The cull pass writes visible instances' models and objects, then one draw per batch with any visible instances.
+     */
+    struct InstanceArena {
+        uint32_t frame_number = UINT32_MAX;
+        GrowableBuffer instances; // on the host; batches are transient
+        GrowableBuffer draws, counts, models, objects; // on the device; counts holds one per batch, then one per run
+        uint32_t instance_count = 0;
+        std::map<std::tuple<const asset::Mesh*, uint32_t, uint32_t>, uint32_t> batch_index; // by mesh, submesh and material
+        std::vector<uint32_t> batch_sizes;
+        std::vector<std::pair<const asset::Mesh*, uint32_t>> runs; // each mesh and how many batches it has
+    };
+
+    /**
+     * Each frame in flight allocates linearly from its own region of the transient buffer. A region starts over with
+     * the first allocation for a new frame: the scene records a frame only once the last one to use its region has
+     * completed.
+     */
+    struct TransientRing {
+        uint32_t frame_number = UINT32_MAX;
+        VkDeviceSize head = 0, flushed = 0; // relative to the region
+        uint32_t uniforms = UINT32_MAX; // this frame's PerFrameData, as a dynamic offset
+    };
+    VkBuffer m_transient_buffer;
+    VmaAllocation m_transient_mem;
+    std::byte* m_transient_ptr;
+    VkDeviceAddress m_transient_address;
+    VkDeviceSize m_uniform_alignment;
+    std::array<TransientRing, SIMULTANEOUS_FRAMES> m_transient_rings;
 
     VkSampler m_sampler;
 
     mat4s m_perspective_projection, m_ortho_projection;
     std::vector<VkDescriptorSetLayout> m_descriptor_layouts;
     VkDescriptorPool m_graphics_descriptor_pool;
-    std::array<VkDescriptorSet, SIMULTANEOUS_FRAMES> m_descriptor_set_0;
+    VkDescriptorSet m_descriptor_set_0;
     std::array<std::array<VkDescriptorSet, static_cast<size_t>(GraphicsPipeline::MAX_VALUE)>, SIMULTANEOUS_FRAMES> m_descriptor_set_1;
+    std::array<InstanceArena, SIMULTANEOUS_FRAMES> m_instance_arenas;
+
+    /**
+     * The picture book holds every resident image, at a slot it keeps for as long as it stays resident. Each frame in
+     * flight has its own copy of the descriptor set, brought up to date just before the frame is recorded, so that
+     * a slot can be pointed elsewhere while frames that sample it are in flight.
+     */
+    uint32_t m_picturebook_capacity;
+    VkDescriptorPool m_picturebook_pool;
+    std::array<VkDescriptorSet, SIMULTANEOUS_FRAMES> m_picturebook;
+    std::mutex m_picturebook_lock;
+    std::vector<VkImageView> m_picturebook_views; // by slot
+    std::vector<uint32_t> m_picturebook_free;
+    std::array<std::vector<uint32_t>, SIMULTANEOUS_FRAMES> m_picturebook_dirty; // slots each copy is behind on
+
+    static void reserve(GrowableBuffer& buffer, VkDeviceSize size, VkBufferUsageFlags usage, bool host);
+    static void release(GrowableBuffer& buffer);
+    InstanceArena& instance_arena(uint32_t frame_number);
+    TransientRing& transient_ring(uint32_t frame_number);
+    void write_picturebook(uint32_t frame_number);
 
 protected:
     VkRenderPass m_render_pass;
@@ -173,14 +268,58 @@ public:
     inline mat4s projection() const { return m_perspective_projection; }
     inline mat4s ortho_projection() const { return m_ortho_projection; }
     inline VkSampler sampler() const { return m_sampler; }
-    inline const VkDescriptorSetLayout& picturebook_descriptor_layout() const { return m_descriptor_layouts[2]; }
-    std::span<std::byte> descriptor_buffer(int frame, int set, int binding);
-    void flush_descriptor_buffers();
+    inline uint32_t picturebook_capacity() const { return m_picturebook_capacity; }
+
+    /** Give an image view a slot in the picture book, which bind_pipeline() binds to set 2 as picture_book[]. */
+    static uint32_t acquire_picture(VkImageView view);
+    /** Point a slot at another view. Frames recorded from now on sample it; those already recorded keep the old one. */
+    static void replace_picture(uint32_t slot, VkImageView view);
+    /** Give a slot back, once no frame can sample it. */
+    static void release_picture(uint32_t slot);
+    inline VkBuffer transient_buffer() const { return m_transient_buffer; }
+
+    /** Allocate memory for this frame only. It stays valid until the frame completes. */
+    Transient allocate_transient(uint32_t frame_number, VkDeviceSize size, VkDeviceSize alignment = 16);
+    /** This frame's PerFrameData, bound to set 0 by bind_pipeline(). Allocated on first use. */
+    std::span<std::byte> frame_uniforms(uint32_t frame_number);
+    /** Make what was written to this frame's transient memory since the last flush visible to the GPU. */
+    void flush_transient(uint32_t frame_number);
 
     void bind_pipeline(VkCommandBuffer cmd, GraphicsPipeline pass, int frame_number);
     void bind_pipeline(VkCommandBuffer cmd, ComputePipeline pass, int frame_number);
+
+    /**
+     * Draw a submesh this frame, with a material and a model matrix. Instances of the same submesh and material are
+     * batched into one instanced draw, and all of a mesh's batches into one indirect draw.
+     * @param material Passed on to the shader, as PerObjectData::material.
+     */
+    void push_instance(uint32_t frame_number, const asset::Mesh* mesh, uint32_t submesh, uint32_t material, const mat4s& model);
+    void push_instances(uint32_t frame_number, const asset::Mesh* mesh, uint32_t submesh, uint32_t material, std::span<const mat4s> models);
+
+    /**
+     * Record the cull pass over this frame's instances: frustum-cull them against this frame's view, and write draws
+     * for the visible ones. Must be recorded outside of a render pass, before the draws.
+     */
+    void record_cull(VkCommandBuffer cmd, uint32_t frame_number);
+
+    /**
+     * Record this frame's draws, as the cull pass left them: one indirect draw per mesh, from first_run on. The pipeline
+     * and push constants must be bound.
+     */
+    void draw_instances(VkCommandBuffer cmd, uint32_t frame_number, size_t first_run = 0, size_t run_count = SIZE_MAX);
+    /** How many indirect draws draw_instances() records this frame, for splitting them between command buffers. */
+    inline size_t instance_runs(uint32_t frame_number) const
+    {
+        const InstanceArena& arena = m_instance_arenas[frame_number % SIMULTANEOUS_FRAMES];
+        return arena.frame_number == frame_number ? arena.runs.size() : 0;
+    }
+
+    /** Where the cull pass writes this frame's visible instances, for the PerObjectData and Models push constants. */
+    inline VkDeviceAddress instance_objects(uint32_t frame_number) const { return m_instance_arenas[frame_number % SIMULTANEOUS_FRAMES].objects.address; }
+    inline VkDeviceAddress instance_models(uint32_t frame_number) const { return m_instance_arenas[frame_number % SIMULTANEOUS_FRAMES].models.address; }
     virtual Output draw(uint32_t frame_number) = 0;
     virtual void recreate_subpass_data(uint32_t frame_number) = 0;
+    virtual int subpass_count() const = 0;
 
     void resize_frames(VkExtent2D surface_extent);
 };
@@ -221,6 +360,7 @@ public:
 
     virtual Output draw(uint32_t frame_number);
     virtual void recreate_subpass_data(uint32_t frame_number);
+    inline virtual int subpass_count() const { return std::tuple_size<AllSubpasses>::value; }
 };
 
 }
@@ -0,0 +1,95 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "mpmc.h"
+#include "wsdeque.h"
+
+namespace twogame {
+
+/**
+ * Work-stealing thread pool. Each worker owns a Chase-Lev deque: jobs spawned by a worker go to the bottom of its own
+ * deque, and idle workers steal from the top of someone else's. Jobs submitted from other threads go through a shared
+ * injection queue.
+ *
+ * A job runs once all of its prerequisites have finished. Dependencies must be declared before the job is submitted.
+ *
+ * Tasks are jobs that may block on progress outside the job system, such as a scene's bringup waiting for staging
+ * buffers. They have their own queue, which only idle workers take from: a worker helping out while it waits never
+ * picks one up, so a task is never nested under a wait it could keep from finishing.
+ */
+class JobSystem final {
+    static std::unique_ptr<JobSystem> s_self;
+    static thread_local int s_worker_index;
+
+public:
+    class Job {
+        friend class JobSystem;
+
+        std::function<void()> m_work;
+        std::atomic_int32_t m_pending; // unfinished prerequisites, plus one until the job is submitted
+        std::atomic_bool m_done;
+        std::atomic_uint32_t m_helpers; // workers sleeping in wait() until this job is done
+        bool m_cancelled; // set before m_done
+        bool m_task;
+        std::mutex m_lock;
+        std::vector<std::shared_ptr<Job>> m_continuations;
+        std::shared_ptr<Job> m_self; // keeps the job alive while it is queued
+
+    public:
+        Job(std::function<void()>&& work);
+        inline bool done() const { return m_done.load(std::memory_order_acquire); }
+        /** Whether the job finished without running, because the job system shut down first. Valid once done. */
+        inline bool cancelled() const { return m_cancelled; }
+    };
+    using JobRef = std::shared_ptr<Job>;
+
+private:
+    constexpr static size_t DEQUE_CAPACITY = 4096;
+    constexpr static size_t INJECTION_CAPACITY = 256;
+    struct Worker {
+        WSDeque<Job*, DEQUE_CAPACITY> deque;
+        std::thread thread;
+        uint32_t rng;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    MPMCQ<Job*, INJECTION_CAPACITY> m_injected, m_tasks;
+    alignas(MPMCQ<Job*, INJECTION_CAPACITY>::hardware_interference_size) std::atomic_uint32_t m_epoch, m_sleepers;
+    std::atomic_uint32_t m_waiting; // sleepers that are inside wait()
+    std::atomic_bool m_running;
+
+    JobSystem(unsigned worker_count);
+    void worker_loop(int index);
+    Job* find_job(int index, bool tasks);
+    void schedule(JobRef&& job);
+    void execute(Job* job);
+    void finish(Job* job, bool cancelled);
+
+public:
+    static void init();
+    static void drop();
+    ~JobSystem();
+
+    static inline unsigned worker_count() { return s_self->m_workers.size(); }
+    static inline bool on_worker() { return s_worker_index >= 0; }
+
+    static JobRef create(std::function<void()> work);
+    /** Make job wait for prerequisite. Only valid before job is submitted. */
+    static void depend(const JobRef& job, const JobRef& prerequisite);
+    static void submit(const JobRef& job);
+    static JobRef spawn(std::function<void()> work);
+    /** Spawn a task: a job that only an idle worker runs. */
+    static JobRef spawn_task(std::function<void()> work);
+
+    /**
+     * Block until the job has finished. Worker threads run other jobs while they wait, and sleep alongside the idle
+     * workers when there are none; they only take tasks when waiting on a task. Other threads park.
+     */
+    static void wait(const JobRef& job);
+};
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <physfs.h>
+#include "asyncio.h"
+#include "pk2.h"
+
+namespace twogame {
+
+/**
+ * Memory-mapped .pk2 packs (see pk2.h). Packs are mounted alongside PhysicsFS, under the same mount points, and serve
+ * their entries as spans of the mapping, so reading an asset out of a pack is a single copy from the page cache.
+ *
+ * Mount everything before any assets are loaded; lookups don't lock.
+ */
+class PackFiles final {
+    struct Pack {
+        std::string mountpoint; // with a trailing slash
+        const uint8_t* data;
+        size_t size;
+        const pk2::IndexEntry* entries;
+        uint32_t entry_count;
+        const char* names;
+        int fd; // for asynchronous reads
+    };
+    static std::vector<Pack> s_packs;
+
+public:
+    /**
+     * Map the pack at path and serve its entries under mountpoint. Packs without an index, like zip archives that
+     * weren't built by twogame-pack, aren't mapped and are left to PhysicsFS.
+     */
+    static bool mount(const char* path, std::string_view mountpoint);
+    static void unmount_all();
+
+    /**
+     * The bytes of the file at path, if it is in a mapped pack. Packs are searched in the order they were mounted,
+     * like PhysicsFS's search path.
+     * @param fd, fd_offset If set, receive a descriptor of the pack and the entry's offset in it, for asynchronous
+     * reads.
+     * @return An empty span if no mapped pack has the file.
+     */
+    static std::span<const uint8_t> find(std::string_view path, int* fd = nullptr, uint64_t* fd_offset = nullptr);
+};
+
+/**
+ * A file in the PhysicsFS search path, read the cheapest way available. Files in a mapped pack, or in a mounted
+ * directory, are mapped: their bytes can be copied straight from the page cache to wherever they are going. Anything
+ * else, like a compressed zip entry, falls back to PhysicsFS reads.
+ */
+class AssetFile final {
+    PHYSFS_File* m_fh;
+    std::span<const uint8_t> m_mapped;
+    bool m_owns_mapping; // mapped from a directory, rather than borrowed from a pack
+    int m_fd; // the mapped file, or the pack it is in, for asynchronous reads
+    uint64_t m_fd_offset;
+
+public:
+    AssetFile(std::string_view path);
+    AssetFile(const AssetFile&) = delete;
+    ~AssetFile();
+
+    inline bool is_mapped() const { return m_fh == nullptr; }
+    inline PHYSFS_File* physfs() const { return m_fh; }
+    uint64_t size() const;
+
+    /**
+     * The whole file, if it is mapped.
+     * @return An empty span if the file is read through PhysicsFS.
+     */
+    inline std::span<const uint8_t> mapped() const { return m_mapped; }
+
+    /**
+     * Copy size bytes from offset in the file to dst, which is usually mapped staging or buffer memory.
+     */
+    void read(uint64_t offset, void* dst, size_t size) const;
+
+    /**
+     * Like read(), but queue the read onto reads to be started as part of a batch, if the file can be read
+     * asynchronously. Otherwise the bytes are copied before this returns.
+     */
+    void read_async(uint64_t offset, void* dst, size_t size, std::vector<AsyncIO::Read>& reads) const;
+};
+
+}
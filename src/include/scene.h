@@ -1,52 +1,167 @@
 #pragma once
 #include <atomic>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <span>
 #include <stack>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <variant>
 #include "display.h"
+#include "jobs.h"
 #include "mpmc.h"
 
 namespace twogame {
 
+class IAsset;
 class IScene;
+namespace asset {
+    class Image;
+}
 
 class SceneHost final {
     static std::unique_ptr<SceneHost> s_self;
 
 public:
-    constexpr static VkDeviceSize STAGING_BUFFER_SIZE = 1 << 29;
+    constexpr static VkDeviceSize STAGING_RING_SIZE = 1 << 26;
+    constexpr static VkDeviceSize STAGING_PASS_BUDGET = STAGING_RING_SIZE / 4;
+    constexpr static VkDeviceSize MIP_STREAM_BUDGET = STAGING_PASS_BUDGET / 2;
+    constexpr static size_t DRAWS_PER_RECORDER = 64;
+    class StagingRing;
+
+    /**
+     * One pass worth of transfers. Source data lives in the shared staging ring; the buffer only holds the space it
+     * reserved there and the commands that copy out of it.
+     */
     class StagingBuffer {
         friend class SceneHost;
 
+        StagingRing* m_ring;
         VkBuffer m_src_buffer;
-        VmaAllocation m_src_mem;
         std::span<std::byte> m_src_data;
         VkCommandBuffer m_xfer_commands, m_acquire_commands;
         VkSemaphore m_post_xfer;
+        VkFence m_xfer_fence;
+        std::atomic_uint64_t m_serial; // bumped every time the buffer is reused, so stale ring records can tell
 
+        // Assets are prepared in parallel, each into its own window, but they all record into the same command lists.
+        std::mutex m_record_lock;
         std::vector<VkBufferMemoryBarrier2> m_buffer_memory_barriers;
         std::vector<std::pair<VkCopyBufferInfo2, std::vector<VkBufferCopy2>>> m_buffer_copies;
         std::array<std::vector<VkImageMemoryBarrier2>, 2> m_image_memory_barriers;
         std::vector<std::pair<VkCopyBufferToImageInfo2, std::vector<VkBufferImageCopy2>>> m_image_copies;
+        std::vector<JobSystem::JobRef> m_reads;
 
     public:
-        StagingBuffer() { }
+        StagingBuffer()
+            : m_serial(0)
+        {
+        }
+
+        /**
+         * Reserve space in the staging ring for this pass. Reserve everything the pass needs in as few calls as
+         * possible: space is only recycled once a pass has been submitted and its copies have completed.
+         * @return the offset to pass to window(), or nothing if the ring can only make room by recycling this pass.
+         */
+        std::optional<VkDeviceSize> reserve(VkDeviceSize size);
         inline std::span<std::byte> window(VkDeviceSize offset) const { return m_src_data.subspan(offset); }
-        void copy_image(VkImage dst, VkImageCreateInfo& info, std::span<const VkBufferImageCopy2> copies, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access, VkImageLayout final_layout);
-        void copy_buffer(VkBuffer dst, VkDeviceSize dst_size, std::span<const VkBufferCopy2> regions, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access);
+
+        /**
+         * Copy out of the staging ring. Resources staged over several passes set first only on their first copy, which
+         * moves images into the transfer layout, and last only on their final copy, which hands them to the graphics
+         * queue.
+         */
+        void copy_image(VkImage dst, VkImageCreateInfo& info, std::span<const VkBufferImageCopy2> copies, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access, VkImageLayout final_layout, bool first = true, bool last = true, uint32_t base_level = 0, uint32_t level_count = VK_REMAINING_MIP_LEVELS);
+        void copy_buffer(VkBuffer dst, VkDeviceSize dst_size, std::span<const VkBufferCopy2> regions, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access, bool last = true);
+
+        /**
+         * Have the pass wait for jobs filling its staging windows, such as reads or transcodes. Copies can be recorded
+         * before the data has arrived: finalize() waits for every job before the pass is submitted.
+         */
+        void await_reads(JobSystem::JobRef&& reads);
         void finalize();
     };
 
+    /**
+     * Staging memory shared by every pass in flight. Reservations bump the head with a single CAS; the tail follows
+     * behind as the transfers that read each reservation complete, in reservation order.
+     */
+    class StagingRing {
+        friend class SceneHost;
+        constexpr static size_t hardware_interference_size = 64;
+
+        // Head and tail pack a reservation sequence number above a byte position. Both wrap; only differences count.
+        constexpr static int POSITION_BITS = 40;
+        constexpr static uint64_t POSITION_MASK = (uint64_t(1) << POSITION_BITS) - 1;
+        constexpr static uint64_t SEQUENCE_MASK = (uint64_t(1) << (64 - POSITION_BITS)) - 1;
+        constexpr static size_t RECORD_COUNT = 256;
+        static_assert(std::has_single_bit(STAGING_RING_SIZE) && STAGING_RING_SIZE <= POSITION_MASK);
+
+        struct Record {
+            std::atomic<StagingBuffer*> owner; // null until the reservation is published
+            uint64_t serial;
+            uint64_t end;
+        };
+
+        VkBuffer m_buffer;
+        VmaAllocation m_mem;
+        std::span<std::byte> m_data;
+        alignas(hardware_interference_size) std::atomic_uint64_t m_head;
+        alignas(hardware_interference_size) std::atomic_uint64_t m_tail;
+        std::mutex m_reclaim_lock;
+        std::array<Record, RECORD_COUNT> m_records;
+
+        static inline uint64_t pack(uint64_t sequence, uint64_t position) { return ((sequence & SEQUENCE_MASK) << POSITION_BITS) | (position & POSITION_MASK); }
+        bool reclaim(const StagingBuffer* waiter, bool& blocked_by_waiter);
+
+    public:
+        StagingRing();
+        ~StagingRing();
+        std::optional<VkDeviceSize> reserve(VkDeviceSize size, StagingBuffer* owner);
+        void rearm(StagingBuffer& batch);
+    };
+
+    /**
+     * Schedule for staging a set of assets, and everything they depend on, over a scene's construct passes. Each
+     * asset's needs are measured once, then packed best-fit decreasing into passes of STAGING_PASS_BUDGET bytes, with
+     * no asset planned before anything it depends on. Assets too large for one pass stream through whatever space the
+     * plan leaves over.
+     */
+    class StagingPlan {
+        std::vector<IAsset*> m_assets; // sorted by address
+        std::vector<std::vector<size_t>> m_dependents;
+        std::vector<size_t> m_order; // every asset after the assets it depends on
+        std::vector<VkDeviceSize> m_remaining;
+        std::vector<size_t> m_pass;
+        std::vector<bool> m_done;
+        std::vector<bool> m_owned; // claimed by this plan; the rest are prepared by another scene's plan
+        size_t m_pass_count;
+
+    public:
+        StagingPlan(std::span<IAsset* const> roots);
+
+        /** Every asset in the plan, sorted by address. */
+        inline const std::vector<IAsset*>& assets() const { return m_assets; }
+        /** Passes planned for assets that fit in one; streaming larger assets may take more. */
+        inline size_t pass_count() const { return m_pass_count; }
+
+        /**
+         * Stage this pass's share of the plan, in parallel on the job system. An asset is prepared only after all of
+         * its dependents are fully staged, and each one gets its own window of the staging ring. Assets are marked
+         * ready at the ticket of the pass that finishes them.
+         * @return true once every asset has been completely staged, and every asset another plan is preparing will be
+         * ready by ticket.
+         */
+        bool stage(StagingBuffer& staging, size_t pass, uint64_t ticket);
+    };
+
 private:
     constexpr static int SIMULTANEOUS_FRAMES = DisplayHost::SIMULTANEOUS_FRAMES;
-    struct BQData {
-        IScene* scene;
-        bool bringup;
-    };
     struct RQData {
         IScene* scene;
         uint64_t ticket;
@@ -55,9 +170,8 @@ private:
 
     std::atomic<IScene*> m_active_scene;
     std::atomic_uint32_t m_frame_number = 0;
-    MPMCQ<BQData, 8> m_builder_queue;
     MPMCQ<RQData, 8> m_render_queue, m_return_queue;
-    MPMCQ<SDL_Event, 64> m_event_queue;
+    SPSCQ<SDL_Event, 64> m_event_queue;
 
     // Owned by scene thread
     using frame_number_t = uint32_t;
@@ -65,22 +179,57 @@ private:
     std::thread m_scene_host;
     std::unordered_map<IScene*, uint64_t> m_scenes;
     std::queue<std::pair<IScene*, frame_number_t>> m_purge_queue;
+    std::vector<JobSystem::JobRef> m_jobs;
+
+    // Mip streaming, one pass at a time. Images swapped out are destroyed once no frame in flight can sample them.
+    struct MipStream {
+        JobSystem::JobRef job;
+        uint64_t ticket;
+        std::vector<std::shared_ptr<asset::Image>> images;
+    };
+    std::unordered_map<asset::Image*, std::pair<std::shared_ptr<asset::Image>, uint32_t>> m_mip_requests;
+    std::optional<MipStream> m_mip_stream;
+    std::queue<std::pair<std::function<void()>, frame_number_t>> m_retired;
     std::atomic_uint64_t m_max_ticket;
     bool m_active;
 
+    // Draws recorded in parallel, a range per recorder. Each recorder has its own pool, so only one thread ever records
+    // into it; one set per frame in flight, read by the render thread once the frame is recorded.
+    struct DrawRecording {
+        uint32_t frame_number;
+        std::vector<std::pair<VkCommandPool, VkCommandBuffer>> recorders;
+        std::vector<VkCommandBuffer> commands; // in execution order
+        std::vector<size_t> subpass_ends; // where each subpass's commands end
+    };
+    std::array<DrawRecording, SIMULTANEOUS_FRAMES> m_draw_recordings;
+
     // Owned by render thread
+    struct RQTicketOrder {
+        bool operator()(const RQData& left, const RQData& right) const { return left.ticket > right.ticket; }
+    };
     std::unique_ptr<IRenderer> m_renderer;
     VkCommandPool m_xfer_command_pool, m_acquire_command_pool;
     VkSemaphore m_timeline;
     VkQueue m_graphics_queue, m_transfer_queue;
+    std::priority_queue<RQData, std::vector<RQData>, RQTicketOrder> m_unsignaled; // copies submitted, timeline not yet signaled
+    std::queue<RQData> m_in_flight;
+    uint64_t m_next_signal;
 
-    // Owned by worker threads
-    constexpr static int BUILDER_THREAD_COUNT = 2;
-    std::array<std::thread, BUILDER_THREAD_COUNT> m_builders;
-    std::array<StagingBuffer, BUILDER_THREAD_COUNT> m_staging_buffers;
+    // Each pass checks a staging buffer out of the free list; the render thread returns it once the timeline passes
+    // the pass's ticket.
+    constexpr static int STAGING_BUFFER_COUNT = 8;
+    StagingRing m_staging_ring;
+    std::array<StagingBuffer, STAGING_BUFFER_COUNT> m_staging_buffers;
+    MPMCQ<StagingBuffer*, STAGING_BUFFER_COUNT> m_free_staging_buffers;
 
     void scene_loop();
-    void builder_loop(int thread_id);
+    void bringup(IScene* scene, bool rebind = false);
+    void submit_copies(const RQData& job);
+    void signal_in_order();
+    void recycle_staging_buffers(uint64_t timeline_value);
+    void serve_mip_requests(uint32_t frame_number, uint64_t timeline_value);
+    void record_draws(IScene* scene, uint32_t frame_number);
+    void spawn(std::function<void()> work);
     SceneHost(IRenderer* renderer, IScene* initial);
 
 public:
@@ -93,11 +242,15 @@ public:
     ~SceneHost();
 
     static inline IRenderer* renderer() { return s_self->m_renderer.get(); }
+    /** The last frame the scene thread recorded, or 0 while the initial scene is being built. */
+    static inline uint32_t frame_number() { return s_self ? s_self->m_frame_number.load(std::memory_order_acquire) : 0; }
+    /** The last ticket the GPU has finished, or 0 while the initial scene is being built. */
+    static uint64_t timeline_value();
 
     /**
-     * Enqueue the scene for preparation.
+     * Start preparing the scene on the job system.
      * @warning only safe to call from the scene thread.
-     * @return false if the queue is full and the caller should try again.
+     * @return false if the host is shutting down.
      */
     static bool prepare(IScene* scene);
 
@@ -107,10 +260,18 @@ public:
      */
     static void set_next_scene(IScene* scene);
 
+    /**
+     * Ask for an image's mip chain to be streamed in down to level. Requests are served between frames, a pass of at
+     * most MIP_STREAM_BUDGET bytes at a time; an image that doesn't fit in one pass carries on over the next ones.
+     * @warning only safe to call from the scene thread.
+     */
+    static void stream_mips(asset::Image* image, uint32_t level);
+
     static void wait_frame(uint32_t frame_number);
     static void push_event(SDL_Event*);
     static void submit_transfers();
 
+    static void execute_computes(VkCommandBuffer container, uint32_t frame_number);
     static void execute_draws(VkCommandBuffer container, uint32_t frame_number, int subpass);
 };
 
@@ -129,10 +290,29 @@ public:
     virtual void tick(uint64_t frame_time, uint64_t delta_time, SceneHost*) = 0;
     virtual void record_commands(IRenderer*, uint32_t frame_number) = 0;
 
-    virtual std::span<VkCommandBuffer> draw_commands(uint32_t frame_number, int subpass) = 0;
+    /** Secondary buffers to execute in a subpass, ahead of whatever record_draws() recorded for it. */
+    virtual std::span<VkCommandBuffer> draw_commands(uint32_t frame_number, int subpass) { return {}; }
+    /** How many draws the scene has for a subpass this frame, for SceneHost to split between record_draws() calls. */
+    virtual size_t draw_count(IRenderer*, uint32_t frame_number, int subpass) { return 0; }
+    /**
+     * Record count draws, starting at first, into a secondary buffer that continues subpass. Called after
+     * record_commands(), for several ranges at once on the job system: nothing is inherited from other ranges, so bind
+     * everything the draws use, and only read state shared between them.
+     */
+    virtual void record_draws(IRenderer*, VkCommandBuffer cmd, uint32_t frame_number, int subpass, size_t first, size_t count) { }
+    /** Work recorded outside of the render pass, ahead of the draws: compute passes that the draws consume. */
+    virtual std::span<VkCommandBuffer> compute_commands(uint32_t frame_number) { return {}; }
+
+    /** The assets the scene draws with. They are kept resident while it is active; see Residency. */
+    virtual void push_assets(std::vector<IAsset*>&) const { }
+    /**
+     * Stage again whichever of the scene's assets were evicted while it was inactive, and rewrite anything that refers
+     * to them. Called like construct(), before the host switches to the scene.
+     */
+    virtual bool rebind(IRenderer* renderer, SceneHost::StagingBuffer& buffer, size_t pass, size_t ticket) { return true; }
 };
 
-class IAsset {
+class IAsset : public std::enable_shared_from_this<IAsset> {
 public:
     enum class Type {
         Image,
@@ -142,67 +322,281 @@ public:
 
 protected:
     std::variant<std::shared_ptr<void>, uint64_t> m_prepared;
+    std::atomic_bool m_claimed;
+    std::atomic_bool m_evicted;
+    std::atomic_uint64_t m_ready;
+    std::atomic_uint32_t m_last_used; // frame number
+    std::atomic_uint32_t m_generation; // bumped whenever the asset is prepared or evicted
+    // Held while the asset is evicted, and by anything that starts writing to its memory outside of a staging plan.
+    mutable std::mutex m_residency_lock;
+
+    IAsset()
+        : m_claimed(false)
+        , m_evicted(false)
+        , m_ready(UINT64_MAX)
+        , m_last_used(0)
+        , m_generation(0)
+    {
+    }
 
-    IAsset() { }
+    /** Free the asset's device memory. */
+    virtual void release() { }
+    /** Get an evicted asset ready to be prepared again. */
+    virtual void reload() { }
 
 public:
     virtual ~IAsset() { }
     virtual Type type() const = 0;
 
+    /**
+     * Claim the preparation of this asset. Assets can be shared between scenes that are built at the same time; only
+     * the staging plan that claims an asset prepares it, and the others wait for ready_ticket().
+     */
+    bool claim();
+    /** The timeline value after which the asset can be used, or UINT64_MAX until it has been prepared. */
+    inline uint64_t ready_ticket() const { return m_ready.load(std::memory_order_acquire); }
+    /**
+     * Block until the plan that claimed the asset has prepared it, or until it is evicted and left for another claim.
+     * @return ready_ticket(), which is UINT64_MAX if nobody has claimed the asset.
+     */
+    uint64_t wait_prepared() const;
+    inline uint32_t last_used() const { return m_last_used.load(std::memory_order_relaxed); }
+
+    /**
+     * Mark the asset, and everything it depends on, as used by a frame.
+     * @return false if any of them has been evicted.
+     */
+    bool touch(uint32_t frame_number);
+    /**
+     * Free the asset's device memory, leaving it to be prepared again by the next plan that claims it.
+     * @return false if transfers may still write to it past timeline_value, and it was left alone.
+     */
+    bool evict(uint64_t timeline_value);
+
     virtual void push_dependents(std::queue<IAsset*>&) const { }
+    /** Device memory the asset holds, for Residency to account. */
+    virtual void push_allocations(std::vector<VmaAllocation>&) const { }
+    /** The timeline value until which transfers may still write to the asset's memory. */
+    virtual uint64_t busy_until() const { return ready_ticket(); }
+
+    /** Staging space still needed to finish preparing this asset. */
     virtual size_t prepare_needs() const = 0;
-    virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset) = 0;
+    /**
+     * How much of prepare_needs() the next prepare() can stage within budget, in whole chunks. No chunk is larger than
+     * STAGING_PASS_BUDGET, so an asset always makes progress in an empty pass.
+     */
+    virtual size_t prepare_next(VkDeviceSize budget) const = 0;
+    /**
+     * Stage the next size bytes, as promised by prepare_next(), at offset in the staging ring. Called once per pass,
+     * possibly with size 0, until prepare_needs() is 0; must do nothing once there is nothing left to do.
+     * @return the number of bytes staged.
+     */
+    virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset, VkDeviceSize size) = 0;
     void post_prepare(uint64_t ready);
 };
 
+/**
+ * Interns assets by type and path, so every scene that loads a file shares one copy of it, and a scene only uploads
+ * what no other live scene already has. The registry holds weak references: assets live as long as a scene uses them.
+ */
+class AssetRegistry final {
+    static std::mutex s_lock;
+    static std::map<std::pair<IAsset::Type, std::string>, std::weak_ptr<IAsset>> s_assets;
+
+public:
+    /**
+     * The asset of type T known as key, constructed from args (or from key, without args) if nobody holds it yet.
+     */
+    template <typename T, typename... Args>
+    static std::shared_ptr<T> get(std::string_view key, Args&&... args)
+    {
+        std::pair<IAsset::Type, std::string> id(T::TYPE, key);
+        {
+            std::lock_guard lock(s_lock);
+            auto it = s_assets.find(id);
+            if (it != s_assets.end()) {
+                if (std::shared_ptr<IAsset> asset = it->second.lock())
+                    return std::static_pointer_cast<T>(asset);
+            }
+        }
+
+        // Constructing an asset can load its dependencies through the registry, so it happens outside the lock.
+        std::shared_ptr<T> made;
+        if constexpr (sizeof...(Args) == 0)
+            made = std::make_shared<T>(key);
+        else
+            made = std::make_shared<T>(std::forward<Args>(args)...);
+
+        std::lock_guard lock(s_lock);
+        std::erase_if(s_assets, [](const auto& entry) { return entry.second.expired(); });
+        std::weak_ptr<IAsset>& slot = s_assets[id];
+        if (std::shared_ptr<IAsset> raced = slot.lock())
+            return std::static_pointer_cast<T>(raced);
+        slot = made;
+        return made;
+    }
+
+    /** Every asset still alive. */
+    static void collect(std::vector<std::shared_ptr<IAsset>>& assets);
+};
+
+/**
+ * Keeps assets within the device memory budgets VMA reports. Once a heap's usage passes HIGH_WATER of its budget, the
+ * least recently used assets that no frame in flight can still need are evicted until it is back under LOW_WATER.
+ * Scenes that were built from evicted assets rebind them before they are switched to.
+ */
+class Residency final {
+    static std::mutex s_lock;
+    static void evict(std::array<int64_t, VK_MAX_MEMORY_HEAPS>& excess, uint32_t frame_number);
+
+public:
+    constexpr static double HIGH_WATER = 0.9, LOW_WATER = 0.8;
+    // Frames in flight, plus the one being recorded and the one being presented.
+    constexpr static uint32_t MIN_IDLE_FRAMES = DisplayHost::SIMULTANEOUS_FRAMES + 2;
+
+    /**
+     * Mark the scene's assets used by a frame, so they won't be evicted while it is on screen.
+     * @return false if any were evicted, and the scene has to rebind them first.
+     */
+    static bool touch(const IScene* scene, uint32_t frame_number);
+    /** Evict whatever it takes to bring every heap back within budget. Called once a frame by the scene thread. */
+    static void trim(uint32_t frame_number);
+    /** Evict whatever it takes to allocate size more bytes of device-local memory within budget. */
+    static void make_room(VkDeviceSize size);
+};
+
 namespace asset {
 
+    /**
+     * Image loaded from a KTX2 file. Only the tail of its mip chain, the levels within MIP_TAIL_SIZE, is staged with
+     * the scene; finer levels are streamed in on request (see SceneHost::stream_mips) into a new image, over as many
+     * passes as it takes, which replaces this one once every level has landed. The view's base level is the image's
+     * finest resident mip, so sampling never reaches a level that isn't there.
+     */
     class Image final : public IAsset {
+        std::string m_path;
         VkImage m_image;
         VmaAllocation m_mem;
-        VkImageView m_image_view;
+        std::atomic<VkImageView> m_image_view;
+        std::atomic_uint32_t m_picturebook_slot; // for as long as the image is resident
+        uint32_t m_base_level; // the level of the full chain that m_image starts at
+        uint32_t m_level_count; // of the full chain
+
+        // Finer levels on their way in. The prep is kept for as long as there are levels left to stream.
+        std::shared_ptr<void> m_stream_prep;
+        std::atomic_bool m_streaming;
+        struct {
+            VkImage image;
+            VmaAllocation mem;
+            VkImageView view;
+            VkImageCreateInfo image_info;
+            uint32_t base_level;
+            size_t next_chunk, end; // how far staging has got through the chain down to base_level
+            VkDeviceSize planned; // what the next stream() stages
+        } m_next;
+
+    protected:
+        virtual void release() override;
+        virtual void reload() override;
 
     public:
-        Image();
+        constexpr static Type TYPE = IAsset::Type::Image;
+        Image(std::string_view path);
         ~Image();
-        inline virtual Type type() const override { return IAsset::Type::Image; }
+        inline virtual Type type() const override { return TYPE; }
+        constexpr static VkDeviceSize MIP_TAIL_SIZE = 1 << 16;
         inline VkImage handle() const { return m_image; }
-        inline VkImageView view() const { return m_image_view; }
-
+        inline VkImageView view() const { return m_image_view.load(std::memory_order_acquire); }
+        /** Where the image is in the picture book, or UINT32_MAX if it isn't resident. */
+        inline uint32_t picturebook_slot() const { return m_picturebook_slot.load(std::memory_order_acquire); }
+        inline uint32_t base_level() const { return m_base_level; }
+        inline uint32_t level_count() const { return m_level_count; }
+
+        /**
+         * Plan the next pass of a stream down to level, starting one if none is under way; a stream under way carries
+         * on towards the level it started for.
+         * @return the staging space the pass takes within budget, or 0 if there is nothing to stream or no room for it.
+         */
+        size_t plan_stream(uint32_t level, VkDeviceSize budget);
+        /** Stage the planned pass into the new image at offset in the staging ring. */
+        void stream(SceneHost::StagingBuffer& commands, VkDeviceSize offset);
+        /**
+         * Switch to the streamed image once the transfer of its last pass has landed.
+         * @return what destroys the image it replaces, once no frame can sample it, or nothing if the stream needs more
+         * passes.
+         */
+        std::function<void()> land_stream();
+
+        virtual void push_allocations(std::vector<VmaAllocation>&) const override;
+        virtual uint64_t busy_until() const override;
         virtual size_t prepare_needs() const override;
-        virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset) override;
+        virtual size_t prepare_next(VkDeviceSize budget) const override;
+        virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset, VkDeviceSize size) override;
     };
 
     class Material : public IAsset {
         std::shared_ptr<Image> m_base_color_texture;
 
     public:
-        Material();
+        constexpr static Type TYPE = IAsset::Type::Material;
+        Material(std::string_view base_color_texture);
         ~Material();
-        inline virtual Type type() const override { return IAsset::Type::Material; }
+        inline virtual Type type() const override { return TYPE; }
 
         virtual void push_dependents(std::queue<IAsset*>&) const override;
         virtual size_t prepare_needs() const override;
-        virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset) override;
+        virtual size_t prepare_next(VkDeviceSize budget) const override;
+        virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset, VkDeviceSize size) override;
 
+        /** Or null, if the material has no texture. */
         Image* base_color_texture() const { return m_base_color_texture.get(); }
     };
 
+    /**
+     * Mesh loaded from a mesh container (see schemas/mesh.fbs). All vertex streams share one vertex buffer and are
+     * bound at the binding their semantic names.
+     */
     class Mesh final : public IAsset {
     public:
+        constexpr static uint32_t VERTEX_BINDING_COUNT = 5;
+        struct Submesh {
+            uint32_t first_index, index_count;
+            int32_t vertex_offset;
+            uint32_t material; // index into materials()
+            vec3s bounds_min, bounds_max;
+        };
+
+    private:
+        std::string m_path;
         VkBuffer m_vertex_buffer;
         VkBuffer m_index_buffer;
         VmaAllocation m_vertex_mem, m_index_mem;
+        VkIndexType m_index_type;
+        uint32_t m_binding_count;
+        std::array<VkDeviceSize, VERTEX_BINDING_COUNT> m_stream_offsets, m_stream_strides;
+        std::vector<Submesh> m_submeshes;
         std::vector<std::shared_ptr<Material>> m_materials;
 
+    protected:
+        virtual void release() override;
+        virtual void reload() override;
+
     public:
-        Mesh();
+        constexpr static Type TYPE = IAsset::Type::Mesh;
+        Mesh(std::string_view path);
         ~Mesh();
-        inline virtual Type type() const override { return IAsset::Type::Mesh; }
+        inline virtual Type type() const override { return TYPE; }
+        inline std::span<const Submesh> submeshes() const { return m_submeshes; }
+        inline const std::vector<std::shared_ptr<Material>>& materials() const { return m_materials; }
+
+        /** Bind the index buffer and every vertex stream. */
+        void bind_buffers(VkCommandBuffer cmd) const;
 
         virtual void push_dependents(std::queue<IAsset*>&) const override;
+        virtual void push_allocations(std::vector<VmaAllocation>&) const override;
         virtual size_t prepare_needs() const override;
-        virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset) override;
+        virtual size_t prepare_next(VkDeviceSize budget) const override;
+        virtual size_t prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset, VkDeviceSize size) override;
     };
 
 }
@@ -0,0 +1,268 @@
+#include "jobs.h"
+#include <algorithm>
+#include <SDL3/SDL_assert.h>
+#include <SDL3/SDL_log.h>
+
+namespace twogame {
+
+std::unique_ptr<JobSystem> JobSystem::s_self;
+thread_local int JobSystem::s_worker_index = -1;
+
+JobSystem::Job::Job(std::function<void()>&& work)
+    : m_work(std::move(work))
+    , m_pending(1)
+    , m_done(false)
+    , m_helpers(0)
+    , m_cancelled(false)
+    , m_task(false)
+{
+}
+
+JobSystem::JobSystem(unsigned worker_count)
+    : m_epoch(0)
+    , m_sleepers(0)
+    , m_waiting(0)
+    , m_running(true)
+{
+    m_workers.resize(worker_count);
+    for (unsigned i = 0; i < worker_count; i++) {
+        m_workers[i] = std::make_unique<Worker>();
+        m_workers[i]->rng = 0x9E3779B9u * (i + 1);
+    }
+    for (unsigned i = 0; i < worker_count; i++)
+        m_workers[i]->thread = std::thread(&JobSystem::worker_loop, this, i);
+    SDL_LogInfo(SDL_LOG_CATEGORY_SYSTEM, "job system: %u workers", worker_count);
+}
+
+JobSystem::~JobSystem()
+{
+    m_running.store(false, std::memory_order_seq_cst);
+    m_epoch.fetch_add(1, std::memory_order_seq_cst);
+    m_epoch.notify_all();
+    for (auto it = m_workers.begin(); it != m_workers.end(); ++it)
+        (*it)->thread.join();
+
+    // Anything still queued will never run. Cancel it, so nobody waits on it forever, and the jobs are freed.
+    Job* job;
+    for (auto it = m_workers.begin(); it != m_workers.end(); ++it) {
+        std::optional<Job*> left;
+        while ((left = (*it)->deque.pop()))
+            finish(*left, true);
+    }
+    while (m_injected.try_pop(job))
+        finish(job, true);
+    while (m_tasks.try_pop(job))
+        finish(job, true);
+    m_injected.close();
+    m_tasks.close();
+}
+
+void JobSystem::init()
+{
+    SDL_assert(!s_self);
+
+    // Leave room for the render and scene threads.
+    unsigned hardware_threads = std::thread::hardware_concurrency();
+    s_self = std::unique_ptr<JobSystem> { new JobSystem(std::max(2U, hardware_threads > 2 ? hardware_threads - 2 : 0)) };
+}
+
+void JobSystem::drop()
+{
+    SDL_assert(s_self);
+    s_self.reset();
+}
+
+void JobSystem::worker_loop(int index)
+{
+    s_worker_index = index;
+    while (m_running.load(std::memory_order_acquire)) {
+        Job* job = find_job(index, true);
+        if (job) {
+            execute(job);
+            continue;
+        }
+
+        // Look once more after reading the epoch: anything scheduled after this point bumps it and wakes us.
+        uint32_t epoch = m_epoch.load(std::memory_order_seq_cst);
+        if ((job = find_job(index, true))) {
+            execute(job);
+            continue;
+        }
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (m_running.load(std::memory_order_acquire))
+            SpinThenPark<>::wait(m_epoch, epoch);
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+JobSystem::Job* JobSystem::find_job(int index, bool tasks)
+{
+    Job* job;
+    if (index >= 0) {
+        if (auto own = m_workers[index]->deque.pop())
+            return *own;
+    }
+    if (m_injected.try_pop(job))
+        return job;
+
+    // Steal from the other workers, starting at a random victim.
+    uint32_t start = 0;
+    if (index >= 0) {
+        uint32_t& rng = m_workers[index]->rng;
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        start = rng;
+    }
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        size_t victim = (start + i) % m_workers.size();
+        if (static_cast<int>(victim) == index)
+            continue;
+        if (auto stolen = m_workers[victim]->deque.steal())
+            return *stolen;
+    }
+    if (tasks && m_tasks.try_pop(job))
+        return job;
+    return nullptr;
+}
+
+void JobSystem::schedule(JobRef&& job)
+{
+    Job* raw = job.get();
+    raw->m_self = std::move(job);
+
+    int index = s_worker_index;
+    if (raw->m_task) {
+        if (m_tasks.push(raw) == false) {
+            finish(raw, true);
+            return;
+        }
+    } else if (index < 0 || m_workers[index]->deque.push(raw) == false) {
+        if (m_injected.push(raw) == false) {
+            finish(raw, true);
+            return;
+        }
+    }
+
+    // Workers sleeping in wait() don't take tasks, so one of them could swallow the only wakeup meant for a task.
+    m_epoch.fetch_add(1, std::memory_order_seq_cst);
+    if (m_sleepers.load(std::memory_order_seq_cst) > 0) {
+        if (raw->m_task && m_waiting.load(std::memory_order_seq_cst) > 0)
+            m_epoch.notify_all();
+        else
+            m_epoch.notify_one();
+    }
+}
+
+void JobSystem::execute(Job* job)
+{
+    job->m_work();
+    finish(job, false);
+}
+
+void JobSystem::finish(Job* job, bool cancelled)
+{
+    job->m_work = nullptr;
+
+    JobRef self = std::move(job->m_self);
+    std::vector<JobRef> continuations;
+    {
+        std::lock_guard lock(job->m_lock);
+        job->m_cancelled = cancelled;
+        job->m_done.store(true, std::memory_order_seq_cst);
+        continuations.swap(job->m_continuations);
+    }
+    job->m_done.notify_all();
+    if (job->m_helpers.load(std::memory_order_seq_cst) > 0) {
+        m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        m_epoch.notify_all();
+    }
+
+    // A cancelled job's continuations are cancelled in turn: they would run without their prerequisite's results.
+    for (auto it = continuations.begin(); it != continuations.end(); ++it) {
+        if ((*it)->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (cancelled) {
+                Job* raw = it->get();
+                raw->m_self = std::move(*it);
+                finish(raw, true);
+            } else {
+                schedule(std::move(*it));
+            }
+        }
+    }
+}
+
+JobSystem::JobRef JobSystem::create(std::function<void()> work)
+{
+    return std::make_shared<Job>(std::move(work));
+}
+
+void JobSystem::depend(const JobRef& job, const JobRef& prerequisite)
+{
+    std::lock_guard lock(prerequisite->m_lock);
+    if (prerequisite->m_done.load(std::memory_order_relaxed))
+        return;
+
+    job->m_pending.fetch_add(1, std::memory_order_relaxed);
+    prerequisite->m_continuations.push_back(job);
+}
+
+void JobSystem::submit(const JobRef& job)
+{
+    if (job->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        s_self->schedule(JobRef { job });
+}
+
+JobSystem::JobRef JobSystem::spawn(std::function<void()> work)
+{
+    JobRef job = create(std::move(work));
+    submit(job);
+    return job;
+}
+
+JobSystem::JobRef JobSystem::spawn_task(std::function<void()> work)
+{
+    JobRef job = create(std::move(work));
+    job->m_task = true;
+    submit(job);
+    return job;
+}
+
+void JobSystem::wait(const JobRef& job)
+{
+    int index = s_worker_index;
+    if (index < 0) {
+        while (job->done() == false)
+            SpinThenPark<>::wait(job->m_done, false);
+        return;
+    }
+
+    // A task can block on something this wait holds up, so it's left for idle workers, unless the job is one itself.
+    // With nothing to run, sleep on the epoch like an idle worker: new work wakes us, and so does the job finishing.
+    JobSystem* self = s_self.get();
+    bool tasks = job->m_task;
+    while (job->done() == false) {
+        Job* next = self->find_job(index, tasks);
+        if (next) {
+            self->execute(next);
+            continue;
+        }
+
+        uint32_t epoch = self->m_epoch.load(std::memory_order_seq_cst);
+        job->m_helpers.fetch_add(1, std::memory_order_seq_cst);
+        if ((next = self->find_job(index, tasks))) {
+            job->m_helpers.fetch_sub(1, std::memory_order_relaxed);
+            self->execute(next);
+            continue;
+        }
+        self->m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        self->m_waiting.fetch_add(1, std::memory_order_seq_cst);
+        if (job->m_done.load(std::memory_order_seq_cst) == false)
+            SpinThenPark<>::wait(self->m_epoch, epoch);
+        self->m_waiting.fetch_sub(1, std::memory_order_relaxed);
+        self->m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        job->m_helpers.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+}
@@ -5,6 +5,7 @@
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_main.h>
 #include "display.h"
+#include "pack.h"
 #include "physfs.h"
 #include "scene.h"
 #define APP_NAME "twogame demo"
@@ -14,27 +15,29 @@
 
 class DuckScene : public twogame::IScene {
     // These come from the shader
-    struct ObjectData { };
     struct MaterialData {
         uint32_t base_color_texture;
     };
 
-    std::array<VkBuffer, 2> m_object_buffer, m_model_buffer;
-    std::array<VmaAllocation, 2> m_object_mem, m_model_mem;
-    std::array<std::span<ObjectData>, 2> m_object_data;
-    std::array<std::span<mat4s>, 2> m_model_data;
-    VkBuffer m_material_buffer;
-    VmaAllocation m_material_mem;
-    std::span<MaterialData> m_material_data;
+    // Handles are null until construct() creates them, so a scene torn down mid-bringup destroys only what it has.
+    std::array<VkCommandPool, SIMULTANEOUS_FRAMES> m_cull_cmd_pool {};
+    std::array<std::array<VkCommandBuffer, 1>, SIMULTANEOUS_FRAMES> m_cull_cmd;
+    std::array<VkDeviceAddress, SIMULTANEOUS_FRAMES> m_material_address; // in the frame's transient memory
 
-    std::array<VkCommandPool, SIMULTANEOUS_FRAMES> m_draw_cmd_pool;
-    std::array<std::array<VkCommandBuffer, 1>, SIMULTANEOUS_FRAMES> m_draw_cmd;
-    VkDescriptorPool m_picturebook_pool;
-    VkDescriptorSet m_picturebook;
+    // The finest mip each image was sampled at, as the shader reports it by picture book slot: see basic.frag.
+    constexpr static uint32_t MIP_FEEDBACK_BIAS = 16;
+    std::array<VkBuffer, SIMULTANEOUS_FRAMES> m_mip_feedback_buffer {};
+    std::array<VmaAllocation, SIMULTANEOUS_FRAMES> m_mip_feedback_mem {};
+    std::array<std::span<uint32_t>, SIMULTANEOUS_FRAMES> m_mip_feedback;
 
     std::vector<std::shared_ptr<twogame::IAsset>> m_assets;
     std::vector<twogame::asset::Image*> m_images;
     std::vector<twogame::asset::Material*> m_materials;
+    std::vector<uint32_t> m_submesh_materials; // index into m_materials
+    std::unique_ptr<twogame::SceneHost::StagingPlan> m_staging_plan;
+
+    void construct_once();
+    void read_mip_feedback(uint32_t frame_number);
 
 public:
     DuckScene()
@@ -47,22 +50,23 @@ public:
     virtual void tick(uint64_t frame_time, uint64_t delta_time, twogame::SceneHost* stage);
     virtual void record_commands(twogame::IRenderer* renderer, uint32_t frame_number);
 
-    virtual std::span<VkCommandBuffer> draw_commands(uint32_t frame_number, int subpass);
+    virtual std::span<VkCommandBuffer> compute_commands(uint32_t frame_number);
+    virtual size_t draw_count(twogame::IRenderer* renderer, uint32_t frame_number, int subpass);
+    virtual void record_draws(twogame::IRenderer* renderer, VkCommandBuffer cmd, uint32_t frame_number, int subpass, size_t first, size_t count);
+
+    virtual void push_assets(std::vector<twogame::IAsset*>& assets) const;
+    virtual bool rebind(twogame::IRenderer* renderer, twogame::SceneHost::StagingBuffer& staging, size_t pass, size_t ticket);
 };
 
 DuckScene::~DuckScene()
 {
-    vmaDestroyBuffer(twogame::DisplayHost::allocator(), m_object_buffer[0], m_object_mem[0]);
-    vmaDestroyBuffer(twogame::DisplayHost::allocator(), m_object_buffer[1], m_object_mem[1]);
-    vmaDestroyBuffer(twogame::DisplayHost::allocator(), m_model_buffer[0], m_model_mem[0]);
-    vmaDestroyBuffer(twogame::DisplayHost::allocator(), m_model_buffer[1], m_model_mem[1]);
-    vmaDestroyBuffer(twogame::DisplayHost::allocator(), m_material_buffer, m_material_mem);
-    vkDestroyDescriptorPool(twogame::DisplayHost::device(), m_picturebook_pool, nullptr);
-    for (auto it = m_draw_cmd_pool.begin(); it != m_draw_cmd_pool.end(); ++it)
+    for (size_t i = 0; i < SIMULTANEOUS_FRAMES; i++)
+        vmaDestroyBuffer(twogame::DisplayHost::allocator(), m_mip_feedback_buffer[i], m_mip_feedback_mem[i]);
+    for (auto it = m_cull_cmd_pool.begin(); it != m_cull_cmd_pool.end(); ++it)
         vkDestroyCommandPool(twogame::DisplayHost::device(), *it, nullptr);
 }
 
-bool DuckScene::construct(twogame::IRenderer* renderer, twogame::SceneHost::StagingBuffer& staging, size_t pass, size_t ticket)
+void DuckScene::construct_once()
 {
     VkCommandPoolCreateInfo cmd_pool_ci {};
     cmd_pool_ci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -72,47 +76,32 @@ bool DuckScene::construct(twogame::IRenderer* renderer, twogame::SceneHost::Stag
     VkCommandBufferAllocateInfo cmd_buffer_ci {};
     cmd_buffer_ci.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     cmd_buffer_ci.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
-    cmd_buffer_ci.commandBufferCount = m_draw_cmd[0].size();
+    cmd_buffer_ci.commandBufferCount = m_cull_cmd[0].size();
     for (size_t i = 0; i < SIMULTANEOUS_FRAMES; i++) {
-        VK_DEMAND(vkCreateCommandPool(twogame::DisplayHost::device(), &cmd_pool_ci, nullptr, &m_draw_cmd_pool[i]));
+        VK_DEMAND(vkCreateCommandPool(twogame::DisplayHost::device(), &cmd_pool_ci, nullptr, &m_cull_cmd_pool[i]));
 
-        cmd_buffer_ci.commandPool = m_draw_cmd_pool[i];
-        VK_DEMAND(vkAllocateCommandBuffers(twogame::DisplayHost::device(), &cmd_buffer_ci, m_draw_cmd[i].data()));
+        cmd_buffer_ci.commandPool = m_cull_cmd_pool[i];
+        VK_DEMAND(vkAllocateCommandBuffers(twogame::DisplayHost::device(), &cmd_buffer_ci, m_cull_cmd[i].data()));
     }
 
-    VkDescriptorPoolCreateInfo descriptor_pool_ci {};
-    VkDescriptorPoolSize descriptor_pool_size;
-    descriptor_pool_ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    descriptor_pool_ci.maxSets = 1;
-    descriptor_pool_ci.poolSizeCount = 1;
-    descriptor_pool_ci.pPoolSizes = &descriptor_pool_size;
-    descriptor_pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    descriptor_pool_size.descriptorCount = twogame::IRenderer::PICTUREBOOK_CAPACITY;
-    VK_DEMAND(vkCreateDescriptorPool(twogame::DisplayHost::device(), &descriptor_pool_ci, nullptr, &m_picturebook_pool));
-
     // Load assets without constructing them yet. This is awkward. TODO improve it.
-    // Walk the scene for asset references, deduplicate them, and shove them all in this data structure:
-    m_assets.emplace_back(new twogame::asset::Mesh);
+    m_assets.push_back(twogame::AssetRegistry::get<twogame::asset::Mesh>("/data/duck.tgm"));
 
-    std::set<twogame::IAsset*> all_assets;
-    std::queue<twogame::IAsset*> asset_search_queue;
+    std::vector<twogame::IAsset*> roots;
     for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
-        asset_search_queue.push(it->get());
-    while (asset_search_queue.empty() == false) {
-        if (all_assets.insert(asset_search_queue.front()).second)
-            asset_search_queue.front()->push_dependents(asset_search_queue);
-        asset_search_queue.pop();
-    }
+        roots.push_back(it->get());
+    m_staging_plan = std::make_unique<twogame::SceneHost::StagingPlan>(roots);
+}
 
-    std::priority_queue sorted_assets(all_assets.begin(), all_assets.end(), [](twogame::IAsset* left, twogame::IAsset* right) {
-        return left->prepare_needs() < right->prepare_needs();
-    });
-    // TODO sort into buckets. Descending order, best-fit. PQ gives us this order.
-    size_t staging_offset = 0;
-    while (sorted_assets.empty() == false) {
-        staging_offset += sorted_assets.top()->prepare(staging, staging_offset);
-        sorted_assets.pop();
-    }
+bool DuckScene::construct(twogame::IRenderer* renderer, twogame::SceneHost::StagingBuffer& staging, size_t pass, size_t ticket)
+{
+    if (pass == 0)
+        construct_once();
+
+    // Assets are staged over as many passes as the plan needs; the rest of the scene is built on the last one.
+    if (m_staging_plan->stage(staging, pass, ticket) == false)
+        return false;
+    const std::vector<twogame::IAsset*>& all_assets = m_staging_plan->assets();
 
     // Because all_assets is sorted, insertion in this way preserves sorted order
     for (auto it = all_assets.begin(); it != all_assets.end(); ++it) {
@@ -128,63 +117,71 @@ bool DuckScene::construct(twogame::IRenderer* renderer, twogame::SceneHost::Stag
         }
     }
 
-    uint32_t image_count = m_images.size();
-    VkDescriptorSetAllocateInfo descriptor_set_ci {};
-    VkDescriptorSetVariableDescriptorCountAllocateInfo descriptor_variable_ci {};
-    descriptor_set_ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptor_set_ci.pNext = &descriptor_variable_ci;
-    descriptor_set_ci.descriptorPool = m_picturebook_pool;
-    descriptor_set_ci.descriptorSetCount = 1;
-    descriptor_set_ci.pSetLayouts = &renderer->picturebook_descriptor_layout();
-    descriptor_variable_ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO;
-    descriptor_variable_ci.descriptorSetCount = 1;
-    descriptor_variable_ci.pDescriptorCounts = &image_count;
-    VK_DEMAND(vkAllocateDescriptorSets(twogame::DisplayHost::device(), &descriptor_set_ci, &m_picturebook));
+    auto mesh = static_cast<twogame::asset::Mesh*>(m_assets[0].get());
+    for (auto it = mesh->submeshes().begin(); it != mesh->submeshes().end(); ++it) {
+        auto material = std::lower_bound(m_materials.begin(), m_materials.end(), mesh->materials()[it->material].get());
+        m_submesh_materials.push_back(std::distance(m_materials.begin(), material));
+    }
 
     VkBufferCreateInfo buffer_ci {};
     VmaAllocationCreateInfo alloc_ci {};
     VmaAllocationInfo alloc_info;
     buffer_ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    buffer_ci.size = 0;
+    buffer_ci.size = renderer->picturebook_capacity() * sizeof(uint32_t);
     buffer_ci.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
     buffer_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    alloc_ci.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
-    alloc_ci.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
-    m_object_buffer.fill(VK_NULL_HANDLE);
-    m_object_mem.fill(VK_NULL_HANDLE);
-    buffer_ci.size = /* total instances **/ sizeof(mat4);
-    VK_DEMAND(vmaCreateBuffer(twogame::DisplayHost::allocator(), &buffer_ci, &alloc_ci, &m_model_buffer[0], &m_model_mem[0], &alloc_info));
-    m_model_data[0] = std::span(static_cast<mat4s*>(alloc_info.pMappedData), 1);
-    VK_DEMAND(vmaCreateBuffer(twogame::DisplayHost::allocator(), &buffer_ci, &alloc_ci, &m_model_buffer[1], &m_model_mem[1], &alloc_info));
-    m_model_data[1] = std::span(static_cast<mat4s*>(alloc_info.pMappedData), 1);
-    buffer_ci.size = std::max(64UL, m_materials.size() * sizeof(MaterialData));
-    VK_DEMAND(vmaCreateBuffer(twogame::DisplayHost::allocator(), &buffer_ci, &alloc_ci, &m_material_buffer, &m_material_mem, &alloc_info));
-    m_material_data = std::span(static_cast<MaterialData*>(alloc_info.pMappedData), m_materials.size());
-    for (size_t i = 0; i < m_materials.size(); i++) {
-        auto it = std::lower_bound(m_images.begin(), m_images.end(), m_materials[i]->base_color_texture());
-        SDL_assert(*it == m_materials[i]->base_color_texture());
-        m_material_data[i].base_color_texture = std::distance(m_images.begin(), it);
+    alloc_ci.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    alloc_ci.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    for (size_t i = 0; i < SIMULTANEOUS_FRAMES; i++) {
+        VK_DEMAND(vmaCreateBuffer(twogame::DisplayHost::allocator(), &buffer_ci, &alloc_ci, &m_mip_feedback_buffer[i], &m_mip_feedback_mem[i], &alloc_info));
+        m_mip_feedback[i] = std::span(static_cast<uint32_t*>(alloc_info.pMappedData), renderer->picturebook_capacity());
+        std::fill(m_mip_feedback[i].begin(), m_mip_feedback[i].end(), UINT32_MAX);
+        vmaFlushAllocation(twogame::DisplayHost::allocator(), m_mip_feedback_mem[i], 0, VK_WHOLE_SIZE);
     }
 
-    // All assets need to be prepared before creating the picture book, bound to descriptor set 2.
-    VkWriteDescriptorSet picturebook_write {};
-    std::vector<VkDescriptorImageInfo> picturebook_writes(m_images.size());
-    for (size_t i = 0; i < m_images.size(); i++) {
-        picturebook_writes[i].sampler = renderer->sampler();
-        picturebook_writes[i].imageView = m_images[i]->view();
-        picturebook_writes[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    m_staging_plan.reset();
+    return true;
+}
+
+void DuckScene::read_mip_feedback(uint32_t frame_number)
+{
+    // Written by the last frame that used this buffer, which has completed. The feedback is only a hint, so a frame
+    // that streamed in mips since then at worst asks for what it already has.
+    std::span<uint32_t> feedback = m_mip_feedback[frame_number % SIMULTANEOUS_FRAMES];
+    vmaInvalidateAllocation(twogame::DisplayHost::allocator(), m_mip_feedback_mem[frame_number % SIMULTANEOUS_FRAMES], 0, VK_WHOLE_SIZE);
+    for (auto it = m_images.begin(); it != m_images.end(); ++it) {
+        uint32_t slot = (*it)->picturebook_slot();
+        if (slot == UINT32_MAX || feedback[slot] == UINT32_MAX)
+            continue;
+
+        // The shader reports levels relative to the image's finest resident one; below zero means finer ones are wanted.
+        int64_t level = static_cast<int64_t>((*it)->base_level()) + feedback[slot] - MIP_FEEDBACK_BIAS;
+        if (level < (*it)->base_level())
+            twogame::SceneHost::stream_mips(*it, std::max<int64_t>(0, level));
+        feedback[slot] = UINT32_MAX;
     }
-    picturebook_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    picturebook_write.dstSet = m_picturebook;
-    picturebook_write.dstBinding = 0;
-    picturebook_write.descriptorCount = picturebook_writes.size();
-    picturebook_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    picturebook_write.pImageInfo = picturebook_writes.data();
-    vkUpdateDescriptorSets(twogame::DisplayHost::device(), 1, &picturebook_write, 0, nullptr);
+    vmaFlushAllocation(twogame::DisplayHost::allocator(), m_mip_feedback_mem[frame_number % SIMULTANEOUS_FRAMES], 0, VK_WHOLE_SIZE);
+}
 
-    for (auto it = all_assets.begin(); it != all_assets.end(); ++it) {
-        (*it)->post_prepare(ticket);
+void DuckScene::push_assets(std::vector<twogame::IAsset*>& assets) const
+{
+    for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
+        assets.push_back(it->get());
+}
+
+bool DuckScene::rebind(twogame::IRenderer* renderer, twogame::SceneHost::StagingBuffer& staging, size_t pass, size_t ticket)
+{
+    // Only evicted assets are claimed by the new plan; the rest are already resident. Mesh buffers and image views are
+    // looked up as commands are recorded, so there is nothing else to rewrite.
+    if (pass == 0) {
+        std::vector<twogame::IAsset*> roots;
+        push_assets(roots);
+        m_staging_plan = std::make_unique<twogame::SceneHost::StagingPlan>(roots);
     }
+    if (m_staging_plan->stage(staging, pass, ticket) == false)
+        return false;
+
+    m_staging_plan.reset();
     return true;
 }
 
@@ -198,31 +195,60 @@ void DuckScene::tick(uint64_t frame_time, uint64_t delta_time, twogame::SceneHos
 
 void DuckScene::record_commands(twogame::IRenderer* renderer, uint32_t frame_number)
 {
-    vkResetCommandPool(twogame::DisplayHost::device(), m_draw_cmd_pool[frame_number % SIMULTANEOUS_FRAMES], 0);
+    vkResetCommandPool(twogame::DisplayHost::device(), m_cull_cmd_pool[frame_number % SIMULTANEOUS_FRAMES], 0);
+    read_mip_feedback(frame_number);
 
     mat4 view;
     vec3 eye = { 0, 250, (float)frame_number - 500 }, toward = { 0, 100, 0 };
     glm_lookat(eye, toward, ((vec3) { 0, frame_number <= 500 ? 1.f : -1.f, 0 }), view);
 
-    memcpy(renderer->descriptor_buffer(frame_number, 0, 0).subspan(0, sizeof(mat4)).data(), renderer->projection().raw, sizeof(mat4));
-    memcpy(renderer->descriptor_buffer(frame_number, 0, 0).subspan(sizeof(mat4), sizeof(mat4)).data(), view, sizeof(mat4));
-    renderer->flush_descriptor_buffers();
+    std::span<std::byte> uniforms = renderer->frame_uniforms(frame_number);
+    memcpy(uniforms.subspan(0, sizeof(mat4)).data(), renderer->projection().raw, sizeof(mat4));
+    memcpy(uniforms.subspan(sizeof(mat4), sizeof(mat4)).data(), view, sizeof(mat4));
 
-    m_model_data[frame_number % SIMULTANEOUS_FRAMES][0] = GLMS_MAT4_IDENTITY;
-    vmaFlushAllocation(twogame::DisplayHost::allocator(), m_model_mem[frame_number % SIMULTANEOUS_FRAMES], 0, VK_WHOLE_SIZE);
+    // Materials point at their textures by picture book slot, which changes if a texture is evicted and loaded again.
+    twogame::IRenderer::Transient materials = renderer->allocate_transient(frame_number, std::max<size_t>(1, m_materials.size()) * sizeof(MaterialData));
+    MaterialData* material_data = reinterpret_cast<MaterialData*>(materials.data.data());
+    for (size_t i = 0; i < m_materials.size(); i++)
+        material_data[i].base_color_texture = m_materials[i]->base_color_texture() ? m_materials[i]->base_color_texture()->picturebook_slot() : UINT32_MAX;
+    m_material_address[frame_number % SIMULTANEOUS_FRAMES] = materials.address;
+    renderer->flush_transient(frame_number);
+
+    // Every submesh is an instance; the renderer batches them, and culls them on the GPU.
+    auto mesh = static_cast<twogame::asset::Mesh*>(m_assets[0].get());
+    for (uint32_t i = 0; i < mesh->submeshes().size(); i++)
+        renderer->push_instance(frame_number, mesh, i, m_submesh_materials[i], GLMS_MAT4_IDENTITY);
 
-    VkCommandBuffer cmd = m_draw_cmd[frame_number % SIMULTANEOUS_FRAMES][0];
     VkCommandBufferBeginInfo begin_info {};
     VkCommandBufferInheritanceInfo inherit_info {};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     begin_info.pInheritanceInfo = &inherit_info;
     inherit_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
-    inherit_info.renderPass = renderer->render_pass();
-    inherit_info.subpass = 0;
+    VkCommandBuffer cmd = m_cull_cmd[frame_number % SIMULTANEOUS_FRAMES][0];
     VK_DEMAND(vkBeginCommandBuffer(cmd, &begin_info));
+    renderer->record_cull(cmd, frame_number);
+    vkEndCommandBuffer(cmd);
+}
+
+std::span<VkCommandBuffer> DuckScene::compute_commands(uint32_t frame_number)
+{
+    return m_cull_cmd[frame_number % SIMULTANEOUS_FRAMES];
+}
+
+size_t DuckScene::draw_count(twogame::IRenderer* renderer, uint32_t frame_number, int subpass)
+{
+    switch (subpass) {
+    case 0:
+        return renderer->instance_runs(frame_number);
+    default:
+        std::abort();
+    }
+}
+
+void DuckScene::record_draws(twogame::IRenderer* renderer, VkCommandBuffer cmd, uint32_t frame_number, int subpass, size_t first, size_t count)
+{
     renderer->bind_pipeline(cmd, twogame::IRenderer::GraphicsPipeline::GPass, frame_number);
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, renderer->graphics_pipeline_layout(twogame::IRenderer::GraphicsPipeline::GPass), 2, 1, &m_picturebook, 0, nullptr);
 
     VkExtent2D swapchain_extent = twogame::DisplayHost::swapchain_extent();
     VkViewport viewport {};
@@ -238,34 +264,17 @@ void DuckScene::record_commands(twogame::IRenderer* renderer, uint32_t frame_num
     vkCmdSetViewport(cmd, 0, 1, &viewport);
     vkCmdSetScissor(cmd, 0, 1, &scissor);
 
+    // This share of whatever the cull pass kept: each draw's instances index their models and objects.
     VkBufferDeviceAddressInfo bda_info {};
-    std::array<VkDeviceAddress, 3> pod;
+    std::array<VkDeviceAddress, 4> pod;
     bda_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
-    bda_info.buffer = m_model_buffer[frame_number % SIMULTANEOUS_FRAMES];
-    pod[1] = vkGetBufferDeviceAddress(twogame::DisplayHost::device(), &bda_info);
-    bda_info.buffer = m_material_buffer;
-    pod[2] = vkGetBufferDeviceAddress(twogame::DisplayHost::device(), &bda_info);
-
-    auto mesh = static_cast<twogame::asset::Mesh*>(m_assets[0].get());
-    std::array<VkBuffer, 4> buffers = { mesh->m_vertex_buffer, mesh->m_vertex_buffer, mesh->m_vertex_buffer, mesh->m_vertex_buffer };
-    std::array<VkDeviceSize, 4> buffer_offs = { 28788, 0, 0, 57576 };
-    std::array<VkDeviceSize, 4> buffer_strides = { 12, 12, 0, 8 };
-    vkCmdBindIndexBuffer(cmd, mesh->m_index_buffer, 0, VK_INDEX_TYPE_UINT16);
-    vkCmdBindVertexBuffers2(cmd, 0, buffers.size(), buffers.data(), buffer_offs.data(), nullptr, buffer_strides.data());
+    pod[0] = renderer->instance_objects(frame_number);
+    pod[1] = renderer->instance_models(frame_number);
+    pod[2] = m_material_address[frame_number % SIMULTANEOUS_FRAMES];
+    bda_info.buffer = m_mip_feedback_buffer[frame_number % SIMULTANEOUS_FRAMES];
+    pod[3] = vkGetBufferDeviceAddress(twogame::DisplayHost::device(), &bda_info);
     vkCmdPushConstants(cmd, renderer->graphics_pipeline_layout(twogame::IRenderer::GraphicsPipeline::GPass), VK_SHADER_STAGE_ALL, 0, pod.size() * sizeof(VkDeviceAddress), pod.data());
-    vkCmdDrawIndexed(cmd, 12636, 1, 0, 0, 0);
-    vkEndCommandBuffer(cmd);
-}
-
-std::span<VkCommandBuffer> DuckScene::draw_commands(uint32_t frame_number, int subpass)
-{
-    auto& frame_commands = m_draw_cmd[frame_number % SIMULTANEOUS_FRAMES];
-    switch (subpass) {
-    case 0:
-        return std::span(frame_commands).subspan(0, 1);
-    default:
-        std::abort();
-    }
+    renderer->draw_instances(cmd, frame_number, first, count);
 }
 
 SDL_AppResult SDL_AppInit(void** _appstate, int argc, char** argv)
@@ -322,6 +331,8 @@ SDL_AppResult SDL_AppInit(void** _appstate, int argc, char** argv)
                 SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "failed to mount %s -> %s/: %s", fullpath, mountpoint, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
             } else {
                 SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "mounted %s -> %s/", fullpath, mountpoint);
+                if (twogame::PackFiles::mount(fullpath, mountpoint))
+                    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "mapped %s", fullpath);
             }
         }
     }
@@ -339,6 +350,8 @@ SDL_AppResult SDL_AppInit(void** _appstate, int argc, char** argv)
 
     try {
         twogame::DisplayHost::init();
+        twogame::JobSystem::init();
+        twogame::AsyncIO::init();
         twogame::SceneHost::init(new twogame::SimpleForwardRenderer, new DuckScene);
     } catch (...) {
         return SDL_APP_FAILURE;
@@ -365,7 +378,10 @@ SDL_AppResult SDL_AppIterate(void* _appstate)
 void SDL_AppQuit(void* _appstate, SDL_AppResult result)
 {
     twogame::SceneHost::drop();
+    twogame::AsyncIO::drop();
+    twogame::JobSystem::drop();
     twogame::DisplayHost::drop();
+    twogame::PackFiles::unmount_all();
     if (PHYSFS_isInit())
         PHYSFS_deinit();
     SDL_Quit();
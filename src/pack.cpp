@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <SDL3/SDL_assert.h>
+#include <SDL3/SDL_log.h>
+#include "pack.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace twogame {
+
+std::vector<PackFiles::Pack> PackFiles::s_packs;
+
+namespace {
+
+    constexpr uint32_t END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06054b50;
+    constexpr size_t END_OF_CENTRAL_DIRECTORY_SIZE = 22;
+
+    // With fd set, the descriptor is kept open for asynchronous reads of the same file; it stays -1 on Windows.
+    std::span<const uint8_t> map_file(const char* path, int* fd_out = nullptr)
+    {
+        if (fd_out)
+            *fd_out = -1;
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return {};
+        LARGE_INTEGER size;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (mapping == nullptr)
+            return {};
+        void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (data == nullptr)
+            return {};
+        return std::span(static_cast<const uint8_t*>(data), static_cast<size_t>(size.QuadPart));
+#else
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return {};
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED || fd_out == nullptr)
+            close(fd);
+        if (data == MAP_FAILED)
+            return {};
+        if (fd_out)
+            *fd_out = fd;
+        return std::span(static_cast<const uint8_t*>(data), static_cast<size_t>(st.st_size));
+#endif
+    }
+
+    void unmap_file(const uint8_t* data, size_t size, int fd = -1)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+#else
+        munmap(const_cast<uint8_t*>(data), size);
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+}
+
+bool PackFiles::mount(const char* path, std::string_view mountpoint)
+{
+    int fd;
+    std::span<const uint8_t> file = map_file(path, &fd);
+    if (file.empty())
+        return false;
+
+    // The trailer is the zip comment, so it ends the file, right after the end of central directory record.
+    pk2::Trailer trailer;
+    uint32_t signature;
+    bool indexed = file.size() >= END_OF_CENTRAL_DIRECTORY_SIZE + sizeof(trailer);
+    if (indexed) {
+        const uint8_t* eocd = file.data() + file.size() - sizeof(trailer) - END_OF_CENTRAL_DIRECTORY_SIZE;
+        memcpy(&signature, eocd, sizeof(signature));
+        memcpy(&trailer, eocd + END_OF_CENTRAL_DIRECTORY_SIZE, sizeof(trailer));
+        indexed = signature == END_OF_CENTRAL_DIRECTORY_SIGNATURE && trailer.magic == pk2::TRAILER_MAGIC && trailer.version == pk2::VERSION
+            && trailer.index_offset % alignof(pk2::IndexEntry) == 0 && trailer.index_size >= sizeof(pk2::IndexHeader)
+            && trailer.index_offset <= file.size() && trailer.index_size <= file.size() - trailer.index_offset;
+    }
+
+    Pack pack;
+    if (indexed) {
+        const uint8_t* index = file.data() + trailer.index_offset;
+        const pk2::IndexHeader* header = reinterpret_cast<const pk2::IndexHeader*>(index);
+        pack.entries = reinterpret_cast<const pk2::IndexEntry*>(index + sizeof(pk2::IndexHeader));
+        pack.entry_count = header->entry_count;
+        pack.names = reinterpret_cast<const char*>(pack.entries + header->entry_count);
+        indexed = header->magic == pk2::INDEX_MAGIC && header->version == pk2::VERSION
+            && sizeof(pk2::IndexHeader) + uint64_t(header->entry_count) * sizeof(pk2::IndexEntry) + header->names_size == trailer.index_size;
+        for (uint32_t i = 0; indexed && i < pack.entry_count; i++) {
+            const pk2::IndexEntry& entry = pack.entries[i];
+            indexed = entry.offset <= file.size() && entry.size <= file.size() - entry.offset
+                && uint64_t(entry.name_offset) + entry.name_size <= header->names_size;
+        }
+    }
+    if (indexed == false) {
+        SDL_LogDebug(SDL_LOG_CATEGORY_APPLICATION, "%s has no pack index, leaving it to PhysicsFS", path);
+        unmap_file(file.data(), file.size(), fd);
+        return false;
+    }
+
+    pack.mountpoint = mountpoint;
+    if (pack.mountpoint.ends_with('/') == false)
+        pack.mountpoint += '/';
+    pack.data = file.data();
+    pack.size = file.size();
+    pack.fd = fd;
+    s_packs.push_back(std::move(pack));
+    return true;
+}
+
+void PackFiles::unmount_all()
+{
+    for (auto it = s_packs.begin(); it != s_packs.end(); ++it)
+        unmap_file(it->data, it->size, it->fd);
+    s_packs.clear();
+}
+
+std::span<const uint8_t> PackFiles::find(std::string_view path, int* fd, uint64_t* fd_offset)
+{
+    for (auto it = s_packs.begin(); it != s_packs.end(); ++it) {
+        if (path.starts_with(it->mountpoint) == false)
+            continue;
+
+        std::string_view name = path.substr(it->mountpoint.size());
+        const char* names = it->names;
+        const pk2::IndexEntry* end = it->entries + it->entry_count;
+        const pk2::IndexEntry* entry = std::lower_bound(it->entries, end, name, [names](const pk2::IndexEntry& e, std::string_view name) {
+            return std::string_view(names + e.name_offset, e.name_size) < name;
+        });
+        if (entry != end && std::string_view(names + entry->name_offset, entry->name_size) == name) {
+            if (fd)
+                *fd = it->fd;
+            if (fd_offset)
+                *fd_offset = entry->offset;
+            return std::span(it->data + entry->offset, entry->size);
+        }
+    }
+    return {};
+}
+
+AssetFile::AssetFile(std::string_view path)
+    : m_fh(nullptr)
+    , m_owns_mapping(false)
+    , m_fd(-1)
+    , m_fd_offset(0)
+{
+    m_mapped = PackFiles::find(path, &m_fd, &m_fd_offset);
+    if (m_mapped.empty() == false)
+        return;
+
+    // A file in a mounted directory is a plain file on disk, so map it. PhysicsFS can say which directory it came
+    // from, and where that directory is mounted.
+    std::string_view real_dir = PHYSFS_getRealDir(path.data()) ? PHYSFS_getRealDir(path.data()) : "";
+    PHYSFS_Stat st;
+    if (real_dir.empty() == false && PHYSFS_stat(path.data(), &st) && st.filesize > 0) {
+        const char* mountpoint = PHYSFS_getMountPoint(real_dir.data());
+        std::string_view relative = path;
+        if (mountpoint && relative.starts_with(mountpoint))
+            relative.remove_prefix(strlen(mountpoint));
+        else if (mountpoint)
+            relative = {};
+        while (relative.starts_with('/'))
+            relative.remove_prefix(1);
+
+        std::string os_path(real_dir);
+        os_path += '/';
+        os_path += relative;
+        std::error_code ec;
+        if (relative.empty() == false && std::filesystem::is_directory(real_dir, ec) && std::filesystem::is_regular_file(os_path, ec)) {
+            m_mapped = map_file(os_path.c_str(), &m_fd);
+            m_owns_mapping = m_mapped.empty() == false;
+        }
+    }
+    if (m_mapped.empty()) {
+        m_fh = PHYSFS_openRead(path.data());
+        SDL_assert_release(m_fh != nullptr);
+    }
+}
+
+AssetFile::~AssetFile()
+{
+    if (m_fh)
+        PHYSFS_close(m_fh);
+    if (m_owns_mapping)
+        unmap_file(m_mapped.data(), m_mapped.size(), m_fd);
+}
+
+uint64_t AssetFile::size() const
+{
+    if (m_fh)
+        return PHYSFS_fileLength(m_fh);
+    return m_mapped.size();
+}
+
+void AssetFile::read(uint64_t offset, void* dst, size_t size) const
+{
+    if (m_fh == nullptr) {
+        SDL_assert_release(offset <= m_mapped.size() && size <= m_mapped.size() - offset);
+        memcpy(dst, m_mapped.data() + offset, size);
+    } else {
+        // PhysicsFS handles are not thread-safe, but an asset is only ever prepared by one job at a time.
+        PHYSFS_seek(m_fh, offset);
+        PHYSFS_sint64 rs = PHYSFS_readBytes(m_fh, dst, size);
+        SDL_assert_release(rs == static_cast<PHYSFS_sint64>(size));
+    }
+}
+
+void AssetFile::read_async(uint64_t offset, void* dst, size_t size, std::vector<AsyncIO::Read>& reads) const
+{
+    if (m_fd < 0 || AsyncIO::uses_io_uring() == false) {
+        read(offset, dst, size);
+        return;
+    }
+    SDL_assert_release(offset <= m_mapped.size() && size <= m_mapped.size() - offset);
+    reads.push_back({ m_fd, m_fd_offset + offset, dst, size });
+}
+
+}
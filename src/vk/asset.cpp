@@ -1,55 +1,201 @@
+#include <algorithm>
+#include <basisu_transcoder.h>
+#include <cinttypes>
+#include <filesystem>
 #include <ktx.h>
 #include <physfs.h>
+#include "mesh_generated.h"
+#include "pack.h"
 #include "scene.h"
 
 namespace twogame {
 
+std::mutex AssetRegistry::s_lock;
+std::map<std::pair<IAsset::Type, std::string>, std::weak_ptr<IAsset>> AssetRegistry::s_assets;
+std::mutex Residency::s_lock;
+
+bool IAsset::claim()
+{
+    if (m_claimed.exchange(true, std::memory_order_acq_rel))
+        return false;
+    if (m_evicted.load(std::memory_order_acquire)) {
+        reload();
+        m_evicted.store(false, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool IAsset::touch(uint32_t frame_number)
+{
+    bool resident = true;
+    std::queue<IAsset*> assets;
+    assets.push(this);
+    while (assets.empty() == false) {
+        IAsset* asset = assets.front();
+        assets.pop();
+        asset->m_last_used.store(frame_number, std::memory_order_relaxed);
+        resident = resident && asset->ready_ticket() != UINT64_MAX;
+        asset->push_dependents(assets);
+    }
+    return resident;
+}
+
+bool IAsset::evict(uint64_t timeline_value)
+{
+    // Checked again under the lock: a mip stream may have started since Residency picked the asset.
+    std::lock_guard lock(m_residency_lock);
+    if (busy_until() > timeline_value)
+        return false;
+
+    // Whoever claims the asset next reloads it; a plan that was counting on it being ready claims it too.
+    release();
+    m_evicted.store(true, std::memory_order_relaxed);
+    m_ready.store(UINT64_MAX, std::memory_order_relaxed);
+    m_claimed.store(false, std::memory_order_release);
+    m_generation.fetch_add(1, std::memory_order_release);
+    m_generation.notify_all();
+    return true;
+}
+
 void IAsset::post_prepare(uint64_t ready)
 {
     m_prepared = ready;
+    m_last_used.store(SceneHost::frame_number(), std::memory_order_relaxed);
+    m_ready.store(ready, std::memory_order_release);
+    m_generation.fetch_add(1, std::memory_order_release);
+    m_generation.notify_all();
 }
 
+uint64_t IAsset::wait_prepared() const
+{
+    // The generation is read first, so a change after the check below still wakes us.
+    while (true) {
+        uint32_t generation = m_generation.load(std::memory_order_acquire);
+        uint64_t ready = ready_ticket();
+        if (ready != UINT64_MAX || m_claimed.load(std::memory_order_acquire) == false)
+            return ready;
+        SpinThenPark<>::wait(m_generation, generation);
+    }
 }
 
-namespace twogame::asset {
+void AssetRegistry::collect(std::vector<std::shared_ptr<IAsset>>& assets)
+{
+    std::lock_guard lock(s_lock);
+    for (auto it = s_assets.begin(); it != s_assets.end(); ++it) {
+        if (std::shared_ptr<IAsset> asset = it->second.lock())
+            assets.push_back(std::move(asset));
+    }
+}
 
-namespace image {
+bool Residency::touch(const IScene* scene, uint32_t frame_number)
+{
+    std::vector<IAsset*> roots;
+    scene->push_assets(roots);
 
-    class ktx_mip_iterate_userdata {
-    private:
-        std::vector<VkBufferImageCopy2> m_regions;
-        uint32_t m_layer_count;
-        VkDeviceSize m_offset;
+    // Under the lock, so nothing can be evicted between checking the scene's assets and marking them used.
+    std::lock_guard lock(s_lock);
+    bool resident = true;
+    for (auto it = roots.begin(); it != roots.end(); ++it)
+        resident = (*it)->touch(frame_number) && resident;
+    return resident;
+}
 
-    public:
-        ktx_mip_iterate_userdata(VkImageCreateInfo& image_info, VkDeviceSize offset)
-            : m_layer_count(image_info.arrayLayers)
-            , m_offset(offset)
-        {
-            m_regions.reserve(m_layer_count);
+void Residency::trim(uint32_t frame_number)
+{
+    std::array<VmaBudget, VK_MAX_MEMORY_HEAPS> budgets;
+    std::array<int64_t, VK_MAX_MEMORY_HEAPS> excess {};
+    const VkPhysicalDeviceMemoryProperties* memory_properties;
+    bool over = false;
+    vmaGetHeapBudgets(DisplayHost::allocator(), budgets.data());
+    vmaGetMemoryProperties(DisplayHost::allocator(), &memory_properties);
+    for (uint32_t i = 0; i < memory_properties->memoryHeapCount; i++) {
+        if (budgets[i].usage > budgets[i].budget * HIGH_WATER) {
+            excess[i] = budgets[i].usage - static_cast<int64_t>(budgets[i].budget * LOW_WATER);
+            over = true;
         }
+    }
+    if (over)
+        evict(excess, frame_number);
+}
 
-        const std::vector<VkBufferImageCopy2>& regions() const { return m_regions; }
+void Residency::make_room(VkDeviceSize size)
+{
+    // The allocation could land in any device-local heap, so make room in all of them.
+    std::array<VmaBudget, VK_MAX_MEMORY_HEAPS> budgets;
+    std::array<int64_t, VK_MAX_MEMORY_HEAPS> excess {};
+    const VkPhysicalDeviceMemoryProperties* memory_properties;
+    bool over = false;
+    vmaGetHeapBudgets(DisplayHost::allocator(), budgets.data());
+    vmaGetMemoryProperties(DisplayHost::allocator(), &memory_properties);
+    for (uint32_t i = 0; i < memory_properties->memoryHeapCount; i++) {
+        if ((memory_properties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && budgets[i].usage + size > budgets[i].budget * HIGH_WATER) {
+            excess[i] = budgets[i].usage + size - static_cast<int64_t>(budgets[i].budget * LOW_WATER);
+            over = true;
+        }
+    }
+    if (over)
+        evict(excess, SceneHost::frame_number());
+}
 
-        void add_region(int miplevel, int face, int width, int height, int depth, ktx_uint64_t face_lod_size)
-        {
-            VkBufferImageCopy2& region = m_regions.emplace_back();
-            SDL_assert(face == 0);
-            region.sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2;
-            region.bufferOffset = m_offset;
-            region.bufferRowLength = 0;
-            region.bufferImageHeight = 0;
-            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            region.imageSubresource.mipLevel = miplevel;
-            region.imageSubresource.baseArrayLayer = face;
-            region.imageSubresource.layerCount = m_layer_count;
-            region.imageOffset = { 0, 0, 0 };
-            region.imageExtent.width = width;
-            region.imageExtent.height = height;
-            region.imageExtent.depth = depth;
-            m_offset += face_lod_size;
+void Residency::evict(std::array<int64_t, VK_MAX_MEMORY_HEAPS>& excess, uint32_t frame_number)
+{
+    std::vector<std::shared_ptr<IAsset>> assets;
+    AssetRegistry::collect(assets);
+    uint64_t timeline_value = SceneHost::timeline_value();
+    const VkPhysicalDeviceMemoryProperties* memory_properties;
+    vmaGetMemoryProperties(DisplayHost::allocator(), &memory_properties);
+
+    std::lock_guard lock(s_lock);
+
+    // Only assets whose copies have landed, and that no frame since MIN_IDLE_FRAMES ago has used, can go. Assets
+    // still being prepared, or streaming in more data, are busy until the timeline passes them.
+    std::vector<std::pair<uint32_t, IAsset*>> candidates;
+    for (auto it = assets.begin(); it != assets.end(); ++it) {
+        uint64_t busy = (*it)->busy_until();
+        uint32_t idle = frame_number - (*it)->last_used();
+        if (busy <= timeline_value && idle >= MIN_IDLE_FRAMES && idle < UINT32_MAX / 2)
+            candidates.emplace_back(idle, it->get());
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [](const auto& left, const auto& right) { return left.first > right.first; });
+
+    size_t evicted = 0;
+    VkDeviceSize freed = 0;
+    std::vector<VmaAllocation> allocations;
+    for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+        std::array<VkDeviceSize, VK_MAX_MEMORY_HEAPS> sizes {};
+        bool helps = false;
+        allocations.clear();
+        it->second->push_allocations(allocations);
+        for (auto jt = allocations.begin(); jt != allocations.end(); ++jt) {
+            VmaAllocationInfo info;
+            vmaGetAllocationInfo(DisplayHost::allocator(), *jt, &info);
+            uint32_t heap = memory_properties->memoryTypes[info.memoryType].heapIndex;
+            sizes[heap] += info.size;
+            helps = helps || excess[heap] > 0;
         }
-    };
+        if (helps == false || it->second->evict(timeline_value) == false)
+            continue;
+
+        evicted++;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            excess[i] -= sizes[i];
+            freed += sizes[i];
+        }
+        if (std::all_of(excess.begin(), excess.end(), [](int64_t e) { return e <= 0; }))
+            break;
+    }
+
+    if (evicted > 0)
+        SDL_LogDebug(SDL_LOG_CATEGORY_GPU, "residency: evicted %zu assets, %" PRIu64 " bytes", evicted, static_cast<uint64_t>(freed));
+    if (std::any_of(excess.begin(), excess.end(), [](int64_t e) { return e > 0; }))
+        SDL_LogDebug(SDL_LOG_CATEGORY_GPU, "residency: over budget with nothing left to evict");
+}
+
+}
+
+namespace twogame::asset {
+
+namespace image {
 
     ktxStream ktx_physfs_istream(PHYSFS_File* fh)
     {
@@ -107,85 +253,602 @@ namespace image {
             return KTX_SUCCESS;
         };
         stream.destruct = [](ktxStream* self) {
-            PHYSFS_File* fh = reinterpret_cast<PHYSFS_File*>(self->data.custom_ptr.address);
-            PHYSFS_close(fh);
+            // The handle belongs to the AssetFile it came from.
         };
         stream.data.custom_ptr.address = fh;
-        stream.closeOnDestruct = KTX_TRUE;
+        stream.closeOnDestruct = KTX_FALSE;
         return stream;
     }
 
-    static ktx_error_code_e ktx_mip_iterate(int miplevel, int face, int width, int height, int depth, ktx_uint64_t face_lod_size, void* pixels, void* userdata)
+    // One image of one mip level, array layer and cube face.
+    struct subimage {
+        uint32_t level, layer, face;
+        ktx_size_t data_offset, size; // into the file if the prep is direct, and into the loaded texture data otherwise
+    };
+
+    // The smallest unit an image is staged in: a whole subimage, or, if that is larger than MAX_CHUNK_SIZE, a run of its
+    // block rows or of the slices of a 3D level. Any chunk fits in a pass, so no texture is too large to stage.
+    constexpr VkDeviceSize MAX_CHUNK_SIZE = 1 << 22;
+    static_assert(MAX_CHUNK_SIZE <= SceneHost::MIP_STREAM_BUDGET && MAX_CHUNK_SIZE <= SceneHost::STAGING_PASS_BUDGET);
+    struct chunk {
+        uint32_t level, layer, face;
+        uint32_t subimage;
+        VkOffset3D offset; // the region of the level it covers
+        VkExtent3D extent;
+        bool first, last; // of the chunks of its level
+        ktx_size_t data_offset, size; // like the subimage's
+    };
+
+    // Where each level's data starts in a KTX2 file: the level index follows the 80-byte header.
+    constexpr uint64_t KTX2_LEVEL_INDEX_OFFSET = 80;
+    struct ktx2_level {
+        uint64_t byte_offset, byte_length, uncompressed_byte_length;
+    };
+
+    // Transcoded textures are cached in /pref/texcache, a file per level of each source file, target format and GPU: a
+    // header, then the level's subimages laid out like their data_offsets say. A source file is known by its path, size
+    // and modification time, so finding its cache doesn't mean reading it.
+    constexpr uint32_t TRANSCODE_CACHE_MAGIC = 0x43544754; // "TGTC"
+    constexpr uint32_t TRANSCODE_CACHE_VERSION = 3;
+    struct transcode_cache_header {
+        uint32_t magic, version;
+        uint64_t size; // of the whole file
+        uint64_t checksum; // of everything after the header
+    };
+    static_assert(sizeof(transcode_cache_header) == 24);
+
+    // Not cryptographic: just enough to tell one file from another, or a damaged copy from a good one.
+    uint64_t content_hash(std::span<const uint8_t> data)
     {
-        ktx_mip_iterate_userdata* mip_data = reinterpret_cast<ktx_mip_iterate_userdata*>(userdata);
-        mip_data->add_region(miplevel, face, width, height, depth, face_lod_size);
-        (void)(pixels);
-        return KTX_SUCCESS;
+        uint64_t h = 0xcbf29ce484222325 ^ data.size();
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, data.data() + i, sizeof(uint64_t));
+            h = (h ^ word) * 0x100000001b3;
+            h ^= h >> 32;
+        }
+        for (; i < data.size(); i++)
+            h = (h ^ data[i]) * 0x100000001b3;
+        return h;
     }
 
+    std::once_flag basisu_init;
+
+    // Basis Universal textures are transcoded a level at a time, and only once the level is staged, so levels that are
+    // never streamed are never transcoded. A level is loaded from the cache if an earlier run left it there, and cached
+    // as soon as it is transcoded otherwise. Every stream stages the coarser levels again, so levels stay in host
+    // memory until the prep goes, once the whole chain is resident. Jobs share the transcoder, each with its own state.
+    struct basis_transcoder {
+        enum : uint8_t {
+            LEVEL_PENDING,
+            LEVEL_BUSY,
+            LEVEL_DONE,
+        };
+
+        const AssetFile* file; // the source, which belongs to the prep; the prep outlives every pass that stages from it
+        std::vector<uint8_t> file_data; // a copy of the source, if it isn't mapped
+        std::once_flag started;
+        basist::ktx2_transcoder ktx2;
+        basist::transcoder_texture_format format;
+        std::string cache_path; // relative to the write dir, less the level
+        std::vector<subimage> subimages;
+        std::vector<uint64_t> level_sizes;
+        std::vector<std::vector<uint8_t>> levels;
+        std::unique_ptr<std::atomic_uint8_t[]> states; // per level
+
+        inline bool ready(uint32_t level) const { return states[level].load(std::memory_order_acquire) == LEVEL_DONE; }
+
+        // Make the level ready unless someone else already has, and return it.
+        std::span<const uint8_t> level(uint32_t level)
+        {
+            uint8_t state = LEVEL_PENDING;
+            if (states[level].compare_exchange_strong(state, LEVEL_BUSY, std::memory_order_acq_rel)) {
+                levels[level].resize(level_sizes[level]);
+                if (load_cache(level) == false) {
+                    transcode(level);
+                    write_cache(level);
+                }
+                states[level].store(LEVEL_DONE, std::memory_order_release);
+                states[level].notify_all();
+            } else {
+                while ((state = states[level].load(std::memory_order_acquire)) != LEVEL_DONE)
+                    states[level].wait(state, std::memory_order_acquire);
+            }
+            return levels[level];
+        }
+
+        std::string level_path(uint32_t level) const
+        {
+            return cache_path + '-' + std::to_string(level) + ".bin";
+        }
+
+        bool load_cache(uint32_t level)
+        {
+            std::string pref_path = "/pref/" + level_path(level);
+            if (PHYSFS_exists(pref_path.c_str()) == 0)
+                return false;
+
+            AssetFile cached(pref_path);
+            transcode_cache_header header {};
+            if (cached.size() == sizeof(header) + levels[level].size()) {
+                cached.read(0, &header, sizeof(header));
+                cached.read(sizeof(header), levels[level].data(), levels[level].size());
+            }
+            if (header.magic == TRANSCODE_CACHE_MAGIC && header.version == TRANSCODE_CACHE_VERSION && header.size == cached.size() && header.checksum == content_hash(levels[level]))
+                return true;
+            SDL_LogDebug(SDL_LOG_CATEGORY_APPLICATION, "transcode cache: %s is stale or damaged", pref_path.c_str());
+            return false;
+        }
+
+        void transcode(uint32_t level)
+        {
+            // Setting the transcoder up decodes the global codebooks, so it waits for the first level that needs it.
+            std::call_once(started, [this]() {
+                std::span<const uint8_t> source = file->mapped();
+                if (source.empty()) {
+                    file_data.resize(file->size());
+                    file->read(0, file_data.data(), file_data.size());
+                    source = file_data;
+                }
+                std::call_once(basisu_init, basist::basisu_transcoder_init);
+                bool ok = ktx2.init(source.data(), source.size()) && ktx2.start_transcoding();
+                SDL_assert_release(ok);
+            });
+
+            for (auto it = subimages.begin(); it != subimages.end(); ++it) {
+                if (it->level != level)
+                    continue;
+                basist::ktx2_transcoder_state transcoder_state;
+                uint32_t blocks_or_pixels = it->size / basist::basis_get_bytes_per_block_or_pixel(format);
+                bool ok = ktx2.transcode_image_level(it->level, it->layer, it->face, levels[level].data() + it->data_offset, blocks_or_pixels, format, 0, 0, 0, -1, -1, &transcoder_state);
+                SDL_assert_release(ok);
+            }
+        }
+
+        // Written under a name of its own and renamed into place, so that a reader never sees a partial file, and two
+        // writers of the same cache never write into one file.
+        void write_cache(uint32_t level) const
+        {
+            std::string path = level_path(level);
+            transcode_cache_header header { TRANSCODE_CACHE_MAGIC, TRANSCODE_CACHE_VERSION, sizeof(header) + levels[level].size(), content_hash(levels[level]) };
+            char scratch_path[96];
+            snprintf(scratch_path, sizeof(scratch_path), "%s.%p.tmp", path.c_str(), static_cast<const void*>(this));
+            PHYSFS_mkdir("texcache");
+            PHYSFS_File* fh = PHYSFS_openWrite(scratch_path);
+            if (fh == nullptr) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION, "transcode cache: can't write %s: %s", scratch_path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+                return;
+            }
+            bool ok = PHYSFS_writeBytes(fh, &header, sizeof(header)) == sizeof(header);
+            ok = ok && PHYSFS_writeBytes(fh, levels[level].data(), levels[level].size()) == static_cast<PHYSFS_sint64>(levels[level].size());
+            ok = PHYSFS_close(fh) && ok;
+            std::error_code ec;
+            if (ok) {
+                // PhysicsFS can't rename, but the write dir is a plain directory.
+                std::filesystem::path write_dir = PHYSFS_getWriteDir();
+                std::filesystem::rename(write_dir / scratch_path, write_dir / path, ec);
+            }
+            if (ok == false || ec) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION, "transcode cache: can't write %s: %s", path.c_str(), ec ? ec.message().c_str() : PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+                PHYSFS_delete(scratch_path);
+            }
+        }
+    };
+
     struct prep {
-        PHYSFS_File* fh;
+        AssetFile file;
         ktxTexture2* ktx2 = nullptr;
+        VkFormat format;
+        bool direct; // the file holds the texture data exactly as the GPU wants it
+        std::shared_ptr<basis_transcoder> transcoder; // or nothing, if the texture data needs no transcoding
+        std::vector<subimage> subimages;
+        std::vector<chunk> chunks;
+        size_t next_chunk = 0;
+        uint32_t tail_level; // the finest level staged with the scene; finer ones are streamed
+        size_t tail_chunks;
+        VkImageCreateInfo image_info {};
 
         prep(std::string_view path)
+            : file(path)
         {
-            fh = PHYSFS_openRead(path.data());
-            ktxStream kstream = ktx_physfs_istream(fh);
-            ktx_error_code_e k_res = ktxTexture2_CreateFromStream(&kstream, 0, &ktx2);
+            ktx_error_code_e k_res;
+            if (file.is_mapped()) {
+                k_res = ktxTexture2_CreateFromMemory(file.mapped().data(), file.mapped().size(), 0, &ktx2);
+            } else {
+                ktxStream kstream = ktx_physfs_istream(file.physfs());
+                k_res = ktxTexture2_CreateFromStream(&kstream, 0, &ktx2);
+            }
             SDL_assert_release(k_res == KTX_SUCCESS);
-            SDL_assert(ktx2->vkFormat);
 
             ktxTexture* ktx = reinterpret_cast<ktxTexture*>(ktx2);
             SDL_assert(ktx->numDimensions > 0 && ktx->numDimensions < 4);
             SDL_assert(ktx->generateMipmaps == false);
 
-            if (ktxTexture2_NeedsTranscoding(ktx2)) {
+            format = static_cast<VkFormat>(ktx2->vkFormat);
+            bool transcoded = ktxTexture2_NeedsTranscoding(ktx2);
+            basist::transcoder_texture_format transcode_format = basist::transcoder_texture_format::cTFRGBA32;
+            if (transcoded) {
                 VkPhysicalDeviceFeatures device_features {};
                 vkGetPhysicalDeviceFeatures(DisplayHost::hardware_device(), &device_features);
 
                 khr_df_model_e color_model = ktxTexture2_GetColorModel_e(ktx2);
-                ktx_transcode_fmt_e tf;
+                bool srgb = ktxTexture2_GetTransferFunction_e(ktx2) == KHR_DF_TRANSFER_SRGB;
                 if (color_model == KHR_DF_MODEL_UASTC && device_features.textureCompressionASTC_LDR)
-                    tf = KTX_TTF_ASTC_4x4_RGBA;
+                    transcode_format = basist::transcoder_texture_format::cTFASTC_4x4_RGBA;
                 else if (color_model == KHR_DF_MODEL_ETC1S && device_features.textureCompressionETC2)
-                    tf = KTX_TTF_ETC2_RGBA;
+                    transcode_format = basist::transcoder_texture_format::cTFETC2_RGBA;
                 else if (device_features.textureCompressionASTC_LDR)
-                    tf = KTX_TTF_ASTC_4x4_RGBA;
+                    transcode_format = basist::transcoder_texture_format::cTFASTC_4x4_RGBA;
                 else if (device_features.textureCompressionETC2)
-                    tf = KTX_TTF_ETC2_RGBA;
+                    transcode_format = basist::transcoder_texture_format::cTFETC2_RGBA;
                 else if (device_features.textureCompressionBC)
-                    tf = KTX_TTF_BC7_RGBA;
+                    transcode_format = basist::transcoder_texture_format::cTFBC7_RGBA;
                 else
-                    tf = KTX_TTF_RGBA32;
+                    transcode_format = basist::transcoder_texture_format::cTFRGBA32;
+
+                switch (transcode_format) {
+                case basist::transcoder_texture_format::cTFASTC_4x4_RGBA:
+                    format = srgb ? VK_FORMAT_ASTC_4x4_SRGB_BLOCK : VK_FORMAT_ASTC_4x4_UNORM_BLOCK;
+                    break;
+                case basist::transcoder_texture_format::cTFETC2_RGBA:
+                    format = srgb ? VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK : VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK;
+                    break;
+                case basist::transcoder_texture_format::cTFBC7_RGBA:
+                    format = srgb ? VK_FORMAT_BC7_SRGB_BLOCK : VK_FORMAT_BC7_UNORM_BLOCK;
+                    break;
+                default:
+                    format = srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+                    break;
+                }
+            }
+            SDL_assert(format);
 
-                k_res = ktxTexture2_TranscodeBasis(ktx2, tf, 0);
+            // Texture data that is neither supercompressed nor transcoded is copied from the file straight into
+            // staging when it is prepared. Anything else is decoded into host memory first, and staged from there.
+            direct = transcoded == false && ktx2->supercompressionScheme == KTX_SS_NONE;
+            std::vector<ktx2_level> levels(ktx->numLevels);
+            if (direct) {
+                file.read(KTX2_LEVEL_INDEX_OFFSET, levels.data(), levels.size() * sizeof(ktx2_level));
+            } else if (transcoded == false) {
+                k_res = ktxTexture_LoadImageData(ktx, nullptr, 0);
                 SDL_assert_release(k_res == KTX_SUCCESS);
             }
+
+            // Block sizes come from the data format descriptor, or from the format the texture is transcoded to.
+            const uint32_t* basic_block = ktx2->pDfd + 1;
+            uint32_t block_width = KHR_DFDVAL(basic_block, TEXELBLOCKDIMENSION0) + 1, block_height = KHR_DFDVAL(basic_block, TEXELBLOCKDIMENSION1) + 1;
+            if (transcoded) {
+                block_width = basist::basis_get_block_width(transcode_format);
+                block_height = basist::basis_get_block_height(transcode_format);
+                if (basist::basis_transcoder_format_is_uncompressed(transcode_format))
+                    block_width = block_height = 1;
+            }
+
+            // Smallest mips first, so that a texture that spans several passes fills in from the bottom of its chain.
+            // Transcoded subimages are laid out the same way in their level's data.
+            std::vector<uint64_t> level_sizes(ktx->numLevels);
+            for (uint32_t level = ktx->numLevels; level-- > 0;) {
+                uint32_t width = std::max(1U, ktx->baseWidth >> level), height = std::max(1U, ktx->baseHeight >> level);
+                ktx_size_t size = ktxTexture_GetImageSize(ktx, level) * std::max(1U, ktx->baseDepth >> level);
+                if (transcoded)
+                    size = ((width + block_width - 1) / block_width) * ((height + block_height - 1) / block_height) * basist::basis_get_bytes_per_block_or_pixel(transcode_format);
+                for (uint32_t layer = 0; layer < ktx->numLayers; layer++) {
+                    for (uint32_t face = 0; face < ktx->numFaces; face++) {
+                        subimage& s = subimages.emplace_back();
+                        s.level = level;
+                        s.layer = layer;
+                        s.face = face;
+                        s.size = size;
+                        if (transcoded) {
+                            s.data_offset = level_sizes[level];
+                            level_sizes[level] += (size + 15) & ~15;
+                        } else {
+                            k_res = ktxTexture_GetImageOffset(ktx, level, layer, face, &s.data_offset);
+                            SDL_assert_release(k_res == KTX_SUCCESS);
+                        }
+                        if (direct) {
+                            // Images within a level are laid out the same way in the file as in memory.
+                            ktx_size_t level_offset;
+                            ktxTexture_GetImageOffset(ktx, level, 0, 0, &level_offset);
+                            s.data_offset = levels[level].byte_offset + (s.data_offset - level_offset);
+                            SDL_assert_release(s.data_offset + s.size <= levels[level].byte_offset + levels[level].byte_length);
+                        }
+                        split(subimages.size() - 1, block_height);
+                    }
+                }
+            }
+            if (transcoded)
+                start_transcoder(path, transcode_format, std::move(level_sizes));
+
+            // The tail takes levels, coarsest first, for as long as they fit in MIP_TAIL_SIZE. The coarsest level is
+            // always in it, so every image has something to sample as soon as the scene is ready.
+            VkDeviceSize tail_size = 0;
+            tail_level = ktx->numLevels - 1;
+            tail_chunks = 0;
+            while (tail_chunks < chunks.size()) {
+                size_t end = chain_end(chunks[tail_chunks].level);
+                VkDeviceSize level_size = chain_size(end) - chain_size(tail_chunks);
+                if (tail_chunks > 0 && tail_size + level_size > Image::MIP_TAIL_SIZE)
+                    break;
+                tail_size += level_size;
+                tail_level = chunks[tail_chunks].level;
+                tail_chunks = end;
+            }
         }
 
         ~prep()
         {
             ktxTexture2_Destroy(ktx2);
-            PHYSFS_close(fh);
+        }
+
+        // Get ready to transcode levels, or load them from the cache, as they are staged.
+        void start_transcoder(std::string_view path, basist::transcoder_texture_format transcode_format, std::vector<uint64_t>&& level_sizes)
+        {
+            PHYSFS_Stat st {};
+            if (PHYSFS_stat(std::string(path).c_str(), &st) == 0) {
+                st.filesize = file.size();
+                st.modtime = -1;
+            }
+            std::vector<uint8_t> key(path.begin(), path.end());
+            key.resize(path.size() + sizeof(st.filesize) + sizeof(st.modtime));
+            memcpy(key.data() + path.size(), &st.filesize, sizeof(st.filesize));
+            memcpy(key.data() + path.size() + sizeof(st.filesize), &st.modtime, sizeof(st.modtime));
+
+            VkPhysicalDeviceProperties device_props;
+            vkGetPhysicalDeviceProperties(DisplayHost::hardware_device(), &device_props);
+            char cache_path[64];
+            snprintf(cache_path, sizeof(cache_path), "texcache/%016" PRIx64 "-%u-%04x-%04x", content_hash(key), static_cast<unsigned>(transcode_format), device_props.vendorID, device_props.deviceID);
+
+            transcoder = std::make_shared<basis_transcoder>();
+            transcoder->file = &file;
+            transcoder->format = transcode_format;
+            transcoder->cache_path = cache_path;
+            transcoder->subimages = subimages;
+            transcoder->levels.resize(level_sizes.size());
+            transcoder->level_sizes = std::move(level_sizes);
+            transcoder->states = std::make_unique<std::atomic_uint8_t[]>(transcoder->levels.size());
+        }
+
+        // Cut a subimage into chunks of at most MAX_CHUNK_SIZE: whole slices if one fits, and runs of block rows if not.
+        // Rows and slices are tightly packed, in the file as in a transcoded level.
+        void split(size_t index, uint32_t block_height)
+        {
+            const ktxTexture* ktx = reinterpret_cast<const ktxTexture*>(ktx2);
+            const subimage& s = subimages[index];
+            uint32_t width = std::max(1U, ktx->baseWidth >> s.level), height = std::max(1U, ktx->baseHeight >> s.level), depth = std::max(1U, ktx->baseDepth >> s.level);
+            uint32_t rows = (height + block_height - 1) / block_height;
+            ktx_size_t slice_size = s.size / depth, row_size = slice_size / rows;
+            uint32_t slices_per_chunk = depth, rows_per_chunk = rows;
+            if (s.size > MAX_CHUNK_SIZE && slice_size <= MAX_CHUNK_SIZE) {
+                slices_per_chunk = MAX_CHUNK_SIZE / slice_size;
+            } else if (s.size > MAX_CHUNK_SIZE) {
+                slices_per_chunk = 1;
+                rows_per_chunk = std::max<ktx_size_t>(1, MAX_CHUNK_SIZE / row_size);
+            }
+
+            bool first_image = s.layer == 0 && s.face == 0, last_image = s.layer + 1 == ktx->numLayers && s.face + 1 == ktx->numFaces;
+            for (uint32_t z = 0; z < depth; z += slices_per_chunk) {
+                for (uint32_t row = 0; row < rows; row += rows_per_chunk) {
+                    uint32_t slice_count = std::min(slices_per_chunk, depth - z), row_count = std::min(rows_per_chunk, rows - row);
+                    chunk& c = chunks.emplace_back();
+                    c.level = s.level;
+                    c.layer = s.layer;
+                    c.face = s.face;
+                    c.subimage = index;
+                    c.offset = { 0, static_cast<int32_t>(row * block_height), static_cast<int32_t>(z) };
+                    c.extent = { width, std::min(row_count * block_height, height - row * block_height), slice_count };
+                    c.first = first_image && z == 0 && row == 0;
+                    c.last = last_image && z + slice_count == depth && row + row_count == rows;
+                    c.data_offset = s.data_offset + z * slice_size + row * row_size;
+                    c.size = slice_count * row_count * row_size;
+                }
+            }
+        }
+
+
+        // Chunks run coarsest level first, so the chain down to any level is a prefix of them.
+        size_t chain_end(uint32_t level) const
+        {
+            size_t end = 0;
+            while (end < chunks.size() && chunks[end].level >= level)
+                end++;
+            return end;
+        }
+
+        VkDeviceSize chain_size(size_t end) const
+        {
+            VkDeviceSize size = 0;
+            for (size_t i = 0; i < end; i++)
+                size += (chunks[i].size + 15) & ~15;
+            return size;
         }
     };
 
+    // Create an image holding the texture's levels from base_level down, with a view of all of them.
+    void create(const prep& p, uint32_t base_level, VkImageCreateInfo& image_info, VkImage* image, VmaAllocation* mem, VkImageView* view)
+    {
+        const ktxTexture* ktx = reinterpret_cast<const ktxTexture*>(p.ktx2);
+        VmaAllocationCreateInfo alloc_info {};
+        alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.flags = 0;
+        image_info.imageType = static_cast<VkImageType>(ktx->numDimensions - 1);
+        image_info.format = p.format;
+        image_info.extent.width = std::max(1U, ktx->baseWidth >> base_level);
+        image_info.extent.height = std::max(1U, ktx->baseHeight >> base_level);
+        image_info.extent.depth = std::max(1U, ktx->baseDepth >> base_level);
+        image_info.mipLevels = ktx->numLevels - base_level;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+
+        VkImageViewCreateInfo image_view_info {};
+        image_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        if (ktx->isArray && ktx->isCubemap) {
+            image_info.arrayLayers = 6 * ktx->numLayers;
+            image_info.flags |= VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+            image_view_info.viewType = VK_IMAGE_VIEW_TYPE_CUBE_ARRAY;
+        } else if (ktx->isCubemap) {
+            image_info.arrayLayers = 6;
+            image_info.flags |= VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+            image_view_info.viewType = VK_IMAGE_VIEW_TYPE_CUBE;
+        } else if (ktx->isArray) {
+            image_info.arrayLayers = ktx->numLayers;
+            if (ktx->numDimensions == 1) {
+                image_view_info.viewType = VK_IMAGE_VIEW_TYPE_1D_ARRAY;
+            } else if (ktx->numDimensions == 2) {
+                image_info.flags |= VK_IMAGE_CREATE_2D_ARRAY_COMPATIBLE_BIT;
+                image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+            }
+        } else {
+            image_info.arrayLayers = 1;
+            image_view_info.viewType = static_cast<VkImageViewType>(image_info.imageType);
+        }
+        VK_DEMAND(vmaCreateImage(DisplayHost::allocator(), &image_info, &alloc_info, image, mem, nullptr));
+
+        image_view_info.image = *image;
+        image_view_info.format = image_info.format;
+        image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        image_view_info.subresourceRange.baseMipLevel = 0;
+        image_view_info.subresourceRange.levelCount = image_info.mipLevels;
+        image_view_info.subresourceRange.baseArrayLayer = 0;
+        image_view_info.subresourceRange.layerCount = image_info.arrayLayers;
+        VK_DEMAND(vkCreateImageView(DisplayHost::device(), &image_view_info, nullptr, view));
+    }
+
+    // Stage chunks from next up to end into an image whose level 0 is base_level, as many as fit in size. Each level
+    // is moved into the transfer layout by its first chunk and handed to the graphics queue by its last, so the levels
+    // of an image can land over several passes.
+    size_t stage(prep& p, SceneHost::StagingBuffer& commands, VkDeviceSize offset, VkDeviceSize size, size_t& next, size_t end, VkImage image, uint32_t base_level, VkImageCreateInfo& image_info)
+    {
+        ktxTexture* ktx = reinterpret_cast<ktxTexture*>(p.ktx2);
+        std::vector<VkBufferImageCopy2> regions;
+        std::vector<AsyncIO::Read> reads;
+        std::vector<JobSystem::JobRef> levels, copies;
+        size_t staged = 0, begin = next;
+        const ktx_uint8_t* texture_data = p.direct || p.transcoder ? nullptr : ktxTexture_GetData(ktx);
+        for (; next < end; next++) {
+            const chunk& c = p.chunks[next];
+            size_t chunk_size = (c.size + 15) & ~15;
+            if (staged + chunk_size > size)
+                break;
+
+            if (p.transcoder && p.transcoder->ready(c.level)) {
+                memcpy(commands.window(offset + staged).data(), p.transcoder->levels[c.level].data() + c.data_offset, c.size);
+            } else if (p.transcoder) {
+                // Chunks run a level at a time, so a level is made ready by one job, which the level's copies wait on.
+                if (next == begin || p.chunks[next - 1].level != c.level)
+                    levels.push_back(JobSystem::create([transcoder = p.transcoder, level = c.level]() { transcoder->level(level); }));
+                JobSystem::JobRef copy = JobSystem::create([transcoder = p.transcoder, c, dst = commands.window(offset + staged).data()]() {
+                    memcpy(dst, transcoder->levels[c.level].data() + c.data_offset, c.size);
+                });
+                JobSystem::depend(copy, levels.back());
+                copies.push_back(std::move(copy));
+            } else if (p.direct) {
+                p.file.read_async(c.data_offset, commands.window(offset + staged).data(), c.size, reads);
+            } else {
+                memcpy(commands.window(offset + staged).data(), texture_data + c.data_offset, c.size);
+            }
+            VkBufferImageCopy2& region = regions.emplace_back();
+            region.sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2;
+            region.bufferOffset = offset + staged;
+            region.bufferRowLength = 0;
+            region.bufferImageHeight = 0;
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.mipLevel = c.level - base_level;
+            region.imageSubresource.baseArrayLayer = c.layer * ktx->numFaces + c.face;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = c.offset;
+            region.imageExtent = c.extent;
+            staged += chunk_size;
+        }
+
+        if (reads.empty() == false)
+            commands.await_reads(AsyncIO::read(std::move(reads)));
+        if (copies.empty() == false) {
+            // Levels are transcoded in parallel; the pass waits for every copy out of them before it is submitted.
+            JobSystem::JobRef done = JobSystem::create([]() { });
+            for (auto it = copies.begin(); it != copies.end(); ++it) {
+                JobSystem::depend(done, *it);
+                JobSystem::submit(*it);
+            }
+            for (auto it = levels.begin(); it != levels.end(); ++it)
+                JobSystem::submit(*it);
+            JobSystem::submit(done);
+            commands.await_reads(std::move(done));
+        }
+
+        for (size_t i = 0; i < regions.size();) {
+            size_t j = i;
+            uint32_t level = p.chunks[begin + i].level;
+            while (j < regions.size() && p.chunks[begin + j].level == level)
+                j++;
+            commands.copy_image(image, image_info, std::span(regions).subspan(i, j - i), VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                p.chunks[begin + i].first, p.chunks[begin + j - 1].last, level - base_level, 1);
+            i = j;
+        }
+        return staged;
+    }
+
 }
 
 namespace mesh {
 
     struct prep {
-        PHYSFS_File* fh;
+        AssetFile file;
+        std::vector<uint8_t> header_data;
         struct buffer {
-            VkBuffer handle;
-            VmaAllocation mem;
-            VkMemoryPropertyFlags flags;
+            VkBuffer handle = VK_NULL_HANDLE;
+            VmaAllocation mem = VK_NULL_HANDLE;
+            VkMemoryPropertyFlags flags = 0;
+            PHYSFS_uint64 file_offset = 0;
+            VkDeviceSize size = 0;
         } vertex_buffer, index_buffer;
 
+        // Buffers that can't be written directly are staged as one byte stream, in any number of pieces.
+        struct segment {
+            VkBuffer dst;
+            PHYSFS_uint64 file_offset;
+            VkDeviceSize size;
+            VkPipelineStageFlags2 dst_stage;
+            VkAccessFlags2 dst_access;
+        };
+        std::vector<segment> segments;
+        VkDeviceSize cursor = 0, total = 0;
+        bool host_written = false;
+
+        inline const schema::Mesh* header() const { return schema::GetSizePrefixedMesh(header_data.data()); }
+
         prep(std::string_view path)
+            : file(path)
         {
-            fh = PHYSFS_openRead(path.data());
+            PHYSFS_sint64 file_length = file.size();
+
+            // Only the header is read here; the payloads go straight to the GPU when the mesh is prepared.
+            uint32_t header_size = 0;
+            SDL_assert_release(file_length >= static_cast<PHYSFS_sint64>(sizeof(header_size)));
+            file.read(0, &header_size, sizeof(header_size));
+            header_size = SDL_Swap32LE(header_size);
+            SDL_assert_release(sizeof(header_size) + header_size <= static_cast<PHYSFS_uint64>(file_length));
+            header_data.resize(sizeof(header_size) + header_size);
+            file.read(0, header_data.data(), header_data.size());
+            flatbuffers::Verifier verifier(header_data.data(), header_data.size());
+            SDL_assert_release(schema::VerifySizePrefixedMeshBuffer(verifier) && "not a mesh container");
+
+            const schema::Mesh* mesh = header();
+            SDL_assert_release(mesh->vertex_data() && mesh->vertex_data()->size() > 0);
+            vertex_buffer.file_offset = mesh->vertex_data()->offset();
+            vertex_buffer.size = mesh->vertex_data()->size();
+            SDL_assert_release(vertex_buffer.file_offset + vertex_buffer.size <= static_cast<PHYSFS_uint64>(file_length));
+            if (mesh->index_data()) {
+                index_buffer.file_offset = mesh->index_data()->offset();
+                index_buffer.size = mesh->index_data()->size();
+                SDL_assert_release(index_buffer.file_offset + index_buffer.size <= static_cast<PHYSFS_uint64>(file_length));
+            }
 
+            Residency::make_room(vertex_buffer.size + index_buffer.size);
             VmaAllocationInfo alloc_info;
             VmaAllocationCreateInfo alloc_ci {};
             alloc_ci.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT;
@@ -193,118 +856,206 @@ namespace mesh {
 
             VkBufferCreateInfo buffer_ci {};
             buffer_ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-            buffer_ci.size = 25272;
-            buffer_ci.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
             buffer_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-            VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &buffer_ci, &alloc_ci, &index_buffer.handle, &index_buffer.mem, &alloc_info));
-            vmaGetMemoryTypeProperties(twogame::DisplayHost::allocator(), alloc_info.memoryType, &index_buffer.flags);
+            if (index_buffer.size > 0) {
+                buffer_ci.size = index_buffer.size;
+                buffer_ci.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+                VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &buffer_ci, &alloc_ci, &index_buffer.handle, &index_buffer.mem, &alloc_info));
+                vmaGetMemoryTypeProperties(twogame::DisplayHost::allocator(), alloc_info.memoryType, &index_buffer.flags);
+            }
 
-            buffer_ci.size = 76768;
+            buffer_ci.size = vertex_buffer.size;
             buffer_ci.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
             VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &buffer_ci, &alloc_ci, &vertex_buffer.handle, &vertex_buffer.mem, &alloc_info));
             vmaGetMemoryTypeProperties(twogame::DisplayHost::allocator(), alloc_info.memoryType, &vertex_buffer.flags);
-        }
-        ~prep()
-        {
-            PHYSFS_close(fh);
+
+            if ((vertex_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
+                segments.push_back({ vertex_buffer.handle, vertex_buffer.file_offset, vertex_buffer.size, VK_PIPELINE_STAGE_2_VERTEX_INPUT_BIT, VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT });
+            if (index_buffer.handle && (index_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
+                segments.push_back({ index_buffer.handle, index_buffer.file_offset, index_buffer.size, VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT, VK_ACCESS_2_INDEX_READ_BIT });
+            for (auto it = segments.begin(); it != segments.end(); ++it)
+                total += it->size;
         }
     };
 
 }
 
-Image::Image()
-    : m_image(VK_NULL_HANDLE)
+Image::Image(std::string_view path)
+    : m_path(path)
+    , m_image(VK_NULL_HANDLE)
     , m_mem(VK_NULL_HANDLE)
     , m_image_view(VK_NULL_HANDLE)
+    , m_picturebook_slot(UINT32_MAX)
+    , m_streaming(false)
+    , m_next {}
 {
-    m_prepared = std::make_shared<image::prep>("/data/duck.i0.ktx2");
+    auto prep = std::make_shared<image::prep>(path);
+    m_prepared = prep;
+    m_base_level = prep->tail_level;
+    m_level_count = prep->ktx2->numLevels;
 }
 
 Image::~Image()
 {
-    vkDestroyImageView(DisplayHost::device(), m_image_view, nullptr);
+    release();
+}
+
+void Image::release()
+{
+    // Prepared and evicted on workers, but read by the scene thread every frame.
+    uint32_t slot = m_picturebook_slot.exchange(UINT32_MAX, std::memory_order_acq_rel);
+    if (slot != UINT32_MAX)
+        IRenderer::release_picture(slot);
+    vkDestroyImageView(DisplayHost::device(), m_image_view.load(std::memory_order_relaxed), nullptr);
     vmaDestroyImage(DisplayHost::allocator(), m_image, m_mem);
+    vkDestroyImageView(DisplayHost::device(), m_next.view, nullptr);
+    vmaDestroyImage(DisplayHost::allocator(), m_next.image, m_next.mem);
+    m_image_view.store(VK_NULL_HANDLE, std::memory_order_relaxed);
+    m_image = VK_NULL_HANDLE;
+    m_mem = VK_NULL_HANDLE;
+    m_next = {};
+    m_stream_prep.reset();
+    m_streaming.store(false, std::memory_order_relaxed);
+}
+
+void Image::reload()
+{
+    auto prep = std::make_shared<image::prep>(m_path);
+    m_prepared = prep;
+    m_base_level = prep->tail_level;
+}
+
+void Image::push_allocations(std::vector<VmaAllocation>& allocations) const
+{
+    std::lock_guard lock(m_residency_lock);
+    if (m_mem)
+        allocations.push_back(m_mem);
+}
+
+uint64_t Image::busy_until() const
+{
+    return m_streaming.load(std::memory_order_acquire) ? UINT64_MAX : ready_ticket();
 }
 
 size_t Image::prepare_needs() const
 {
+    size_t needs = 0;
     auto p_prepare_data = std::get_if<std::shared_ptr<void>>(&m_prepared);
     if (p_prepare_data) {
         image::prep* prepare_data = static_cast<image::prep*>(p_prepare_data->get());
-        ktxTexture* ktx = reinterpret_cast<ktxTexture*>(prepare_data->ktx2);
-        return (ktxTexture_GetDataSizeUncompressed(ktx) + 15) & ~15;
-    } else {
-        return 0;
+        needs = prepare_data->chain_size(prepare_data->tail_chunks) - prepare_data->chain_size(prepare_data->next_chunk);
     }
+    return needs;
 }
 
-size_t Image::prepare(SceneHost::StagingBuffer& commands, VkDeviceSize staging_offset)
-{
-    image::prep* prepare_data = static_cast<image::prep*>(std::get<std::shared_ptr<void>>(m_prepared).get());
-    ktxTexture* ktx = reinterpret_cast<ktxTexture*>(prepare_data->ktx2);
-
-    VmaAllocationCreateInfo alloc_info {};
-    alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
-
-    VkImageCreateInfo image_info {};
-    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    image_info.flags = 0;
-    image_info.imageType = static_cast<VkImageType>(ktx->numDimensions - 1);
-    image_info.format = static_cast<VkFormat>(prepare_data->ktx2->vkFormat);
-    image_info.extent.width = ktx->baseWidth;
-    image_info.extent.height = ktx->baseHeight;
-    image_info.extent.depth = ktx->baseDepth;
-    image_info.mipLevels = ktx->numLevels;
-    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
-    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-    image_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-
-    VkImageViewCreateInfo image_view_info {};
-    image_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    if (ktx->isArray && ktx->isCubemap) {
-        image_info.arrayLayers = 6 * ktx->numLayers;
-        image_info.flags |= VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
-        image_view_info.viewType = VK_IMAGE_VIEW_TYPE_CUBE_ARRAY;
-    } else if (ktx->isCubemap) {
-        image_info.arrayLayers = 6;
-        image_info.flags |= VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
-        image_view_info.viewType = VK_IMAGE_VIEW_TYPE_CUBE;
-    } else if (ktx->isArray) {
-        image_info.arrayLayers = ktx->numLayers;
-        if (ktx->numDimensions == 1) {
-            image_view_info.viewType = VK_IMAGE_VIEW_TYPE_1D_ARRAY;
-        } else if (ktx->numDimensions == 2) {
-            image_info.flags |= VK_IMAGE_CREATE_2D_ARRAY_COMPATIBLE_BIT;
-            image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+size_t Image::prepare_next(VkDeviceSize budget) const
+{
+    size_t next = 0;
+    auto p_prepare_data = std::get_if<std::shared_ptr<void>>(&m_prepared);
+    if (p_prepare_data) {
+        image::prep* prepare_data = static_cast<image::prep*>(p_prepare_data->get());
+        for (auto it = prepare_data->chunks.begin() + prepare_data->next_chunk; it != prepare_data->chunks.begin() + prepare_data->tail_chunks; ++it) {
+            size_t chunk_size = (it->size + 15) & ~15;
+            if (next + chunk_size > budget)
+                break;
+            next += chunk_size;
         }
-    } else {
-        image_info.arrayLayers = 1;
-        image_view_info.viewType = static_cast<VkImageViewType>(image_info.imageType);
     }
-    VK_DEMAND(vmaCreateImage(DisplayHost::allocator(), &image_info, &alloc_info, &m_image, &m_mem, nullptr));
+    return next;
+}
+
+size_t Image::prepare(SceneHost::StagingBuffer& commands, VkDeviceSize staging_offset, VkDeviceSize size)
+{
+    std::shared_ptr<void> prep = std::get<std::shared_ptr<void>>(m_prepared);
+    image::prep* prepare_data = static_cast<image::prep*>(prep.get());
+    if (size == 0)
+        return 0;
+
+    if (m_image == VK_NULL_HANDLE) {
+        VkImageView view;
+        Residency::make_room(prepare_needs());
+        image::create(*prepare_data, m_base_level, prepare_data->image_info, &m_image, &m_mem, &view);
+        m_image_view.store(view, std::memory_order_release);
+        m_picturebook_slot.store(IRenderer::acquire_picture(view), std::memory_order_release);
+    }
+    size_t staged = image::stage(*prepare_data, commands, staging_offset, size, prepare_data->next_chunk, prepare_data->tail_chunks, m_image, m_base_level, prepare_data->image_info);
+
+    // Levels finer than the tail are streamed from the same file, so it stays open once the tail is staged.
+    if (prepare_data->next_chunk == prepare_data->tail_chunks && m_base_level > 0)
+        m_stream_prep = prep;
+    return staged;
+}
+
+size_t Image::plan_stream(uint32_t level, VkDeviceSize budget)
+{
+    // Once m_streaming is set, the image can't be evicted until the stream lands.
+    std::lock_guard lock(m_residency_lock);
+    const image::prep* prep = static_cast<const image::prep*>(m_stream_prep.get());
+    if (prep == nullptr || m_image == VK_NULL_HANDLE)
+        return 0;
+
+    // The new image holds the whole chain down to its base level. Coarser levels are staged again rather than copied
+    // across, so the image on the graphics queue is never touched; the chain is staged over as many passes as it takes.
+    if (m_streaming.load(std::memory_order_acquire) == false) {
+        if (level >= m_base_level)
+            return 0;
+        m_next.base_level = level;
+        m_next.next_chunk = 0;
+        m_next.end = prep->chain_end(level);
+        m_streaming.store(true, std::memory_order_release);
+    }
+
+    VkDeviceSize size = 0;
+    for (size_t i = m_next.next_chunk; i < m_next.end; i++) {
+        VkDeviceSize chunk_size = (prep->chunks[i].size + 15) & ~15;
+        if (size + chunk_size > budget)
+            break;
+        size += chunk_size;
+    }
+    m_next.planned = size;
+    return size;
+}
+
+void Image::stream(SceneHost::StagingBuffer& commands, VkDeviceSize offset)
+{
+    image::prep* prep = static_cast<image::prep*>(m_stream_prep.get());
+    if (m_next.image == VK_NULL_HANDLE) {
+        Residency::make_room(prep->chain_size(m_next.end));
+        image::create(*prep, m_next.base_level, m_next.image_info, &m_next.image, &m_next.mem, &m_next.view);
+    }
+    [[maybe_unused]] size_t staged = image::stage(*prep, commands, offset, m_next.planned, m_next.next_chunk, m_next.end, m_next.image, m_next.base_level, m_next.image_info);
+    SDL_assert(staged == m_next.planned);
+}
+
+std::function<void()> Image::land_stream()
+{
+    std::lock_guard lock(m_residency_lock);
+    if (m_next.next_chunk < m_next.end)
+        return {};
 
-    image_view_info.image = m_image;
-    image_view_info.format = image_info.format;
-    image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    image_view_info.subresourceRange.baseMipLevel = 0;
-    image_view_info.subresourceRange.levelCount = image_info.mipLevels;
-    image_view_info.subresourceRange.baseArrayLayer = 0;
-    image_view_info.subresourceRange.layerCount = image_info.arrayLayers;
-    VK_DEMAND(vkCreateImageView(DisplayHost::device(), &image_view_info, nullptr, &m_image_view));
+    VkImage image = m_image;
+    VmaAllocation mem = m_mem;
+    VkImageView view = m_image_view.load(std::memory_order_relaxed);
+    m_image = m_next.image;
+    m_mem = m_next.mem;
+    m_image_view.store(m_next.view, std::memory_order_release);
+    IRenderer::replace_picture(m_picturebook_slot.load(std::memory_order_relaxed), m_next.view);
+    m_base_level = m_next.base_level;
+    m_next = {};
+    if (m_base_level == 0)
+        m_stream_prep.reset();
+    m_streaming.store(false, std::memory_order_release);
 
-    std::span<std::byte> staging_data = commands.window(staging_offset);
-    image::ktx_mip_iterate_userdata mip_data(image_info, staging_offset);
-    ktx_error_code_e res = ktxTexture_LoadImageData(ktx, reinterpret_cast<ktx_uint8_t*>(staging_data.data()), staging_data.size());
-    SDL_assert_release(res == KTX_SUCCESS);
-    res = ktxTexture_IterateLevels(ktx, image::ktx_mip_iterate, &mip_data);
-    SDL_assert_release(res == KTX_SUCCESS);
-    commands.copy_image(m_image, image_info, mip_data.regions(), VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-    return (ktxTexture_GetDataSizeUncompressed(ktx) + 15) & ~15;
+    return [image, mem, view]() {
+        vkDestroyImageView(DisplayHost::device(), view, nullptr);
+        vmaDestroyImage(DisplayHost::allocator(), image, mem);
+    };
 }
 
-Material::Material()
+Material::Material(std::string_view base_color_texture)
 {
-    m_base_color_texture = std::make_shared<Image>();
+    if (base_color_texture.empty() == false)
+        m_base_color_texture = AssetRegistry::get<Image>(base_color_texture);
 }
 
 Material::~Material()
@@ -313,7 +1064,8 @@ Material::~Material()
 
 void Material::push_dependents(std::queue<IAsset*>& deps) const
 {
-    deps.push(m_base_color_texture.get());
+    if (m_base_color_texture)
+        deps.push(m_base_color_texture.get());
 }
 
 size_t Material::prepare_needs() const
@@ -321,27 +1073,107 @@ size_t Material::prepare_needs() const
     return 0;
 }
 
-size_t Material::prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset)
+size_t Material::prepare_next(VkDeviceSize budget) const
+{
+    return 0;
+}
+
+size_t Material::prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset, VkDeviceSize size)
 {
     return 0;
 }
 
-Mesh::Mesh()
+Mesh::Mesh(std::string_view path)
+    : m_path(path)
+    , m_index_type(VK_INDEX_TYPE_UINT16)
+    , m_binding_count(0)
 {
-    auto prep = std::make_shared<mesh::prep>("/data/duck.bin");
+    auto prep = std::make_shared<mesh::prep>(path);
     m_prepared = prep;
-    m_materials.emplace_back(new Material);
 
     m_vertex_buffer = prep->vertex_buffer.handle;
     m_vertex_mem = prep->vertex_buffer.mem;
     m_index_buffer = prep->index_buffer.handle;
     m_index_mem = prep->index_buffer.mem;
+
+    const schema::Mesh* header = prep->header();
+    m_stream_offsets.fill(0);
+    m_stream_strides.fill(0);
+    if (header->streams()) {
+        for (auto it = header->streams()->begin(); it != header->streams()->end(); ++it) {
+            uint32_t binding = static_cast<uint32_t>(it->semantic());
+            SDL_assert_release(binding < VERTEX_BINDING_COUNT);
+            m_stream_offsets[binding] = it->offset();
+            m_stream_strides[binding] = it->stride();
+            m_binding_count = std::max(m_binding_count, binding + 1);
+        }
+    }
+    if (header->index_type() == schema::IndexType::UInt32)
+        m_index_type = VK_INDEX_TYPE_UINT32;
+
+    if (header->submeshes()) {
+        for (auto it = header->submeshes()->begin(); it != header->submeshes()->end(); ++it) {
+            Submesh& submesh = m_submeshes.emplace_back();
+            submesh.first_index = it->first_index();
+            submesh.index_count = it->index_count();
+            submesh.vertex_offset = it->vertex_offset();
+            submesh.material = it->material();
+            if (it->bounds()) {
+                submesh.bounds_min = { { it->bounds()->min().x(), it->bounds()->min().y(), it->bounds()->min().z() } };
+                submesh.bounds_max = { { it->bounds()->max().x(), it->bounds()->max().y(), it->bounds()->max().z() } };
+            }
+        }
+    }
+    // Material slots are keyed by the mesh and slot name. Their textures are named relative to the mesh, and are shared
+    // with anything else that uses the same file; a slot without one has no texture.
+    if (header->materials()) {
+        std::string_view dir = path.substr(0, path.rfind('/') + 1);
+        for (size_t i = 0; i < header->materials()->size(); i++) {
+            const schema::MaterialSlot* slot = header->materials()->Get(i);
+            std::string key = std::string(path) + '#' + (slot->name() ? slot->name()->str() : std::to_string(i));
+            std::string base_color_texture;
+            if (slot->base_color_texture())
+                base_color_texture = std::string(dir) + slot->base_color_texture()->str();
+            m_materials.push_back(AssetRegistry::get<Material>(key, base_color_texture));
+        }
+    }
+    for (auto it = m_submeshes.begin(); it != m_submeshes.end(); ++it)
+        SDL_assert_release(it->material < m_materials.size());
 }
 
 Mesh::~Mesh()
+{
+    release();
+}
+
+void Mesh::release()
 {
     vmaDestroyBuffer(DisplayHost::allocator(), m_vertex_buffer, m_vertex_mem);
-    vmaDestroyBuffer(DisplayHost::allocator(), m_index_buffer, m_index_mem);
+    if (m_index_buffer)
+        vmaDestroyBuffer(DisplayHost::allocator(), m_index_buffer, m_index_mem);
+    m_vertex_buffer = m_index_buffer = VK_NULL_HANDLE;
+    m_vertex_mem = m_index_mem = VK_NULL_HANDLE;
+}
+
+void Mesh::reload()
+{
+    // The header is read again, but only the buffers change: the layout and materials are kept from the first load.
+    auto prep = std::make_shared<mesh::prep>(m_path);
+    m_prepared = prep;
+    m_vertex_buffer = prep->vertex_buffer.handle;
+    m_vertex_mem = prep->vertex_buffer.mem;
+    m_index_buffer = prep->index_buffer.handle;
+    m_index_mem = prep->index_buffer.mem;
+}
+
+void Mesh::bind_buffers(VkCommandBuffer cmd) const
+{
+    // Every stream lives in the one vertex buffer. Bindings the mesh has no stream for get a zero stride.
+    std::array<VkBuffer, VERTEX_BINDING_COUNT> buffers;
+    buffers.fill(m_vertex_buffer);
+    if (m_index_buffer)
+        vkCmdBindIndexBuffer(cmd, m_index_buffer, 0, m_index_type);
+    vkCmdBindVertexBuffers2(cmd, 0, m_binding_count, buffers.data(), m_stream_offsets.data(), nullptr, m_stream_strides.data());
 }
 
 void Mesh::push_dependents(std::queue<IAsset*>& deps) const
@@ -350,65 +1182,91 @@ void Mesh::push_dependents(std::queue<IAsset*>& deps) const
         deps.push(it->get());
 }
 
+void Mesh::push_allocations(std::vector<VmaAllocation>& allocations) const
+{
+    if (m_vertex_mem)
+        allocations.push_back(m_vertex_mem);
+    if (m_index_mem)
+        allocations.push_back(m_index_mem);
+}
+
 size_t Mesh::prepare_needs() const
 {
-    size_t needs = 0;
     auto p_prepare_data = std::get_if<std::shared_ptr<void>>(&m_prepared);
     if (p_prepare_data) {
         mesh::prep* prepare_data = static_cast<mesh::prep*>(p_prepare_data->get());
-        if ((prepare_data->vertex_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
-            needs += 76768;
-        if (prepare_data->index_buffer.handle && (prepare_data->index_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
-            needs += 25272;
+        return prepare_data->total - prepare_data->cursor;
     }
-    return needs;
+    return 0;
 }
 
-size_t Mesh::prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset)
+size_t Mesh::prepare_next(VkDeviceSize budget) const
+{
+    return std::min<size_t>(prepare_needs(), budget);
+}
+
+size_t Mesh::prepare(SceneHost::StagingBuffer& commands, VkDeviceSize offset, VkDeviceSize size)
 {
     mesh::prep* prep = static_cast<mesh::prep*>(std::get<std::shared_ptr<void>>(m_prepared).get());
-    size_t staged_size = 0;
-    if (prep->vertex_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
-        void* vertex_buffer_ptr;
-        VK_DEMAND(vmaMapMemory(DisplayHost::allocator(), m_vertex_mem, &vertex_buffer_ptr));
-        PHYSFS_seek(prep->fh, 0);
-        PHYSFS_readBytes(prep->fh, vertex_buffer_ptr, 76768);
-        vmaUnmapMemory(DisplayHost::allocator(), m_vertex_mem);
-        if ((prep->vertex_buffer.flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)
-            vmaFlushAllocation(DisplayHost::allocator(), m_vertex_mem, 0, VK_WHOLE_SIZE);
-    } else {
-        VkBufferCopy2 copy {};
-        copy.sType = VK_STRUCTURE_TYPE_BUFFER_COPY_2;
-        copy.srcOffset = offset;
-        copy.dstOffset = 0;
-        copy.size = 76768;
-
-        PHYSFS_seek(prep->fh, 0);
-        PHYSFS_readBytes(prep->fh, commands.window(offset).data(), 76768);
-        commands.copy_buffer(m_vertex_buffer, 76768, std::span(&copy, 1), VK_PIPELINE_STAGE_2_VERTEX_INPUT_BIT, VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT);
-        staged_size += 76768;
+    if (prep->host_written == false) {
+        // Buffers the host can write are read straight into, both at once. They're unmapped once the reads land,
+        // which only has to happen before the pass is submitted.
+        std::vector<AsyncIO::Read> reads;
+        void *vertex_buffer_ptr = nullptr, *index_buffer_ptr = nullptr;
+        if (prep->vertex_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            VK_DEMAND(vmaMapMemory(DisplayHost::allocator(), m_vertex_mem, &vertex_buffer_ptr));
+            prep->file.read_async(prep->vertex_buffer.file_offset, vertex_buffer_ptr, prep->vertex_buffer.size, reads);
+        }
+        if (prep->index_buffer.handle && (prep->index_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+            VK_DEMAND(vmaMapMemory(DisplayHost::allocator(), m_index_mem, &index_buffer_ptr));
+            prep->file.read_async(prep->index_buffer.file_offset, index_buffer_ptr, prep->index_buffer.size, reads);
+        }
+        if (vertex_buffer_ptr || index_buffer_ptr) {
+            VmaAllocation vertex_mem = vertex_buffer_ptr ? m_vertex_mem : VK_NULL_HANDLE, index_mem = index_buffer_ptr ? m_index_mem : VK_NULL_HANDLE;
+            bool vertex_coherent = prep->vertex_buffer.flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            bool index_coherent = prep->index_buffer.flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            JobSystem::JobRef written = JobSystem::create([vertex_mem, index_mem, vertex_coherent, index_coherent]() {
+                if (vertex_mem) {
+                    vmaUnmapMemory(DisplayHost::allocator(), vertex_mem);
+                    if (vertex_coherent == false)
+                        vmaFlushAllocation(DisplayHost::allocator(), vertex_mem, 0, VK_WHOLE_SIZE);
+                }
+                if (index_mem) {
+                    vmaUnmapMemory(DisplayHost::allocator(), index_mem);
+                    if (index_coherent == false)
+                        vmaFlushAllocation(DisplayHost::allocator(), index_mem, 0, VK_WHOLE_SIZE);
+                }
+            });
+            JobSystem::depend(written, AsyncIO::read(std::move(reads)));
+            JobSystem::submit(written);
+            commands.await_reads(std::move(written));
+        }
+        prep->host_written = true;
     }
-    if (prep->index_buffer.handle && (prep->index_buffer.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
-        void* index_buffer_ptr;
-        VK_DEMAND(vmaMapMemory(DisplayHost::allocator(), m_index_mem, &index_buffer_ptr));
-        PHYSFS_seek(prep->fh, 76768);
-        PHYSFS_readBytes(prep->fh, index_buffer_ptr, 25272);
-        vmaUnmapMemory(DisplayHost::allocator(), m_index_mem);
-        if ((prep->index_buffer.flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)
-            vmaFlushAllocation(DisplayHost::allocator(), m_index_mem, 0, VK_WHOLE_SIZE);
-    } else {
+
+    // Walk the staged byte stream from where the last pass stopped, splitting the piece at buffer boundaries. Reads
+    // into staging only have to land before the pass is submitted.
+    std::vector<AsyncIO::Read> reads;
+    size_t staged = 0;
+    VkDeviceSize segment_begin = 0;
+    for (auto it = prep->segments.begin(); it != prep->segments.end() && staged < size; segment_begin += it->size, ++it) {
+        if (prep->cursor >= segment_begin + it->size)
+            continue;
+
         VkBufferCopy2 copy {};
         copy.sType = VK_STRUCTURE_TYPE_BUFFER_COPY_2;
-        copy.srcOffset = offset;
-        copy.dstOffset = 0;
-        copy.size = 25272;
-
-        PHYSFS_seek(prep->fh, 76768);
-        PHYSFS_readBytes(prep->fh, commands.window(offset).data(), 25272);
-        commands.copy_buffer(m_vertex_buffer, 25272, std::span(&copy, 1), VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT, VK_ACCESS_2_INDEX_READ_BIT);
-        staged_size += 25272;
+        copy.srcOffset = offset + staged;
+        copy.dstOffset = prep->cursor - segment_begin;
+        copy.size = std::min(it->size - copy.dstOffset, size - staged);
+
+        prep->file.read_async(it->file_offset + copy.dstOffset, commands.window(copy.srcOffset).data(), copy.size, reads);
+        commands.copy_buffer(it->dst, it->size, std::span(&copy, 1), it->dst_stage, it->dst_access, copy.dstOffset + copy.size == it->size);
+        prep->cursor += copy.size;
+        staged += copy.size;
     }
-    return staged_size;
+    if (reads.empty() == false)
+        commands.await_reads(AsyncIO::read(std::move(reads)));
+    return staged;
 }
 
 }
@@ -275,9 +275,13 @@ bool DisplayHost::pick_physical_device()
     }
 
         DEMAND_FEATURE(available_features.features, depthClamp);
+        DEMAND_FEATURE(available_features.features, drawIndirectFirstInstance);
+        DEMAND_FEATURE(available_features.features, fragmentStoresAndAtomics);
+        DEMAND_FEATURE(available_features.features, multiDrawIndirect);
         DEMAND_FEATURE(available_features12, descriptorBindingSampledImageUpdateAfterBind);
         DEMAND_FEATURE(available_features12, descriptorBindingVariableDescriptorCount);
         DEMAND_FEATURE(available_features12, descriptorIndexing);
+        DEMAND_FEATURE(available_features12, drawIndirectCount);
         DEMAND_FEATURE(available_features12, timelineSemaphore);
         DEMAND_FEATURE(available_features12, uniformBufferStandardLayout);
         DEMAND_FEATURE(available_features13, synchronization2);
@@ -341,6 +345,7 @@ bool DisplayHost::create_logical_device()
     std::vector<const char*> extensions;
     std::vector<VkExtensionProperties> available_extensions;
     uint32_t count;
+    bool memory_budget = false;
 
     vkEnumerateDeviceExtensionProperties(m_hwd, nullptr, &count, nullptr);
     available_extensions.resize(count);
@@ -352,6 +357,10 @@ bool DisplayHost::create_logical_device()
             extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
         if (strcmp(VK_EXT_ROBUSTNESS_2_EXTENSION_NAME, ext.extensionName) == 0)
             extensions.push_back(VK_EXT_ROBUSTNESS_2_EXTENSION_NAME);
+        if (strcmp(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, ext.extensionName) == 0) {
+            extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+            memory_budget = true;
+        }
     }
 
     VkPhysicalDeviceDriverProperties driver {};
@@ -438,6 +447,10 @@ bool DisplayHost::create_logical_device()
     VmaAllocatorCreateInfo allocator_ci {};
     VmaVulkanFunctions vfn {};
     allocator_ci.flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
+    if (memory_budget) {
+        // Without it, VMA estimates budgets from heap sizes and its own allocations.
+        allocator_ci.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+    }
     allocator_ci.physicalDevice = m_hwd;
     allocator_ci.device = m_device;
     allocator_ci.instance = m_instance;
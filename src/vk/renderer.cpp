@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cinttypes>
 #include <set>
 #include "display.h"
 #include "embedded_shaders.h"
@@ -5,26 +7,41 @@
 
 namespace twogame {
 
+IRenderer* IRenderer::s_self = nullptr;
+
 IRenderer::IRenderer()
     : m_perspective_projection(GLMS_MAT4_ZERO_INIT)
     , m_ortho_projection(GLMS_MAT4_ZERO_INIT)
     , m_descriptor_layouts(3)
     , m_render_pass(VK_NULL_HANDLE)
 {
-    VkPhysicalDeviceProperties hwd_props;
-    vkGetPhysicalDeviceProperties(DisplayHost::hardware_device(), &hwd_props);
+    VkPhysicalDeviceProperties2 hwd_props2 {};
+    VkPhysicalDeviceVulkan12Properties hwd_props12 {};
+    hwd_props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    hwd_props2.pNext = &hwd_props12;
+    hwd_props12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+    vkGetPhysicalDeviceProperties2(DisplayHost::hardware_device(), &hwd_props2);
+    const VkPhysicalDeviceProperties& hwd_props = hwd_props2.properties;
+    SDL_assert(s_self == nullptr);
+    s_self = this;
 
     VkBufferCreateInfo buffer_ci {};
     VmaAllocationCreateInfo alloc_ci {};
     VmaAllocationInfo alloc_info;
     buffer_ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    buffer_ci.size = 4 * sizeof(mat4);
-    buffer_ci.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    buffer_ci.size = SIMULTANEOUS_FRAMES * TRANSIENT_CAPACITY;
+    buffer_ci.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
     buffer_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     alloc_ci.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
     alloc_ci.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
-    VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &buffer_ci, &alloc_ci, &m_uniform_buffer, &m_uniform_buffer_mem, &alloc_info));
-    m_uniform_buffer_ptr = static_cast<std::byte*>(alloc_info.pMappedData);
+    VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &buffer_ci, &alloc_ci, &m_transient_buffer, &m_transient_mem, &alloc_info));
+    m_transient_ptr = static_cast<std::byte*>(alloc_info.pMappedData);
+    m_uniform_alignment = hwd_props.limits.minUniformBufferOffsetAlignment;
+
+    VkBufferDeviceAddressInfo bda_info {};
+    bda_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+    bda_info.buffer = m_transient_buffer;
+    m_transient_address = vkGetBufferDeviceAddress(DisplayHost::device(), &bda_info);
 
     VkSamplerCreateInfo sampler_info {};
     sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -52,18 +69,22 @@ IRenderer::IRenderer()
 
     binding_layout_ci.bindingCount = 1;
     bindings[0].binding = 0;
-    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     bindings[0].descriptorCount = 1;
-    bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
     VK_DEMAND(vkCreateDescriptorSetLayout(DisplayHost::device(), &binding_layout_ci, nullptr, &m_descriptor_layouts[1]));
 
+    m_picturebook_capacity = std::min({ PICTUREBOOK_CAPACITY,
+        hwd_props12.maxPerStageDescriptorUpdateAfterBindSampledImages, hwd_props12.maxPerStageDescriptorUpdateAfterBindSamplers,
+        hwd_props12.maxDescriptorSetUpdateAfterBindSampledImages, hwd_props12.maxDescriptorSetUpdateAfterBindSamplers });
     binding_layout_ci.pNext = &binding_flags_ci;
+    binding_layout_ci.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
     binding_layout_ci.bindingCount = binding_flags_ci.bindingCount = 1;
     bindings[0].binding = 0;
     bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    bindings[0].descriptorCount = PICTUREBOOK_CAPACITY;
+    bindings[0].descriptorCount = m_picturebook_capacity;
     bindings[0].stageFlags = VK_SHADER_STAGE_ALL;
-    binding_flags[0] = VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    binding_flags[0] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
     VK_DEMAND(vkCreateDescriptorSetLayout(DisplayHost::device(), &binding_layout_ci, nullptr, &m_descriptor_layouts[2]));
 
     std::array<VkDescriptorSetLayout, 3> set_layouts;
@@ -75,7 +96,7 @@ IRenderer::IRenderer()
     pipeline_layout_ci.pPushConstantRanges = &push_constant_range;
     push_constant_range.stageFlags = VK_SHADER_STAGE_ALL;
     push_constant_range.offset = 0;
-    push_constant_range.size = 3 * sizeof(uint64_t);
+    push_constant_range.size = 4 * sizeof(uint64_t);
 
     pipeline_layout_ci.setLayoutCount = 3;
     set_layouts[0] = m_descriptor_layouts[1];
@@ -83,16 +104,28 @@ IRenderer::IRenderer()
     set_layouts[2] = m_descriptor_layouts[2];
     VK_DEMAND(vkCreatePipelineLayout(DisplayHost::device(), &pipeline_layout_ci, nullptr, &m_graphics_pipeline_layouts[static_cast<size_t>(GraphicsPipeline::GPass)]));
 
+    pipeline_layout_ci.setLayoutCount = 1;
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.size = sizeof(CullParams);
+    set_layouts[0] = m_descriptor_layouts[1];
+    VK_DEMAND(vkCreatePipelineLayout(DisplayHost::device(), &pipeline_layout_ci, nullptr, &m_compute_pipeline_layouts[static_cast<size_t>(ComputePipeline::Cull)]));
+
     std::array<VkDescriptorPoolSize, 1> pool_sizes {};
     VkDescriptorPoolCreateInfo descriptor_pool_ci {};
     descriptor_pool_ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     descriptor_pool_ci.maxSets = 2 + 2 * static_cast<size_t>(GraphicsPipeline::MAX_VALUE);
     descriptor_pool_ci.poolSizeCount = pool_sizes.size();
     descriptor_pool_ci.pPoolSizes = pool_sizes.data();
-    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     pool_sizes[0].descriptorCount = 1;
     VK_DEMAND(vkCreateDescriptorPool(DisplayHost::device(), &descriptor_pool_ci, nullptr, &m_graphics_descriptor_pool));
 
+    descriptor_pool_ci.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    descriptor_pool_ci.maxSets = SIMULTANEOUS_FRAMES;
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pool_sizes[0].descriptorCount = SIMULTANEOUS_FRAMES * m_picturebook_capacity;
+    VK_DEMAND(vkCreateDescriptorPool(DisplayHost::device(), &descriptor_pool_ci, nullptr, &m_picturebook_pool));
+
     VkDescriptorSetAllocateInfo descriptor_alloc_info {};
     auto m_descriptor_set_1_layouts = std::to_array<VkDescriptorSetLayout>({
         m_descriptor_layouts[0],
@@ -101,34 +134,31 @@ IRenderer::IRenderer()
     descriptor_alloc_info.descriptorPool = m_graphics_descriptor_pool;
     descriptor_alloc_info.descriptorSetCount = 1;
     descriptor_alloc_info.pSetLayouts = &m_descriptor_layouts[1];
-    VK_DEMAND(vkAllocateDescriptorSets(DisplayHost::device(), &descriptor_alloc_info, &m_descriptor_set_0[0]));
-    VK_DEMAND(vkAllocateDescriptorSets(DisplayHost::device(), &descriptor_alloc_info, &m_descriptor_set_0[1]));
+    VK_DEMAND(vkAllocateDescriptorSets(DisplayHost::device(), &descriptor_alloc_info, &m_descriptor_set_0));
     descriptor_alloc_info.descriptorSetCount = m_descriptor_set_1_layouts.size();
     descriptor_alloc_info.pSetLayouts = m_descriptor_set_1_layouts.data();
     VK_DEMAND(vkAllocateDescriptorSets(DisplayHost::device(), &descriptor_alloc_info, m_descriptor_set_1[0].data()));
     VK_DEMAND(vkAllocateDescriptorSets(DisplayHost::device(), &descriptor_alloc_info, m_descriptor_set_1[1].data()));
-
-    std::array<VkWriteDescriptorSet, 2> descriptor_writes {};
-    std::array<VkDescriptorBufferInfo, 2> descriptor_buffer_writes {};
-    descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_writes[0].dstSet = m_descriptor_set_0[0];
-    descriptor_writes[0].dstBinding = 0;
-    descriptor_writes[0].descriptorCount = 1;
-    descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptor_writes[0].pBufferInfo = &descriptor_buffer_writes[0];
-    descriptor_buffer_writes[0].buffer = m_uniform_buffer;
-    descriptor_buffer_writes[0].offset = 0;
-    descriptor_buffer_writes[0].range = 2 * sizeof(mat4);
-    descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_writes[1].dstSet = m_descriptor_set_0[1];
-    descriptor_writes[1].dstBinding = 0;
-    descriptor_writes[1].descriptorCount = 1;
-    descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptor_writes[1].pBufferInfo = &descriptor_buffer_writes[1];
-    descriptor_buffer_writes[1].buffer = m_uniform_buffer;
-    descriptor_buffer_writes[1].offset = 2 * sizeof(mat4);
-    descriptor_buffer_writes[1].range = 2 * sizeof(mat4);
-    vkUpdateDescriptorSets(DisplayHost::device(), descriptor_writes.size(), descriptor_writes.data(), 0, nullptr);
+    std::array<VkDescriptorSetLayout, SIMULTANEOUS_FRAMES> picturebook_layouts;
+    picturebook_layouts.fill(m_descriptor_layouts[2]);
+    descriptor_alloc_info.descriptorPool = m_picturebook_pool;
+    descriptor_alloc_info.descriptorSetCount = picturebook_layouts.size();
+    descriptor_alloc_info.pSetLayouts = picturebook_layouts.data();
+    VK_DEMAND(vkAllocateDescriptorSets(DisplayHost::device(), &descriptor_alloc_info, m_picturebook.data()));
+
+    // Set 0 is written once: each frame's PerFrameData is found through a dynamic offset into the transient buffer.
+    VkWriteDescriptorSet descriptor_write {};
+    VkDescriptorBufferInfo descriptor_buffer_write {};
+    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_write.dstSet = m_descriptor_set_0;
+    descriptor_write.dstBinding = 0;
+    descriptor_write.descriptorCount = 1;
+    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    descriptor_write.pBufferInfo = &descriptor_buffer_write;
+    descriptor_buffer_write.buffer = m_transient_buffer;
+    descriptor_buffer_write.offset = 0;
+    descriptor_buffer_write.range = 2 * sizeof(mat4);
+    vkUpdateDescriptorSets(DisplayHost::device(), 1, &descriptor_write, 0, nullptr);
 
     resize_frames(DisplayHost::swapchain_extent());
 }
@@ -147,36 +177,340 @@ IRenderer::~IRenderer()
     for (auto it = unique_pipeline_layouts.begin(); it != unique_pipeline_layouts.end(); ++it)
         vkDestroyPipelineLayout(DisplayHost::device(), *it, nullptr);
     vkDestroyDescriptorPool(DisplayHost::device(), m_graphics_descriptor_pool, nullptr);
+    vkDestroyDescriptorPool(DisplayHost::device(), m_picturebook_pool, nullptr);
     for (auto it = m_descriptor_layouts.begin(); it != m_descriptor_layouts.end(); ++it)
         vkDestroyDescriptorSetLayout(DisplayHost::device(), *it, nullptr);
     vkDestroyRenderPass(DisplayHost::device(), m_render_pass, nullptr);
     vkDestroySampler(DisplayHost::device(), m_sampler, nullptr);
-    vmaDestroyBuffer(DisplayHost::allocator(), m_uniform_buffer, m_uniform_buffer_mem);
+    vmaDestroyBuffer(DisplayHost::allocator(), m_transient_buffer, m_transient_mem);
+    for (auto it = m_instance_arenas.begin(); it != m_instance_arenas.end(); ++it) {
+        release(it->instances);
+        release(it->draws);
+        release(it->counts);
+        release(it->models);
+        release(it->objects);
+    }
+    s_self = nullptr;
 }
 
-std::span<std::byte> IRenderer::descriptor_buffer(int frame, int set, int binding)
+IRenderer::TransientRing& IRenderer::transient_ring(uint32_t frame_number)
 {
-    frame %= SIMULTANEOUS_FRAMES;
+    TransientRing& ring = m_transient_rings[frame_number % SIMULTANEOUS_FRAMES];
+    if (ring.frame_number != frame_number) {
+        ring.frame_number = frame_number;
+        ring.head = ring.flushed = 0;
+        ring.uniforms = UINT32_MAX;
+    }
+    return ring;
+}
 
-    if (set == 0 && binding == 0) {
-        if (frame == 0)
-            return std::span(m_uniform_buffer_ptr + 0, 2 * sizeof(mat4));
-        if (frame == 1)
-            return std::span(m_uniform_buffer_ptr + 2 * sizeof(mat4), 2 * sizeof(mat4));
+IRenderer::Transient IRenderer::allocate_transient(uint32_t frame_number, VkDeviceSize size, VkDeviceSize alignment)
+{
+    SDL_assert((alignment & (alignment - 1)) == 0);
+    TransientRing& ring = transient_ring(frame_number);
+    VkDeviceSize region = (frame_number % SIMULTANEOUS_FRAMES) * TRANSIENT_CAPACITY;
+    VkDeviceSize offset = (ring.head + alignment - 1) & ~(alignment - 1);
+    if (offset + size > TRANSIENT_CAPACITY) {
+        SDL_LogCritical(SDL_LOG_CATEGORY_GPU, "transient memory exhausted: F%u wants %" PRIu64 " more bytes", frame_number, size);
+        SDL_assert_release(offset + size <= TRANSIENT_CAPACITY);
     }
-    return {};
+    ring.head = offset + size;
+
+    Transient allocation;
+    allocation.data = std::span(m_transient_ptr + region + offset, size);
+    allocation.address = m_transient_address + region + offset;
+    allocation.offset = region + offset;
+    return allocation;
+}
+
+std::span<std::byte> IRenderer::frame_uniforms(uint32_t frame_number)
+{
+    TransientRing& ring = transient_ring(frame_number);
+    if (ring.uniforms == UINT32_MAX)
+        ring.uniforms = allocate_transient(frame_number, 2 * sizeof(mat4), m_uniform_alignment).offset;
+    return std::span(m_transient_ptr + ring.uniforms, 2 * sizeof(mat4));
 }
 
-void IRenderer::flush_descriptor_buffers()
+void IRenderer::flush_transient(uint32_t frame_number)
 {
-    vmaFlushAllocation(DisplayHost::allocator(), m_uniform_buffer_mem, 0, VK_WHOLE_SIZE);
+    // Only what was written since the last flush; on coherent memory, this does nothing at all.
+    TransientRing& ring = transient_ring(frame_number);
+    VkDeviceSize region = (frame_number % SIMULTANEOUS_FRAMES) * TRANSIENT_CAPACITY;
+    if (ring.head > ring.flushed)
+        vmaFlushAllocation(DisplayHost::allocator(), m_transient_mem, region + ring.flushed, ring.head - ring.flushed);
+    ring.flushed = ring.head;
+}
+
+uint32_t IRenderer::acquire_picture(VkImageView view)
+{
+    std::lock_guard lock(s_self->m_picturebook_lock);
+    uint32_t slot;
+    if (s_self->m_picturebook_free.empty()) {
+        slot = s_self->m_picturebook_views.size();
+        if (slot >= s_self->m_picturebook_capacity) {
+            SDL_LogCritical(SDL_LOG_CATEGORY_GPU, "picture book full: all %u slots are taken", s_self->m_picturebook_capacity);
+            SDL_assert_release(slot < s_self->m_picturebook_capacity);
+        }
+        s_self->m_picturebook_views.push_back(view);
+    } else {
+        slot = s_self->m_picturebook_free.back();
+        s_self->m_picturebook_free.pop_back();
+        s_self->m_picturebook_views[slot] = view;
+    }
+    for (auto it = s_self->m_picturebook_dirty.begin(); it != s_self->m_picturebook_dirty.end(); ++it)
+        it->push_back(slot);
+    return slot;
+}
+
+void IRenderer::replace_picture(uint32_t slot, VkImageView view)
+{
+    std::lock_guard lock(s_self->m_picturebook_lock);
+    s_self->m_picturebook_views[slot] = view;
+    for (auto it = s_self->m_picturebook_dirty.begin(); it != s_self->m_picturebook_dirty.end(); ++it)
+        it->push_back(slot);
+}
+
+void IRenderer::release_picture(uint32_t slot)
+{
+    // Images outlive the renderer at shutdown. A released slot keeps its stale descriptor: the binding is partially
+    // bound, and nothing samples it until it is handed out again.
+    if (s_self == nullptr)
+        return;
+    std::lock_guard lock(s_self->m_picturebook_lock);
+    s_self->m_picturebook_views[slot] = VK_NULL_HANDLE;
+    s_self->m_picturebook_free.push_back(slot);
+}
+
+void IRenderer::write_picturebook(uint32_t frame_number)
+{
+    // The last frame that used this copy has completed.
+    std::vector<uint32_t> slots;
+    std::vector<VkDescriptorImageInfo> image_infos;
+    {
+        std::lock_guard lock(m_picturebook_lock);
+        slots.swap(m_picturebook_dirty[frame_number % SIMULTANEOUS_FRAMES]);
+        std::sort(slots.begin(), slots.end());
+        slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+        for (auto it = slots.begin(); it != slots.end(); ++it) {
+            VkDescriptorImageInfo& image_info = image_infos.emplace_back();
+            image_info.sampler = m_sampler;
+            image_info.imageView = m_picturebook_views[*it];
+            image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        }
+    }
+
+    std::vector<VkWriteDescriptorSet> writes;
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (image_infos[i].imageView == VK_NULL_HANDLE)
+            continue;
+        VkWriteDescriptorSet& write = writes.emplace_back();
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = m_picturebook[frame_number % SIMULTANEOUS_FRAMES];
+        write.dstBinding = 0;
+        write.dstArrayElement = slots[i];
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        write.pImageInfo = &image_infos[i];
+    }
+    if (writes.empty() == false)
+        vkUpdateDescriptorSets(DisplayHost::device(), writes.size(), writes.data(), 0, nullptr);
 }
 
 void IRenderer::bind_pipeline(VkCommandBuffer cmd, GraphicsPipeline pass, int frame_number)
 {
-    std::array<VkDescriptorSet, 2> sets = { m_descriptor_set_0[frame_number % SIMULTANEOUS_FRAMES], m_descriptor_set_1[frame_number % SIMULTANEOUS_FRAMES][static_cast<size_t>(pass)] };
+    uint32_t uniforms = m_transient_rings[frame_number % SIMULTANEOUS_FRAMES].uniforms;
+    SDL_assert(uniforms != UINT32_MAX);
+    std::array<VkDescriptorSet, 3> sets = { m_descriptor_set_0, m_descriptor_set_1[frame_number % SIMULTANEOUS_FRAMES][static_cast<size_t>(pass)], m_picturebook[frame_number % SIMULTANEOUS_FRAMES] };
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_graphics_pipelines[static_cast<size_t>(pass)]);
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_graphics_pipeline_layouts[static_cast<size_t>(pass)], 0, sets.size(), sets.data(), 0, nullptr);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_graphics_pipeline_layouts[static_cast<size_t>(pass)], 0, sets.size(), sets.data(), 1, &uniforms);
+}
+
+void IRenderer::bind_pipeline(VkCommandBuffer cmd, ComputePipeline pass, int frame_number)
+{
+    uint32_t uniforms = m_transient_rings[frame_number % SIMULTANEOUS_FRAMES].uniforms;
+    SDL_assert(uniforms != UINT32_MAX);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_compute_pipelines[static_cast<size_t>(pass)]);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_compute_pipeline_layouts[static_cast<size_t>(pass)], 0, 1, &m_descriptor_set_0, 1, &uniforms);
+}
+
+void IRenderer::reserve(GrowableBuffer& buffer, VkDeviceSize size, VkBufferUsageFlags usage, bool host)
+{
+    if (size <= buffer.capacity)
+        return;
+
+    // Buffers are only grown while recording the frame that uses them; the last frame that did has completed.
+    VkBufferCreateInfo buffer_ci {};
+    VmaAllocationCreateInfo alloc_ci {};
+    VmaAllocationInfo alloc_info;
+    buffer_ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_ci.size = std::max({ size, 2 * buffer.capacity, VkDeviceSize(64 * 1024) });
+    buffer_ci.usage = usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    buffer_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    alloc_ci.flags = host ? VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT : 0;
+    alloc_ci.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+
+    GrowableBuffer grown;
+    VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &buffer_ci, &alloc_ci, &grown.buffer, &grown.mem, &alloc_info));
+    grown.ptr = static_cast<std::byte*>(alloc_info.pMappedData);
+    grown.capacity = buffer_ci.size;
+
+    VkBufferDeviceAddressInfo bda_info {};
+    bda_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+    bda_info.buffer = grown.buffer;
+    grown.address = vkGetBufferDeviceAddress(DisplayHost::device(), &bda_info);
+    if (host && buffer.ptr)
+        memcpy(grown.ptr, buffer.ptr, buffer.capacity);
+
+    release(buffer);
+    buffer = grown;
+}
+
+void IRenderer::release(GrowableBuffer& buffer)
+{
+    if (buffer.buffer)
+        vmaDestroyBuffer(DisplayHost::allocator(), buffer.buffer, buffer.mem);
+    buffer = GrowableBuffer {};
+}
+
+IRenderer::InstanceArena& IRenderer::instance_arena(uint32_t frame_number)
+{
+    // The arena starts over with the first instance pushed for a frame.
+    InstanceArena& arena = m_instance_arenas[frame_number % SIMULTANEOUS_FRAMES];
+    if (arena.frame_number != frame_number) {
+        arena.frame_number = frame_number;
+        arena.instance_count = 0;
+        arena.batch_index.clear();
+        arena.batch_sizes.clear();
+        arena.runs.clear();
+    }
+    return arena;
+}
+
+void IRenderer::push_instance(uint32_t frame_number, const asset::Mesh* mesh, uint32_t submesh, uint32_t material, const mat4s& model)
+{
+    push_instances(frame_number, mesh, submesh, material, std::span(&model, 1));
+}
+
+void IRenderer::push_instances(uint32_t frame_number, const asset::Mesh* mesh, uint32_t submesh, uint32_t material, std::span<const mat4s> models)
+{
+    InstanceArena& arena = instance_arena(frame_number);
+    SDL_assert(submesh < mesh->submeshes().size());
+    if (models.empty())
+        return;
+
+    auto batch = arena.batch_index.try_emplace(std::make_tuple(mesh, submesh, material), arena.batch_sizes.size()).first;
+    if (batch->second == arena.batch_sizes.size())
+        arena.batch_sizes.push_back(0);
+    arena.batch_sizes[batch->second] += models.size();
+
+    reserve(arena.instances, (arena.instance_count + models.size()) * sizeof(CullInstance), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, true);
+    CullInstance* instances = reinterpret_cast<CullInstance*>(arena.instances.ptr) + arena.instance_count;
+    for (size_t i = 0; i < models.size(); i++) {
+        memcpy(instances[i].model, models[i].raw, sizeof(mat4));
+        instances[i].batch = batch->second;
+    }
+    arena.instance_count += models.size();
+}
+
+void IRenderer::record_cull(VkCommandBuffer cmd, uint32_t frame_number)
+{
+    InstanceArena& arena = instance_arena(frame_number);
+    uint32_t batch_count = arena.batch_sizes.size();
+    if (batch_count == 0)
+        return;
+
+    // Lay the batches out: batch_index is ordered by mesh first, so each mesh's draws end up next to each other.
+    Transient batch_memory = allocate_transient(frame_number, batch_count * sizeof(CullBatch), alignof(CullBatch));
+    CullBatch* batches = reinterpret_cast<CullBatch*>(batch_memory.data.data());
+    uint32_t first_instance = 0, first_draw = 0;
+    for (auto it = arena.batch_index.begin(); it != arena.batch_index.end(); ++it) {
+        const asset::Mesh* mesh = std::get<0>(it->first);
+        if (arena.runs.empty() || arena.runs.back().first != mesh)
+            arena.runs.emplace_back(mesh, 0);
+
+        const asset::Mesh::Submesh& submesh = mesh->submeshes()[std::get<1>(it->first)];
+        CullBatch& batch = batches[it->second];
+        batch.bounds_min = glms_vec4(submesh.bounds_min, 1.f);
+        batch.bounds_max = glms_vec4(submesh.bounds_max, 1.f);
+        batch.first_index = submesh.first_index;
+        batch.index_count = submesh.index_count;
+        batch.vertex_offset = submesh.vertex_offset;
+        batch.material = std::get<2>(it->first);
+        batch.first_instance = first_instance;
+        batch.run = arena.runs.size() - 1;
+        batch.first_draw = first_draw - arena.runs.back().second;
+        first_instance += arena.batch_sizes[it->second];
+        first_draw++;
+        arena.runs.back().second++;
+    }
+    vmaFlushAllocation(DisplayHost::allocator(), arena.instances.mem, 0, arena.instance_count * sizeof(CullInstance));
+    flush_transient(frame_number);
+
+    VkDeviceSize counts_size = (batch_count + arena.runs.size()) * sizeof(uint32_t);
+    reserve(arena.draws, batch_count * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, false);
+    reserve(arena.counts, counts_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, false);
+    reserve(arena.models, arena.instance_count * sizeof(mat4), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, false);
+    reserve(arena.objects, arena.instance_count * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, false);
+
+    CullParams params {};
+    params.instances = arena.instances.address;
+    params.batches = batch_memory.address;
+    params.draws = arena.draws.address;
+    params.counts = arena.counts.address;
+    params.models = arena.models.address;
+    params.objects = arena.objects.address;
+    params.instance_count = arena.instance_count;
+    params.batch_count = batch_count;
+
+    VkMemoryBarrier2 barrier {};
+    VkDependencyInfo dep {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    dep.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dep.memoryBarrierCount = 1;
+    dep.pMemoryBarriers = &barrier;
+
+    vkCmdFillBuffer(cmd, arena.counts.buffer, 0, counts_size, 0);
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    vkCmdPipelineBarrier2(cmd, &dep);
+
+    // The first pass culls instances and counts the visible ones per batch; the second writes a draw per batch.
+    bind_pipeline(cmd, ComputePipeline::Cull, frame_number);
+    vkCmdPushConstants(cmd, m_compute_pipeline_layouts[static_cast<size_t>(ComputePipeline::Cull)], VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullParams), &params);
+    vkCmdDispatch(cmd, (arena.instance_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    vkCmdPipelineBarrier2(cmd, &dep);
+
+    params.pass = 1;
+    vkCmdPushConstants(cmd, m_compute_pipeline_layouts[static_cast<size_t>(ComputePipeline::Cull)], VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullParams), &params);
+    vkCmdDispatch(cmd, (batch_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+    vkCmdPipelineBarrier2(cmd, &dep);
+}
+
+void IRenderer::draw_instances(VkCommandBuffer cmd, uint32_t frame_number, size_t first_run, size_t run_count)
+{
+    // Only reads the arena, so command buffers on several threads can each draw a share of the runs.
+    const InstanceArena& arena = m_instance_arenas[frame_number % SIMULTANEOUS_FRAMES];
+    if (arena.frame_number != frame_number || first_run >= arena.runs.size())
+        return;
+
+    auto end = arena.runs.begin() + first_run + std::min(run_count, arena.runs.size() - first_run);
+    VkDeviceSize first_draw = 0, count_offset = (arena.batch_sizes.size() + first_run) * sizeof(uint32_t);
+    for (auto it = arena.runs.begin(); it != arena.runs.begin() + first_run; ++it)
+        first_draw += it->second;
+    for (auto it = arena.runs.begin() + first_run; it != end; ++it) {
+        it->first->bind_buffers(cmd);
+        vkCmdDrawIndexedIndirectCount(cmd, arena.draws.buffer, first_draw * sizeof(VkDrawIndexedIndirectCommand), arena.counts.buffer, count_offset, it->second, sizeof(VkDrawIndexedIndirectCommand));
+        first_draw += it->second;
+        count_offset += sizeof(uint32_t);
+    }
 }
 
 void IRenderer::resize_frames(VkExtent2D surface_extent)
@@ -267,7 +601,7 @@ void SimpleForwardRenderer::create_graphics_pipeline()
     p0_depth_att.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
     VK_DEMAND(vkCreateRenderPass2(DisplayHost::device(), &render_pass_ci, nullptr, &m_render_pass));
 
-    std::array<VkShaderModule, 2> shader_modules;
+    std::array<VkShaderModule, 3> shader_modules;
     VkShaderModuleCreateInfo shader_module_info {};
     shader_module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     shader_module_info.codeSize = shaders::basic_vert_size;
@@ -276,6 +610,9 @@ void SimpleForwardRenderer::create_graphics_pipeline()
     shader_module_info.codeSize = shaders::basic_frag_size;
     shader_module_info.pCode = shaders::basic_frag_spv;
     VK_DEMAND(vkCreateShaderModule(DisplayHost::device(), &shader_module_info, nullptr, &shader_modules[1]));
+    shader_module_info.codeSize = shaders::cull_comp_size;
+    shader_module_info.pCode = shaders::cull_comp_spv;
+    VK_DEMAND(vkCreateShaderModule(DisplayHost::device(), &shader_module_info, nullptr, &shader_modules[2]));
 
     std::array<VkPipelineShaderStageCreateInfo, 2> pipeline_shaders {};
     pipeline_shaders[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -383,6 +720,12 @@ void SimpleForwardRenderer::create_graphics_pipeline()
     VK_DEMAND(vkCreateGraphicsPipelines(DisplayHost::device(), DisplayHost::pipeline_cache(), graphics_pipeline_ci.size(), graphics_pipeline_ci.data(), nullptr, m_graphics_pipelines.data()));
 
     std::array<VkComputePipelineCreateInfo, static_cast<size_t>(ComputePipeline::MAX_VALUE)> compute_pipeline_ci {};
+    compute_pipeline_ci[0].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    compute_pipeline_ci[0].stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    compute_pipeline_ci[0].stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    compute_pipeline_ci[0].stage.module = shader_modules[2];
+    compute_pipeline_ci[0].stage.pName = "main";
+    compute_pipeline_ci[0].layout = m_compute_pipeline_layouts[0];
     if constexpr (compute_pipeline_ci.empty() == false)
         VK_DEMAND(vkCreateComputePipelines(DisplayHost::device(), DisplayHost::pipeline_cache(), compute_pipeline_ci.size(), compute_pipeline_ci.data(), nullptr, m_compute_pipelines.data()));
 
@@ -504,6 +847,7 @@ IRenderer::Output SimpleForwardRenderer::draw(uint32_t frame_number)
     render_pass_begin.pClearValues = clear_values.data();
     SceneHost::wait_frame(frame_number);
 
+    SceneHost::execute_computes(frame.ctx.command_container, frame_number);
     for (size_t i = 0; i < std::tuple_size<AllSubpasses>::value; i++) {
         if (i == 0)
             vkCmdBeginRenderPass(frame.ctx.command_container, &render_pass_begin, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
@@ -6,19 +6,120 @@ namespace twogame {
 
 std::unique_ptr<SceneHost> SceneHost::s_self;
 
-void SceneHost::StagingBuffer::copy_buffer(VkBuffer dst, VkDeviceSize dst_size, std::span<const VkBufferCopy2> regions, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access)
+SceneHost::StagingRing::StagingRing()
+    : m_head(0)
+    , m_tail(0)
 {
-    VkBufferMemoryBarrier2& barrier = m_buffer_memory_barriers.emplace_back();
-    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
-    barrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
-    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
-    barrier.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_INPUT_BIT;
-    barrier.dstAccessMask = VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT;
-    barrier.srcQueueFamilyIndex = DisplayHost::queue_family_index_dma();
-    barrier.dstQueueFamilyIndex = DisplayHost::queue_family_index();
-    barrier.buffer = dst;
-    barrier.offset = 0;
-    barrier.size = dst_size;
+    VkBufferCreateInfo buffer_ci {};
+    VmaAllocationCreateInfo alloc_ci {};
+    VmaAllocationInfo alloc_info;
+    buffer_ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_ci.size = STAGING_RING_SIZE;
+    buffer_ci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    buffer_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    alloc_ci.flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
+    alloc_ci.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &buffer_ci, &alloc_ci, &m_buffer, &m_mem, &alloc_info));
+    m_data = std::span(static_cast<std::byte*>(alloc_info.pMappedData), STAGING_RING_SIZE);
+
+    for (auto it = m_records.begin(); it != m_records.end(); ++it)
+        it->owner.store(nullptr, std::memory_order_relaxed);
+}
+
+SceneHost::StagingRing::~StagingRing()
+{
+    vmaDestroyBuffer(DisplayHost::allocator(), m_buffer, m_mem);
+}
+
+std::optional<VkDeviceSize> SceneHost::StagingRing::reserve(VkDeviceSize size, StagingBuffer* owner)
+{
+    size = (size + 15) & ~15;
+    SDL_assert_release(size <= STAGING_RING_SIZE);
+    while (true) {
+        uint64_t head = m_head.load(std::memory_order_acquire), tail = m_tail.load(std::memory_order_acquire);
+        uint64_t sequence = head >> POSITION_BITS, begin = head & POSITION_MASK;
+        if (begin % STAGING_RING_SIZE + size > STAGING_RING_SIZE)
+            begin += STAGING_RING_SIZE - begin % STAGING_RING_SIZE; // a reservation never straddles the end of the ring
+        uint64_t end = begin + size;
+
+        bool fits = ((end - tail) & POSITION_MASK) <= STAGING_RING_SIZE && ((sequence - (tail >> POSITION_BITS)) & SEQUENCE_MASK) < RECORD_COUNT;
+        if (fits == false) {
+            bool blocked_by_waiter = false;
+            if (reclaim(owner, blocked_by_waiter))
+                continue;
+            if (blocked_by_waiter)
+                return std::nullopt;
+
+            // The oldest reservation belongs to a pass that is still recording or whose copies are still running.
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+
+        if (m_head.compare_exchange_weak(head, pack(sequence + 1, end), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            Record& record = m_records[sequence % RECORD_COUNT];
+            record.serial = owner->m_serial.load(std::memory_order_relaxed);
+            record.end = end & POSITION_MASK;
+            record.owner.store(owner, std::memory_order_release);
+            return (begin & POSITION_MASK) % STAGING_RING_SIZE;
+        }
+    }
+}
+
+bool SceneHost::StagingRing::reclaim(const StagingBuffer* waiter, bool& blocked_by_waiter)
+{
+    std::unique_lock lock(m_reclaim_lock, std::try_to_lock);
+    if (lock.owns_lock() == false)
+        return true; // someone else is already moving the tail
+
+    uint64_t tail = m_tail.load(std::memory_order_relaxed), head = m_head.load(std::memory_order_acquire);
+    bool progress = false;
+    while ((tail >> POSITION_BITS) != (head >> POSITION_BITS)) {
+        Record& record = m_records[(tail >> POSITION_BITS) % RECORD_COUNT];
+        StagingBuffer* owner = record.owner.load(std::memory_order_acquire);
+        if (owner == nullptr)
+            break;
+        if (owner->m_serial.load(std::memory_order_relaxed) == record.serial && vkGetFenceStatus(DisplayHost::device(), owner->m_xfer_fence) != VK_SUCCESS) {
+            blocked_by_waiter = owner == waiter;
+            break;
+        }
+
+        record.owner.store(nullptr, std::memory_order_relaxed);
+        tail = pack((tail >> POSITION_BITS) + 1, record.end);
+        progress = true;
+    }
+    m_tail.store(tail, std::memory_order_release);
+    return progress;
+}
+
+void SceneHost::StagingRing::rearm(StagingBuffer& batch)
+{
+    // Resetting the fence must not race with reclaim() reading it.
+    std::lock_guard lock(m_reclaim_lock);
+    VK_DEMAND(vkResetFences(DisplayHost::device(), 1, &batch.m_xfer_fence));
+    batch.m_serial.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::optional<VkDeviceSize> SceneHost::StagingBuffer::reserve(VkDeviceSize size)
+{
+    return m_ring->reserve(size, this);
+}
+
+void SceneHost::StagingBuffer::copy_buffer(VkBuffer dst, VkDeviceSize dst_size, std::span<const VkBufferCopy2> regions, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access, bool last)
+{
+    std::lock_guard lock(m_record_lock);
+    if (last) {
+        VkBufferMemoryBarrier2& barrier = m_buffer_memory_barriers.emplace_back();
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+        barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        barrier.dstStageMask = dst_stage;
+        barrier.dstAccessMask = dst_access;
+        barrier.srcQueueFamilyIndex = DisplayHost::queue_family_index_dma();
+        barrier.dstQueueFamilyIndex = DisplayHost::queue_family_index();
+        barrier.buffer = dst;
+        barrier.offset = 0;
+        barrier.size = dst_size;
+    }
 
     auto& copy = m_buffer_copies.emplace_back();
     copy.second = std::vector(regions.begin(), regions.end());
@@ -29,7 +130,7 @@ void SceneHost::StagingBuffer::copy_buffer(VkBuffer dst, VkDeviceSize dst_size,
     copy.first.pRegions = copy.second.data();
 }
 
-void SceneHost::StagingBuffer::copy_image(VkImage dst, VkImageCreateInfo& info, std::span<const VkBufferImageCopy2> copies, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access, VkImageLayout final_layout)
+void SceneHost::StagingBuffer::copy_image(VkImage dst, VkImageCreateInfo& info, std::span<const VkBufferImageCopy2> copies, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access, VkImageLayout final_layout, bool first, bool last, uint32_t base_level, uint32_t level_count)
 {
     VkImageMemoryBarrier2 barrier {};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
@@ -43,12 +144,16 @@ void SceneHost::StagingBuffer::copy_image(VkImage dst, VkImageCreateInfo& info,
     barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.image = dst;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = info.mipLevels;
+    barrier.subresourceRange.baseMipLevel = base_level;
+    barrier.subresourceRange.levelCount = level_count;
     barrier.subresourceRange.baseArrayLayer = 0;
     barrier.subresourceRange.layerCount = info.arrayLayers;
-    m_image_memory_barriers[0].push_back(barrier);
 
+    std::lock_guard lock(m_record_lock);
+    if (first)
+        m_image_memory_barriers[0].push_back(barrier);
+
+    // Copies from earlier passes were submitted earlier to the same queue, so this barrier covers them too.
     barrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
     barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
     barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
@@ -57,7 +162,8 @@ void SceneHost::StagingBuffer::copy_image(VkImage dst, VkImageCreateInfo& info,
     barrier.newLayout = final_layout;
     barrier.srcQueueFamilyIndex = DisplayHost::queue_family_index_dma();
     barrier.dstQueueFamilyIndex = DisplayHost::queue_family_index();
-    m_image_memory_barriers[1].push_back(barrier);
+    if (last)
+        m_image_memory_barriers[1].push_back(barrier);
 
     auto& copy = m_image_copies.emplace_back();
     copy.second = std::vector(copies.begin(), copies.end());
@@ -69,8 +175,18 @@ void SceneHost::StagingBuffer::copy_image(VkImage dst, VkImageCreateInfo& info,
     copy.first.pRegions = copy.second.data();
 }
 
+void SceneHost::StagingBuffer::await_reads(JobSystem::JobRef&& reads)
+{
+    std::lock_guard lock(m_record_lock);
+    m_reads.push_back(std::move(reads));
+}
+
 void SceneHost::StagingBuffer::finalize()
 {
+    for (auto it = m_reads.begin(); it != m_reads.end(); ++it)
+        JobSystem::wait(*it);
+    m_reads.clear();
+
     VkCommandBufferBeginInfo begin_info {};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
@@ -112,7 +228,7 @@ SceneHost::SceneHost(IRenderer* renderer, IScene* initial)
     , m_active(true)
     , m_renderer(renderer)
 {
-    std::array<VkSemaphore, BUILDER_THREAD_COUNT> builder_sem;
+    std::array<VkSemaphore, STAGING_BUFFER_COUNT> builder_sem;
     VkSemaphoreCreateInfo sem_createinfo {};
     VkSemaphoreTypeCreateInfo sem_typeinfo {};
     sem_createinfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -122,7 +238,7 @@ SceneHost::SceneHost(IRenderer* renderer, IScene* initial)
     if (m_graphics_queue == m_transfer_queue) {
         builder_sem.fill(VK_NULL_HANDLE);
     } else {
-        for (size_t i = 0; i < BUILDER_THREAD_COUNT; i++)
+        for (size_t i = 0; i < STAGING_BUFFER_COUNT; i++)
             VK_DEMAND(vkCreateSemaphore(DisplayHost::device(), &sem_createinfo, nullptr, &builder_sem[i]));
     }
 
@@ -140,12 +256,12 @@ SceneHost::SceneHost(IRenderer* renderer, IScene* initial)
     pool_createinfo.queueFamilyIndex = DisplayHost::queue_family_index();
     VK_DEMAND(vkCreateCommandPool(DisplayHost::device(), &pool_createinfo, nullptr, &m_acquire_command_pool));
 
-    std::array<std::array<VkCommandBuffer, BUILDER_THREAD_COUNT>, 2> builder_commands;
+    std::array<std::array<VkCommandBuffer, STAGING_BUFFER_COUNT>, 2> builder_commands;
     VkCommandBufferAllocateInfo cmd_allocinfo {};
     cmd_allocinfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     cmd_allocinfo.commandPool = m_xfer_command_pool;
     cmd_allocinfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmd_allocinfo.commandBufferCount = BUILDER_THREAD_COUNT;
+    cmd_allocinfo.commandBufferCount = STAGING_BUFFER_COUNT;
     VK_DEMAND(vkAllocateCommandBuffers(DisplayHost::device(), &cmd_allocinfo, builder_commands[0].data()));
     if (m_graphics_queue == m_transfer_queue) {
         builder_commands[1].fill(VK_NULL_HANDLE);
@@ -154,94 +270,82 @@ SceneHost::SceneHost(IRenderer* renderer, IScene* initial)
         VK_DEMAND(vkAllocateCommandBuffers(DisplayHost::device(), &cmd_allocinfo, builder_commands[1].data()));
     }
 
-    VkBufferCreateInfo staging_createinfo {};
-    VmaAllocationCreateInfo staging_allocinfo {};
-    staging_createinfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    staging_createinfo.size = STAGING_BUFFER_SIZE;
-    staging_createinfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    staging_createinfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    staging_allocinfo.flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
-    staging_allocinfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
-    for (size_t i = 0; i < BUILDER_THREAD_COUNT; i++) {
-        VmaAllocationInfo staging_meminfo;
-        VK_DEMAND(vmaCreateBuffer(DisplayHost::allocator(), &staging_createinfo, &staging_allocinfo,
-            &m_staging_buffers[i].m_src_buffer, &m_staging_buffers[i].m_src_mem, &staging_meminfo));
-
-        m_staging_buffers[i].m_src_data = std::span(static_cast<std::byte*>(staging_meminfo.pMappedData), STAGING_BUFFER_SIZE);
+    VkFenceCreateInfo fence_createinfo {};
+    fence_createinfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    for (size_t i = 0; i < STAGING_BUFFER_COUNT; i++) {
+        m_staging_buffers[i].m_ring = &m_staging_ring;
+        m_staging_buffers[i].m_src_buffer = m_staging_ring.m_buffer;
+        m_staging_buffers[i].m_src_data = m_staging_ring.m_data;
         m_staging_buffers[i].m_xfer_commands = builder_commands[0][i];
         m_staging_buffers[i].m_acquire_commands = builder_commands[1][i];
         m_staging_buffers[i].m_post_xfer = builder_sem[i];
+        VK_DEMAND(vkCreateFence(DisplayHost::device(), &fence_createinfo, nullptr, &m_staging_buffers[i].m_xfer_fence));
+        m_free_staging_buffers.push(&m_staging_buffers[i]);
     }
 
     // Prepare the initial scene in-line.
-    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    uint64_t pass = 0;
+    VkSemaphoreWaitInfo wait_info {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &m_timeline;
+
+    RQData job;
     bool complete;
+    size_t pass = 0;
+    m_next_signal = 1;
+    job.scene = initial;
     do {
-        complete = initial->construct(m_renderer.get(), m_staging_buffers[0], pass, pass + 1);
-        m_staging_buffers[0].finalize();
-        pass++;
-
-        VkSubmitInfo submit {};
-        VkTimelineSemaphoreSubmitInfo timeline_info {};
-        submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit.commandBufferCount = 1;
-        submit.pCommandBuffers = &m_staging_buffers[0].m_xfer_commands;
-        submit.signalSemaphoreCount = 1;
-        timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
-        timeline_info.signalSemaphoreValueCount = 1;
-        timeline_info.pSignalSemaphoreValues = &pass;
-        if (m_graphics_queue == m_transfer_queue) {
-            submit.pNext = &timeline_info;
-            submit.pSignalSemaphores = &m_timeline;
-            VK_DEMAND(vkQueueSubmit(m_transfer_queue, 1, &submit, VK_NULL_HANDLE));
-        } else {
-            submit.pSignalSemaphores = &m_staging_buffers[0].m_post_xfer;
-            VK_DEMAND(vkQueueSubmit(m_transfer_queue, 1, &submit, VK_NULL_HANDLE));
-
-            submit.pNext = &timeline_info;
-            submit.waitSemaphoreCount = 1;
-            submit.pWaitSemaphores = &m_staging_buffers[0].m_post_xfer;
-            submit.pWaitDstStageMask = &wait_stage;
-            submit.pCommandBuffers = &m_staging_buffers[0].m_acquire_commands;
-            submit.pSignalSemaphores = &m_timeline;
-            VK_DEMAND(vkQueueSubmit(m_graphics_queue, 1, &submit, VK_NULL_HANDLE));
-        }
-
-        VkSemaphoreWaitInfo wait_info {};
-        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
-        wait_info.semaphoreCount = 1;
-        wait_info.pSemaphores = &m_timeline;
-        wait_info.pValues = &pass;
-
+        m_free_staging_buffers.pop(job.commands);
+        m_staging_ring.rearm(*job.commands);
+        job.ticket = pass + 1;
+        complete = initial->construct(m_renderer.get(), *job.commands, pass++, job.ticket);
+        job.commands->finalize();
+        submit_copies(job);
+        signal_in_order();
+
+        wait_info.pValues = &job.ticket;
         VK_DEMAND(vkWaitSemaphores(DisplayHost::device(), &wait_info, UINT64_MAX));
+        recycle_staging_buffers(job.ticket);
     } while (complete == false);
-    m_scenes[initial] = pass;
+    m_scenes[initial] = job.ticket;
     m_requested_scene = initial;
-    m_max_ticket.store(pass + 1, std::memory_order_relaxed);
+    m_max_ticket.store(job.ticket + 1, std::memory_order_relaxed);
+    m_renderer->write_picturebook(0);
     initial->record_commands(m_renderer.get(), 0);
+    record_draws(initial, 0);
 
     m_scene_host = std::thread(&SceneHost::scene_loop, this);
-    for (size_t i = 0; i < BUILDER_THREAD_COUNT; i++)
-        m_builders[i] = std::thread(&SceneHost::builder_loop, this, i);
 }
 
 SceneHost::~SceneHost()
 {
-    BQData terminate_payload { nullptr, false };
     m_active = false;
     DisplayHost::s_self->m_frame_number = UINT32_MAX;
     DisplayHost::s_self->m_frame_number.notify_all();
-    for (size_t i = 0; i < 2 * m_builders.size(); i++)
-        m_builder_queue.push(terminate_payload);
-    for (auto it = m_builders.begin(); it != m_builders.end(); ++it)
-        it->join();
+    m_render_queue.close();
+    m_return_queue.close();
+    m_free_staging_buffers.close();
     m_scene_host.join();
+    for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it)
+        JobSystem::wait(*it);
 
+    // Bringups were cancelled or have finished, and scenes still in bringup are in m_scenes too.
     vkDeviceWaitIdle(DisplayHost::device());
     for (auto it = m_scenes.begin(); it != m_scenes.end(); ++it)
         delete it->first;
-
+    for (; m_retired.empty() == false; m_retired.pop())
+        m_retired.front().first();
+    m_mip_stream.reset();
+    m_mip_requests.clear();
+
+    for (auto it = m_staging_buffers.begin(); it != m_staging_buffers.end(); ++it) {
+        vkDestroyFence(DisplayHost::device(), it->m_xfer_fence, nullptr);
+        vkDestroySemaphore(DisplayHost::device(), it->m_post_xfer, nullptr);
+    }
+    for (auto it = m_draw_recordings.begin(); it != m_draw_recordings.end(); ++it) {
+        for (auto jt = it->recorders.begin(); jt != it->recorders.end(); ++jt)
+            vkDestroyCommandPool(DisplayHost::device(), jt->first, nullptr);
+    }
     vkDestroyCommandPool(DisplayHost::device(), m_xfer_command_pool, nullptr);
     vkDestroyCommandPool(DisplayHost::device(), m_acquire_command_pool, nullptr);
     vkDestroySemaphore(DisplayHost::device(), m_timeline, nullptr);
@@ -277,24 +381,39 @@ void SceneHost::scene_loop()
         uint32_t render_frame_number = display.m_frame_number.load(std::memory_order_acquire);
         SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "scene  thread: F%u WAITING (H%u)", frame_number, render_frame_number);
         while ((render_frame_number = display.m_frame_number.load(std::memory_order_acquire)) < frame_number)
-            display.m_frame_number.wait(render_frame_number, std::memory_order_relaxed);
+            SpinThenPark<>::wait(display.m_frame_number, render_frame_number);
         if (m_active == false)
             break;
         SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "scene  thread: F%u BEGIN", frame_number);
 
         IScene* scene = m_active_scene.load(std::memory_order_acquire);
         if (m_requested_scene && m_scenes[m_requested_scene] <= timeline_value) {
-            // The requested scene is ready. Execute that one.
-            scene = m_requested_scene;
+            // The requested scene is ready. Execute that one, unless some of its assets were evicted while it waited:
+            // then it rebinds them first.
+            if (Residency::touch(m_requested_scene, frame_number)) {
+                scene = m_requested_scene;
+            } else {
+                IScene* rebind_scene = m_requested_scene;
+                m_scenes[rebind_scene] = UINT64_MAX;
+                spawn([rebind_scene]() { s_self->bringup(rebind_scene, true); });
+            }
         }
         if (scene) {
+            if (scene != m_requested_scene)
+                Residency::touch(scene, frame_number);
+
             // Execute the current scene, and update the frame number and notify the render thread when commands are recorded
-            SDL_Event evt;
+            std::array<SDL_Event, 16> events;
+            size_t event_count;
             frame_time[1] = SDL_GetTicks();
-            while (m_event_queue.try_pop(evt))
-                scene->handle_event(evt, this);
+            while ((event_count = m_event_queue.try_pop_n(events)) > 0) {
+                for (size_t i = 0; i < event_count; i++)
+                    scene->handle_event(events[i], this);
+            }
             scene->tick(frame_time[1], frame_time[1] - frame_time[0], this);
+            m_renderer->write_picturebook(frame_number);
             scene->record_commands(m_renderer.get(), frame_number);
+            record_draws(scene, frame_number);
             frame_time[0] = frame_time[1];
 
             if (scene == m_requested_scene) {
@@ -308,9 +427,15 @@ void SceneHost::scene_loop()
         m_frame_number.store(frame_number, std::memory_order_release);
         m_frame_number.notify_all();
 
-        RQData job;
-        while (m_return_queue.try_pop(job)) {
-            m_scenes[job.scene] = job.ticket;
+        vmaSetCurrentFrameIndex(display.m_allocator, frame_number);
+        Residency::trim(frame_number);
+        serve_mip_requests(frame_number, timeline_value);
+
+        std::array<RQData, 8> jobs;
+        size_t job_count;
+        while ((job_count = m_return_queue.try_pop_n(jobs)) > 0) {
+            for (size_t i = 0; i < job_count; i++)
+                m_scenes[jobs[i].scene] = jobs[i].ticket;
         }
 
         if (m_purge_queue.empty() == false) {
@@ -319,64 +444,430 @@ void SceneHost::scene_loop()
                 IScene* purge_scene = m_purge_queue.front().first;
                 m_purge_queue.pop();
                 if (purge_scene != m_active_scene && purge_scene != m_requested_scene) {
-                    BQData payload = { purge_scene, false };
                     m_scenes.erase(purge_scene);
-                    m_builder_queue.push(payload);
+                    spawn([purge_scene]() {
+                        SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "worker thread: scene=%p teardown", purge_scene);
+                        delete purge_scene;
+                    });
                 }
             }
         }
     }
 }
 
-void SceneHost::builder_loop(int thread_id)
+void SceneHost::serve_mip_requests(uint32_t frame_number, uint64_t timeline_value)
 {
-    while (true) {
-        BQData build_job;
-        m_builder_queue.pop(build_job);
-        if (build_job.scene == nullptr && build_job.bringup == false) {
-            vmaDestroyBuffer(DisplayHost::allocator(), m_staging_buffers[thread_id].m_src_buffer, m_staging_buffers[thread_id].m_src_mem);
-            vkDestroySemaphore(DisplayHost::device(), m_staging_buffers[thread_id].m_post_xfer, nullptr);
+    while (m_retired.empty() == false && static_cast<int32_t>(m_retired.front().second - frame_number) <= 0) {
+        m_retired.front().first();
+        m_retired.pop();
+    }
+
+    if (m_mip_stream.has_value()) {
+        if (m_mip_stream->job->done() == false || m_mip_stream->ticket > timeline_value)
+            return;
+
+        // Frames recorded from now on sample the new images; the old ones go once the frames in flight are done. Images
+        // with passes left carry on with the next stream, whatever level they were asked for since.
+        for (auto it = m_mip_stream->images.begin(); it != m_mip_stream->images.end(); ++it) {
+            std::function<void()> retire = (*it)->land_stream();
+            if (retire)
+                m_retired.emplace(std::move(retire), frame_number + SIMULTANEOUS_FRAMES + 1);
+            else
+                m_mip_requests.try_emplace(it->get(), *it, (*it)->base_level());
+        }
+        m_mip_stream.reset();
+    }
+    if (m_mip_requests.empty())
+        return;
+
+    // Streaming only takes a staging buffer nobody else is waiting for, and never holds up a scene's bringup.
+    StagingBuffer* staging;
+    if (m_free_staging_buffers.try_pop(staging) == false)
+        return;
+
+    // Requests that don't fit next to the others wait for the next pass. An image whose chain doesn't fit on its own
+    // stages what does, and comes back for the rest.
+    MipStream stream;
+    std::vector<VkDeviceSize> offsets;
+    VkDeviceSize size = 0;
+    for (auto it = m_mip_requests.begin(); it != m_mip_requests.end();) {
+        size_t needs = it->second.first->plan_stream(it->second.second, MIP_STREAM_BUDGET - size);
+        if (needs == 0 && size > 0) {
+            ++it;
+            continue;
+        }
+        if (needs > 0) {
+            offsets.push_back(size);
+            size += (needs + 15) & ~15;
+            stream.images.push_back(it->second.first);
+        }
+        it = m_mip_requests.erase(it);
+    }
+    if (stream.images.empty()) {
+        m_free_staging_buffers.push(staging);
+        return;
+    }
+
+    stream.ticket = m_max_ticket.fetch_add(1, std::memory_order_relaxed);
+    spawn([this, staging, ticket = stream.ticket, images = stream.images, offsets = std::move(offsets), size]() {
+        RQData job { nullptr, ticket, staging };
+        m_staging_ring.rearm(*staging);
+        std::optional<VkDeviceSize> base = staging->reserve(size);
+        SDL_assert_release(base.has_value());
+        for (size_t i = 0; i < images.size(); i++)
+            images[i]->stream(*staging, *base + offsets[i]);
+        staging->finalize();
+        m_render_queue.push(job);
+        SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "worker thread: ticket=%" PRIu64 " mip stream=%p", ticket, staging);
+    });
+    stream.job = m_jobs.back();
+    m_mip_stream = std::move(stream);
+}
+
+void SceneHost::record_draws(IScene* scene, uint32_t frame_number)
+{
+    DrawRecording& recording = m_draw_recordings[frame_number % SIMULTANEOUS_FRAMES];
+    recording.frame_number = frame_number;
+    recording.commands.clear();
+    recording.subpass_ends.clear();
+
+    // Split each subpass's draws into ranges of at least DRAWS_PER_RECORDER, at most one per thread that can record.
+    struct Range {
+        int subpass;
+        size_t first, count;
+    };
+    std::vector<Range> ranges;
+    size_t max_ranges = JobSystem::worker_count() + 1;
+    for (int subpass = 0; subpass < m_renderer->subpass_count(); subpass++) {
+        size_t draw_count = scene->draw_count(m_renderer.get(), frame_number, subpass);
+        size_t range_count = std::min(max_ranges, (draw_count + DRAWS_PER_RECORDER - 1) / DRAWS_PER_RECORDER);
+        for (size_t i = 0; i < range_count; i++) {
+            size_t first = draw_count * i / range_count;
+            ranges.push_back({ subpass, first, draw_count * (i + 1) / range_count - first });
+        }
+        recording.subpass_ends.push_back(ranges.size());
+    }
+    if (ranges.empty())
+        return;
+
+    VkCommandPoolCreateInfo pool_ci {};
+    VkCommandBufferAllocateInfo cmd_allocinfo {};
+    pool_ci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_ci.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_ci.queueFamilyIndex = DisplayHost::queue_family_index();
+    cmd_allocinfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_allocinfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    cmd_allocinfo.commandBufferCount = 1;
+    while (recording.recorders.size() < ranges.size()) {
+        std::pair<VkCommandPool, VkCommandBuffer> recorder;
+        VK_DEMAND(vkCreateCommandPool(DisplayHost::device(), &pool_ci, nullptr, &recorder.first));
+        cmd_allocinfo.commandPool = recorder.first;
+        VK_DEMAND(vkAllocateCommandBuffers(DisplayHost::device(), &cmd_allocinfo, &recorder.second));
+        recording.recorders.push_back(recorder);
+    }
+    for (size_t i = 0; i < ranges.size(); i++)
+        recording.commands.push_back(recording.recorders[i].second);
+
+    auto record = [&](size_t i) {
+        VkCommandBufferBeginInfo begin_info {};
+        VkCommandBufferInheritanceInfo inherit_info {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        begin_info.pInheritanceInfo = &inherit_info;
+        inherit_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inherit_info.renderPass = m_renderer->render_pass();
+        inherit_info.subpass = ranges[i].subpass;
+
+        // The last frame to use this pool has completed; see scene_loop().
+        vkResetCommandPool(DisplayHost::device(), recording.recorders[i].first, 0);
+        VK_DEMAND(vkBeginCommandBuffer(recording.recorders[i].second, &begin_info));
+        scene->record_draws(m_renderer.get(), recording.recorders[i].second, frame_number, ranges[i].subpass, ranges[i].first, ranges[i].count);
+        VK_DEMAND(vkEndCommandBuffer(recording.recorders[i].second));
+    };
+
+    // Ranges are claimed, not handed out. Every worker may be busy with a task that waits on the render thread, which
+    // waits for this frame, so the scene thread records whatever no worker has started and only waits for ranges that
+    // are already being recorded. A job that starts after every range is claimed finds nothing left to do, and never
+    // touches record.
+    struct Claims {
+        std::atomic_size_t next { 0 }, recorded { 0 };
+        size_t count;
+        std::function<void(size_t)> record;
+    };
+    auto claims = std::make_shared<Claims>();
+    claims->count = ranges.size();
+    claims->record = record;
+    auto claim = [claims]() {
+        for (size_t i; (i = claims->next.fetch_add(1, std::memory_order_relaxed)) < claims->count;) {
+            claims->record(i);
+            if (claims->recorded.fetch_add(1, std::memory_order_acq_rel) + 1 == claims->count)
+                claims->recorded.notify_all();
+        }
+    };
+    for (size_t i = 1; i < ranges.size(); i++)
+        JobSystem::spawn(claim);
+    claim();
+
+    size_t recorded;
+    while ((recorded = claims->recorded.load(std::memory_order_acquire)) < claims->count)
+        SpinThenPark<>::wait(claims->recorded, recorded);
+}
+
+void SceneHost::spawn(std::function<void()> work)
+{
+    std::erase_if(m_jobs, [](const JobSystem::JobRef& job) { return job->done(); });
+    m_jobs.push_back(JobSystem::spawn_task(std::move(work)));
+}
+
+void SceneHost::bringup(IScene* scene, bool rebind)
+{
+    // Passes are not serialized on the GPU: each one is handed to the render thread as soon as it is recorded, and
+    // the scene is ready once the timeline reaches the last pass's ticket. Rebinding a scene works the same way.
+    RQData job;
+    bool complete;
+    int pass = 0;
+    job.scene = scene;
+    do {
+        if (m_free_staging_buffers.pop(job.commands) == false)
+            return; // cancelled by shutdown
+
+        m_staging_ring.rearm(*job.commands);
+        job.ticket = m_max_ticket.fetch_add(1, std::memory_order_relaxed);
+        if (rebind)
+            complete = job.scene->rebind(m_renderer.get(), *job.commands, pass++, job.ticket);
+        else
+            complete = job.scene->construct(m_renderer.get(), *job.commands, pass++, job.ticket);
+        job.commands->finalize();
+        if (m_render_queue.push(job) == false)
             return;
+        SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "worker thread: scene=%p ticket=%" PRIu64 " bringup=%p", job.scene, job.ticket, job.commands);
+    } while (complete == false);
+
+    SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "worker thread: scene=%p ticket=%" PRIu64 " bringup complete", job.scene, job.ticket);
+    m_return_queue.push(job);
+}
+
+SceneHost::StagingPlan::StagingPlan(std::span<IAsset* const> roots)
+{
+    // Walk the graph, deduplicating assets and remembering each one's direct dependents.
+    std::vector<std::pair<IAsset*, std::vector<IAsset*>>> nodes;
+    std::unordered_map<IAsset*, size_t> node_index;
+    std::queue<IAsset*> search_queue;
+    for (auto it = roots.begin(); it != roots.end(); ++it)
+        search_queue.push(*it);
+    while (search_queue.empty() == false) {
+        IAsset* asset = search_queue.front();
+        search_queue.pop();
+        if (node_index.emplace(asset, nodes.size()).second == false)
+            continue;
+
+        std::queue<IAsset*> dependents;
+        asset->push_dependents(dependents);
+        auto& node = nodes.emplace_back(asset, std::vector<IAsset*>());
+        while (dependents.empty() == false) {
+            node.second.push_back(dependents.front());
+            search_queue.push(dependents.front());
+            dependents.pop();
+        }
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const auto& left, const auto& right) { return left.first < right.first; });
+    for (size_t i = 0; i < nodes.size(); i++)
+        node_index[nodes[i].first] = i;
+
+    m_assets.resize(nodes.size());
+    m_dependents.resize(nodes.size());
+    m_remaining.resize(nodes.size());
+    m_pass.resize(nodes.size(), 0);
+    m_done.resize(nodes.size(), false);
+    m_owned.resize(nodes.size(), false);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        // Assets another plan has claimed, or already prepared, are left to it: they need nothing from this one.
+        m_assets[i] = nodes[i].first;
+        m_owned[i] = nodes[i].first->claim();
+        m_done[i] = m_owned[i] == false;
+        m_remaining[i] = m_owned[i] ? (nodes[i].first->prepare_needs() + 15) & ~15 : 0;
+        for (auto it = nodes[i].second.begin(); it != nodes[i].second.end(); ++it)
+            m_dependents[i].push_back(node_index[*it]);
+    }
+
+    // Order the graph so that every asset comes after the assets it depends on.
+    std::vector<size_t> waiting(nodes.size());
+    std::vector<std::vector<size_t>> unblocks(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        waiting[i] = m_dependents[i].size();
+        for (auto it = m_dependents[i].begin(); it != m_dependents[i].end(); ++it)
+            unblocks[*it].push_back(i);
+        if (waiting[i] == 0)
+            m_order.push_back(i);
+    }
+    for (size_t k = 0; k < m_order.size(); k++) {
+        for (auto it = unblocks[m_order[k]].begin(); it != unblocks[m_order[k]].end(); ++it) {
+            if (--waiting[*it] == 0)
+                m_order.push_back(*it);
+        }
+    }
+    SDL_assert_release(m_order.size() == nodes.size() && "asset dependencies form a cycle");
+
+    // Best-fit decreasing: place each asset that fits in a pass, largest first, into the pass it fills most tightly.
+    std::vector<size_t> by_size;
+    std::vector<VkDeviceSize> free_space;
+    auto best_fit = [&free_space](VkDeviceSize size, size_t first_pass) {
+        size_t best = free_space.size();
+        for (size_t b = first_pass; b < free_space.size(); b++) {
+            if (free_space[b] >= size && (best == free_space.size() || free_space[b] < free_space[best]))
+                best = b;
         }
+        if (best == free_space.size())
+            free_space.push_back(STAGING_PASS_BUDGET);
+        free_space[best] -= size;
+        return best;
+    };
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (m_remaining[i] > 0 && m_remaining[i] <= STAGING_PASS_BUDGET)
+            by_size.push_back(i);
+    }
+    std::stable_sort(by_size.begin(), by_size.end(), [this](size_t left, size_t right) { return m_remaining[left] > m_remaining[right]; });
+    for (auto it = by_size.begin(); it != by_size.end(); ++it)
+        m_pass[*it] = best_fit(m_remaining[*it], 0);
+
+    // Then move anything planned ahead of what it depends on back to the tightest pass it may use. Assets that need no
+    // staging, or too much for one pass, start as early as their dependents allow.
+    for (auto it = m_order.begin(); it != m_order.end(); ++it) {
+        size_t i = *it, first_pass = 0;
+        for (auto jt = m_dependents[i].begin(); jt != m_dependents[i].end(); ++jt)
+            first_pass = std::max(first_pass, m_pass[*jt]);
+        if (m_remaining[i] == 0 || m_remaining[i] > STAGING_PASS_BUDGET) {
+            m_pass[i] = first_pass;
+        } else if (m_pass[i] < first_pass) {
+            free_space[m_pass[i]] += m_remaining[i];
+            m_pass[i] = best_fit(m_remaining[i], first_pass);
+        }
+    }
+    m_pass_count = std::max<size_t>(1, free_space.size());
+    SDL_LogDebug(SDL_LOG_CATEGORY_SYSTEM, "staging plan: %zu assets in %zu passes", m_assets.size(), m_pass_count);
+}
+
+bool SceneHost::StagingPlan::stage(StagingBuffer& staging, size_t pass, uint64_t ticket)
+{
+    // An asset left to another plan may have been evicted before this one got to use it. Whoever claims it first
+    // prepares it again, starting with this pass.
+    for (size_t i = 0; i < m_assets.size(); i++) {
+        if (m_owned[i] == false && m_assets[i]->ready_ticket() == UINT64_MAX && m_assets[i]->claim()) {
+            m_owned[i] = true;
+            m_done[i] = false;
+            m_remaining[i] = (m_assets[i]->prepare_needs() + 15) & ~15;
+            m_pass[i] = pass;
+        }
+    }
+
+    // Space the plan set aside for this pass is kept for the assets it was planned for; anything that is overdue or
+    // streaming gets what is left.
+    VkDeviceSize reserved = 0;
+    for (size_t i = 0; i < m_assets.size(); i++) {
+        if (m_done[i] == false && m_pass[i] == pass && m_remaining[i] <= STAGING_PASS_BUDGET)
+            reserved += m_remaining[i];
+    }
 
-        if (build_job.bringup) {
-            VkSemaphoreWaitInfo wait_info {};
-            wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
-            wait_info.semaphoreCount = 1;
-            wait_info.pSemaphores = &m_timeline;
-
-            RQData job;
-            bool complete;
-            int pass = 0;
-            job.scene = build_job.scene;
-            job.commands = &m_staging_buffers[thread_id];
-            do {
-                job.ticket = m_max_ticket.fetch_add(1, std::memory_order_relaxed);
-                complete = job.scene->construct(m_renderer.get(), m_staging_buffers[thread_id], pass++, job.ticket);
-                m_staging_buffers[thread_id].finalize();
-                m_render_queue.push(job);
-                SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "worker thread: scene=%p ticket=%" PRIu64 " bringup=%p", job.scene, job.ticket, job.commands);
-
-                // Because the builder thread blocks until the command buffer we just submitted is complete, we don't need any GPU waiting.
-                wait_info.pValues = &job.ticket;
-                VK_DEMAND(vkWaitSemaphores(DisplayHost::device(), &wait_info, UINT64_MAX));
-            } while (complete == false);
-            SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "worker thread: scene=%p ticket=%" PRIu64 " bringup complete", job.scene, job.ticket);
-            m_return_queue.push(job);
-        } else {
-            SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "worker thread: scene=%p teardown", build_job.scene);
-            delete build_job.scene;
+    // Hand out disjoint staging windows from a single reservation, so the prepare jobs never contend for space. An
+    // asset whose dependents are still being staged waits for a later pass.
+    std::vector<VkDeviceSize> offsets(m_assets.size()), sizes(m_assets.size());
+    std::vector<bool> runs(m_assets.size(), false);
+    VkDeviceSize staging_size = 0;
+    for (auto it = m_order.begin(); it != m_order.end(); ++it) {
+        size_t i = *it;
+        if (m_done[i])
+            continue;
+        if (m_pass[i] == pass && m_remaining[i] <= STAGING_PASS_BUDGET)
+            reserved -= m_remaining[i];
+
+        bool blocked = m_pass[i] > pass;
+        for (auto jt = m_dependents[i].begin(); jt != m_dependents[i].end(); ++jt)
+            blocked = blocked || (m_done[*jt] == false && (runs[*jt] == false || m_remaining[*jt] > ((sizes[*jt] + 15) & ~15)));
+        if (blocked)
+            continue;
+
+        runs[i] = true;
+        sizes[i] = m_assets[i]->prepare_next(STAGING_PASS_BUDGET - staging_size - reserved);
+        SDL_assert(sizes[i] <= STAGING_PASS_BUDGET - staging_size - reserved);
+        offsets[i] = staging_size;
+        staging_size += (sizes[i] + 15) & ~15;
+    }
+    if (staging_size > 0) {
+        std::optional<VkDeviceSize> base = staging.reserve(staging_size);
+        if (base.has_value() == false)
+            SDL_LogCritical(SDL_LOG_CATEGORY_SYSTEM, "staging ring cannot fit %" PRIu64 " bytes alongside this pass's other reservations", staging_size);
+        SDL_assert_release(base.has_value());
+        for (auto it = offsets.begin(); it != offsets.end(); ++it)
+            *it += *base;
+    }
+
+    std::vector<JobSystem::JobRef> jobs(m_assets.size());
+    for (auto it = m_order.begin(); it != m_order.end(); ++it) {
+        size_t i = *it;
+        if (runs[i] == false)
+            continue;
+        jobs[i] = JobSystem::create([asset = m_assets[i], &staging, offset = offsets[i], size = sizes[i]]() {
+            [[maybe_unused]] size_t staged = asset->prepare(staging, offset, size);
+            SDL_assert(staged <= size);
+        });
+        for (auto jt = m_dependents[i].begin(); jt != m_dependents[i].end(); ++jt) {
+            if (jobs[*jt])
+                JobSystem::depend(jobs[i], jobs[*jt]);
+        }
+    }
+    for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+        if (*it)
+            JobSystem::submit(*it);
+    }
+    for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+        if (*it)
+            JobSystem::wait(*it);
+    }
+
+    bool progress = false, complete = true, waiting = false;
+    for (size_t i = 0; i < m_assets.size(); i++) {
+        if (runs[i]) {
+            m_remaining[i] -= std::min(m_remaining[i], (sizes[i] + 15) & ~15);
+            m_done[i] = m_remaining[i] == 0;
+            progress = progress || sizes[i] > 0 || m_done[i];
+            if (m_done[i])
+                m_assets[i]->post_prepare(ticket);
         }
+        complete = complete && m_done[i];
+    }
+
+    // Once this plan's own assets are staged, wait for the plans preparing the rest instead of running empty passes
+    // until they finish. Tickets are signaled in order, so anything ready before this pass's ticket is ready once this
+    // pass is; an asset readied later takes one more pass, for a later ticket. One evicted before it was prepared again
+    // is claimed by that pass.
+    for (size_t i = 0; complete && i < m_assets.size(); i++) {
+        if (m_owned[i] == false && m_assets[i]->wait_prepared() >= ticket)
+            waiting = true;
     }
+
+    // Past the planned passes, a pass that makes no progress will be followed by an identical one. That can't happen:
+    // assets stage in pieces no larger than a pass, and nothing is reserved for a pass past the plan.
+    SDL_assert((complete || progress || pass + 1 < m_pass_count) && "an asset staged nothing in a pass with room for it");
+    return complete && waiting == false;
 }
 
 bool SceneHost::prepare(IScene* scene)
 {
-    BQData job { scene, true };
-    if (s_self->m_scenes.find(scene) == s_self->m_scenes.end())
-        return s_self->m_builder_queue.try_push(job);
-    else
-        return true;
+    if (s_self->m_render_queue.closed())
+        return false;
+    // A scene is known from the moment its bringup starts, with a ticket it never reaches until bringup completes, so
+    // that it is brought up once and deleted at shutdown even if bringup is still running.
+    if (s_self->m_scenes.try_emplace(scene, UINT64_MAX).second)
+        s_self->spawn([scene]() { s_self->bringup(scene); });
+    return true;
+}
+
+uint64_t SceneHost::timeline_value()
+{
+    uint64_t value = 0;
+    if (s_self)
+        VK_DEMAND(vkGetSemaphoreCounterValue(DisplayHost::device(), s_self->m_timeline, &value));
+    return value;
 }
 
 void SceneHost::set_next_scene(IScene* scene)
@@ -384,12 +875,23 @@ void SceneHost::set_next_scene(IScene* scene)
     s_self->m_requested_scene = scene;
 }
 
+void SceneHost::stream_mips(asset::Image* image, uint32_t level)
+{
+    auto& request = s_self->m_mip_requests[image];
+    if (request.first == nullptr) {
+        request.first = std::static_pointer_cast<asset::Image>(image->shared_from_this());
+        request.second = level;
+    } else {
+        request.second = std::min(request.second, level);
+    }
+}
+
 void SceneHost::wait_frame(uint32_t frame_number)
 {
     uint32_t actual_frame;
     SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "render thread: H%u WAIT FOR COMMANDS (F%u)", frame_number, s_self->m_frame_number.load());
     while ((actual_frame = s_self->m_frame_number.load(std::memory_order_acquire)) < frame_number)
-        s_self->m_frame_number.wait(actual_frame, std::memory_order_relaxed);
+        SpinThenPark<>::wait(s_self->m_frame_number, actual_frame);
 
     SDL_LogTrace(SDL_LOG_CATEGORY_SYSTEM, "render thread: H%u COMMANDS READY", frame_number);
 }
@@ -399,46 +901,80 @@ void SceneHost::push_event(SDL_Event* evt)
     s_self->m_event_queue.push(*evt);
 }
 
-void SceneHost::submit_transfers()
+void SceneHost::submit_copies(const RQData& job)
 {
-    RQData job;
-    uint64_t max_ticket = 0, num_commands = 0;
-    std::array<VkSubmitInfo, 8> xfer_commands, acquire_commands;
+    VkSubmitInfo submit {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &job.commands->m_xfer_commands;
+    if (m_graphics_queue != m_transfer_queue) {
+        submit.signalSemaphoreCount = 1;
+        submit.pSignalSemaphores = &job.commands->m_post_xfer;
+    }
+    VK_DEMAND(vkQueueSubmit(m_transfer_queue, 1, &submit, job.commands->m_xfer_fence));
+    m_unsignaled.push(job);
+}
+
+void SceneHost::signal_in_order()
+{
+    // Copies go out as soon as they arrive, but the timeline has to count up, so tickets are signaled in order.
     VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
     VkTimelineSemaphoreSubmitInfo timeline_info {};
     timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
     timeline_info.signalSemaphoreValueCount = 1;
-
-    while (num_commands < xfer_commands.size() && s_self->m_render_queue.try_pop(job)) {
-        xfer_commands[num_commands].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        xfer_commands[num_commands].commandBufferCount = 1;
-        xfer_commands[num_commands].pCommandBuffers = &job.commands->m_xfer_commands;
-        xfer_commands[num_commands].signalSemaphoreCount = 1;
-        if (s_self->m_graphics_queue == s_self->m_transfer_queue) {
-            xfer_commands[num_commands].pNext = &timeline_info;
-            xfer_commands[num_commands].pSignalSemaphores = &s_self->m_timeline;
-        } else {
-            xfer_commands[num_commands].pSignalSemaphores = &job.commands->m_post_xfer;
-            acquire_commands[num_commands].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-            acquire_commands[num_commands].pNext = &timeline_info;
-            acquire_commands[num_commands].waitSemaphoreCount = 1;
-            acquire_commands[num_commands].pWaitSemaphores = &job.commands->m_post_xfer;
-            acquire_commands[num_commands].pWaitDstStageMask = &wait_stage;
-            acquire_commands[num_commands].commandBufferCount = 1;
-            acquire_commands[num_commands].pCommandBuffers = &job.commands->m_acquire_commands;
-            acquire_commands[num_commands].signalSemaphoreCount = 1;
-            acquire_commands[num_commands].pSignalSemaphores = &s_self->m_timeline;
+    while (m_unsignaled.empty() == false && m_unsignaled.top().ticket == m_next_signal) {
+        const RQData& job = m_unsignaled.top();
+        VkSubmitInfo submit {};
+        submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit.pNext = &timeline_info;
+        submit.signalSemaphoreCount = 1;
+        submit.pSignalSemaphores = &m_timeline;
+        timeline_info.pSignalSemaphoreValues = &job.ticket;
+        if (m_graphics_queue != m_transfer_queue) {
+            submit.waitSemaphoreCount = 1;
+            submit.pWaitSemaphores = &job.commands->m_post_xfer;
+            submit.pWaitDstStageMask = &wait_stage;
+            submit.commandBufferCount = 1;
+            submit.pCommandBuffers = &job.commands->m_acquire_commands;
         }
+        VK_DEMAND(vkQueueSubmit(m_graphics_queue, 1, &submit, VK_NULL_HANDLE));
+
+        m_in_flight.push(job);
+        m_unsignaled.pop();
+        m_next_signal++;
+    }
+}
 
-        max_ticket = std::max(max_ticket, job.ticket);
-        num_commands++;
+void SceneHost::recycle_staging_buffers(uint64_t timeline_value)
+{
+    while (m_in_flight.empty() == false && m_in_flight.front().ticket <= timeline_value) {
+        m_free_staging_buffers.push(m_in_flight.front().commands);
+        m_in_flight.pop();
+    }
+}
+
+void SceneHost::submit_transfers()
+{
+    std::array<RQData, 8> jobs;
+    size_t job_count;
+    while ((job_count = s_self->m_render_queue.try_pop_n(jobs)) > 0) {
+        for (size_t i = 0; i < job_count; i++)
+            s_self->submit_copies(jobs[i]);
     }
+    s_self->signal_in_order();
+
+    uint64_t timeline_value;
+    VK_DEMAND(vkGetSemaphoreCounterValue(DisplayHost::device(), s_self->m_timeline, &timeline_value));
+    s_self->recycle_staging_buffers(timeline_value);
+}
 
-    if (num_commands > 0) {
-        timeline_info.pSignalSemaphoreValues = &max_ticket;
-        VK_DEMAND(vkQueueSubmit(s_self->m_transfer_queue, num_commands, xfer_commands.data(), VK_NULL_HANDLE));
-        if (s_self->m_graphics_queue != s_self->m_transfer_queue)
-            VK_DEMAND(vkQueueSubmit(s_self->m_graphics_queue, num_commands, acquire_commands.data(), VK_NULL_HANDLE));
+void SceneHost::execute_computes(VkCommandBuffer container, uint32_t frame_number)
+{
+    IScene* active_scene = s_self->m_active_scene.load(std::memory_order_acquire);
+    if (active_scene) {
+        std::span<VkCommandBuffer> commands = active_scene->compute_commands(frame_number);
+        if (commands.size() > 0)
+            vkCmdExecuteCommands(container, commands.size(), commands.data());
     }
 }
 
@@ -450,6 +986,14 @@ void SceneHost::execute_draws(VkCommandBuffer container, uint32_t frame_number,
         if (commands.size() > 0)
             vkCmdExecuteCommands(container, commands.size(), commands.data());
     }
+
+    // Then the ranges recorded in parallel, in order.
+    const DrawRecording& recording = s_self->m_draw_recordings[frame_number % SIMULTANEOUS_FRAMES];
+    if (recording.frame_number == frame_number && static_cast<size_t>(subpass) < recording.subpass_ends.size()) {
+        size_t first = subpass > 0 ? recording.subpass_ends[subpass - 1] : 0;
+        if (recording.subpass_ends[subpass] > first)
+            vkCmdExecuteCommands(container, recording.subpass_ends[subpass] - first, recording.commands.data() + first);
+    }
 }
 
 }
@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <SDL3/SDL_events.h>
+#include "mpmc.h"
+
+// Measures MPMCQ (and SPSCQ, where the configuration allows it) throughput and enqueue-to-dequeue latency.
+// Every run moves a fixed number of items from P producers to C consumers. Producers stamp each item with the time
+// it was pushed, and consumers record how long it took to come out the other end.
+//
+// Blocking runs are repeated for each waiting policy: "spin" (SpinThenPark<>, the default) and "park" (ParkImmediately).
+//
+// Usage: bench_mpmc [--items N] [--threads N] [--payload 8,32,E] [--capacity 8,64,256,1024] [--mode blocking,polling]
+//                   [--wait spin,park] [--json]
+//
+// Queues are instantiated for fixed payload sizes and capacities, so those are the only ones a run can ask for; E is
+// sizeof(SDL_Event). Anything else is rejected.
+
+namespace {
+
+using bench_clock = std::chrono::steady_clock;
+
+template <size_t S>
+struct Payload {
+    static_assert(S >= sizeof(int64_t));
+    int64_t stamp;
+    std::array<std::byte, S - sizeof(int64_t)> pad;
+};
+
+struct Config {
+    const char* queue;
+    const char* wait;
+    size_t producers, consumers, payload, capacity;
+    bool blocking;
+    size_t items;
+};
+
+struct Result {
+    Config config;
+    double seconds;
+    int64_t p50, p99, p999, max;
+};
+
+constexpr std::array<size_t, 3> PAYLOADS = { 8, 32, sizeof(SDL_Event) };
+constexpr std::array<size_t, 4> CAPACITIES = { 8, 64, 256, 1024 };
+
+struct Options {
+    size_t items = 1 << 18;
+    size_t max_threads = std::max(2U, std::thread::hardware_concurrency());
+    std::vector<size_t> payloads = { PAYLOADS.begin(), PAYLOADS.end() };
+    std::vector<size_t> capacities = { CAPACITIES.begin(), CAPACITIES.end() };
+    std::vector<bool> modes = { true, false };
+    bool spin = true, park = true;
+    bool json = false;
+};
+
+int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count();
+}
+
+size_t share(size_t total, size_t parts, size_t index)
+{
+    return total / parts + (index < total % parts ? 1 : 0);
+}
+
+template <typename Q, size_t S>
+Result run(Config config)
+{
+    auto queue = std::make_unique<Q>();
+    std::atomic_bool go = false;
+    std::atomic_size_t ready = 0;
+    std::vector<std::vector<int64_t>> latencies(config.consumers);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < config.producers; i++) {
+        threads.emplace_back([&, count = share(config.items, config.producers, i)]() {
+            Payload<S> item {};
+            ready.fetch_add(1);
+            while (go.load(std::memory_order_acquire) == false)
+                std::this_thread::yield();
+            for (size_t n = 0; n < count; n++) {
+                item.stamp = now_ns();
+                if (config.blocking) {
+                    queue->push(item);
+                } else {
+                    while (queue->try_push(item) == false)
+                        std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (size_t i = 0; i < config.consumers; i++) {
+        threads.emplace_back([&, i, count = share(config.items, config.consumers, i)]() {
+            Payload<S> item;
+            auto& samples = latencies[i];
+            samples.reserve(count);
+            ready.fetch_add(1);
+            while (go.load(std::memory_order_acquire) == false)
+                std::this_thread::yield();
+            for (size_t n = 0; n < count; n++) {
+                if (config.blocking) {
+                    queue->pop(item);
+                } else {
+                    while (queue->try_pop(item) == false)
+                        std::this_thread::yield();
+                }
+                samples.push_back(now_ns() - item.stamp);
+            }
+        });
+    }
+
+    while (ready.load() < threads.size())
+        std::this_thread::yield();
+    auto start = bench_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    auto end = bench_clock::now();
+
+    std::vector<int64_t> all;
+    all.reserve(config.items);
+    for (auto it = latencies.begin(); it != latencies.end(); ++it)
+        all.insert(all.end(), it->begin(), it->end());
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        return all.empty() ? 0 : all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+    };
+
+    Result result;
+    result.config = config;
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.p50 = percentile(0.5);
+    result.p99 = percentile(0.99);
+    result.p999 = percentile(0.999);
+    result.max = all.empty() ? 0 : all.back();
+    return result;
+}
+
+template <size_t S, size_t... Cs>
+void run_capacities(const Options& options, Config config, std::vector<Result>& results)
+{
+    auto run_one = [&]<size_t Cap>() {
+        if (std::find(options.capacities.begin(), options.capacities.end(), Cap) == options.capacities.end())
+            return;
+        config.capacity = Cap;
+        if (options.spin || config.blocking == false) {
+            config.wait = config.blocking ? "spin" : "none";
+            config.queue = "mpmc";
+            results.push_back(run<MPMCQ<Payload<S>, Cap, SpinThenPark<>>, S>(config));
+            if (config.producers == 1 && config.consumers == 1) {
+                config.queue = "spsc";
+                results.push_back(run<SPSCQ<Payload<S>, Cap, SpinThenPark<>>, S>(config));
+            }
+        }
+        if (options.park && config.blocking) {
+            config.wait = "park";
+            config.queue = "mpmc";
+            results.push_back(run<MPMCQ<Payload<S>, Cap, ParkImmediately>, S>(config));
+            if (config.producers == 1 && config.consumers == 1) {
+                config.queue = "spsc";
+                results.push_back(run<SPSCQ<Payload<S>, Cap, ParkImmediately>, S>(config));
+            }
+        }
+    };
+    (run_one.template operator()<Cs>(), ...);
+}
+
+template <size_t S>
+void run_payload(const Options& options, Config config, std::vector<Result>& results)
+{
+    if (std::find(options.payloads.begin(), options.payloads.end(), S) == options.payloads.end())
+        return;
+    config.payload = S;
+    run_capacities<S, CAPACITIES[0], CAPACITIES[1], CAPACITIES[2], CAPACITIES[3]>(options, config, results);
+}
+
+std::string format_list(std::span<const size_t> values)
+{
+    std::string text;
+    for (auto it = values.begin(); it != values.end(); ++it)
+        text += (it == values.begin() ? "" : ",") + std::to_string(*it);
+    return text;
+}
+
+// Parse a comma-separated list, every entry of which must be one of supported.
+bool parse_list(const char* option, const char* arg, std::span<const size_t> supported, std::vector<size_t>& values)
+{
+    values.clear();
+    for (const char* p = arg;;) {
+        char* end;
+        size_t value = std::strtoull(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0')) {
+            std::fprintf(stderr, "%s: expected a comma-separated list of numbers, got \"%s\"\n", option, arg);
+            return false;
+        }
+        if (std::find(supported.begin(), supported.end(), value) == supported.end()) {
+            std::fprintf(stderr, "%s: %zu is not supported; choose from %s\n", option, value, format_list(supported).c_str());
+            return false;
+        }
+        values.push_back(value);
+        if (*end == '\0')
+            return true;
+        p = end + 1;
+    }
+}
+
+void print_results(const std::vector<Result>& results, bool json)
+{
+    if (json)
+        std::printf("[\n");
+    else
+        std::printf("queue,wait,producers,consumers,payload,capacity,mode,items,seconds,mops,p50_ns,p99_ns,p999_ns,max_ns\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        const char* mode = r.config.blocking ? "blocking" : "polling";
+        double mops = r.config.items / r.seconds / 1e6;
+        if (json) {
+            std::printf("  {\"queue\": \"%s\", \"wait\": \"%s\", \"producers\": %zu, \"consumers\": %zu, \"payload\": %zu, \"capacity\": %zu, \"mode\": \"%s\", "
+                        "\"items\": %zu, \"seconds\": %.6f, \"mops\": %.3f, \"p50_ns\": %lld, \"p99_ns\": %lld, \"p999_ns\": %lld, \"max_ns\": %lld}%s\n",
+                r.config.queue, r.config.wait, r.config.producers, r.config.consumers, r.config.payload, r.config.capacity, mode, r.config.items, r.seconds, mops,
+                static_cast<long long>(r.p50), static_cast<long long>(r.p99), static_cast<long long>(r.p999), static_cast<long long>(r.max),
+                i + 1 < results.size() ? "," : "");
+        } else {
+            std::printf("%s,%s,%zu,%zu,%zu,%zu,%s,%zu,%.6f,%.3f,%lld,%lld,%lld,%lld\n",
+                r.config.queue, r.config.wait, r.config.producers, r.config.consumers, r.config.payload, r.config.capacity, mode, r.config.items, r.seconds, mops,
+                static_cast<long long>(r.p50), static_cast<long long>(r.p99), static_cast<long long>(r.p999), static_cast<long long>(r.max));
+        }
+    }
+    if (json)
+        std::printf("]\n");
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--items" && i + 1 < argc) {
+            options.items = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.max_threads = std::max(1ULL, std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--payload" && i + 1 < argc) {
+            if (parse_list("--payload", argv[++i], PAYLOADS, options.payloads) == false)
+                return 1;
+        } else if (arg == "--capacity" && i + 1 < argc) {
+            if (parse_list("--capacity", argv[++i], CAPACITIES, options.capacities) == false)
+                return 1;
+        } else if (arg == "--mode" && i + 1 < argc) {
+            std::string_view modes = argv[++i];
+            options.modes.clear();
+            if (modes.find("blocking") != std::string_view::npos)
+                options.modes.push_back(true);
+            if (modes.find("polling") != std::string_view::npos)
+                options.modes.push_back(false);
+        } else if (arg == "--wait" && i + 1 < argc) {
+            std::string_view waits = argv[++i];
+            options.spin = waits.find("spin") != std::string_view::npos;
+            options.park = waits.find("park") != std::string_view::npos;
+        } else {
+            std::fprintf(stderr, "usage: %s [--items N] [--threads N] [--payload %s] [--capacity %s] [--mode blocking,polling] [--wait spin,park] [--json]\n", argv[0],
+                format_list(PAYLOADS).c_str(), format_list(CAPACITIES).c_str());
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (size_t producers = 1; producers <= options.max_threads; producers *= 2) {
+        for (size_t consumers = 1; consumers <= options.max_threads; consumers *= 2) {
+            for (bool blocking : options.modes) {
+                Config config {};
+                config.producers = producers;
+                config.consumers = consumers;
+                config.blocking = blocking;
+                config.items = options.items;
+                run_payload<PAYLOADS[0]>(options, config, results);
+                run_payload<PAYLOADS[1]>(options, config, results);
+                run_payload<PAYLOADS[2]>(options, config, results);
+            }
+        }
+    }
+    print_results(results, options.json);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <filesystem>
+#include <string>
+
+namespace twogame::cook {
+
+struct Options {
+    bool etc1s = false; // encode images as Basis ETC1S instead of UASTC: much smaller, lower quality
+};
+
+/**
+ * Convert a glTF or OBJ file into a mesh container (see schemas/mesh.fbs). Every triangle primitive becomes a
+ * submesh, with its vertices deduplicated and optimized for the vertex cache, overdraw and vertex fetch. glTF meshes
+ * are placed by the scene's nodes: each node, and each of its EXT_mesh_gpu_instancing instances, gets its own copy
+ * with the transform baked in.
+ * @return false, with error set, if the source could not be cooked.
+ */
+bool cook_mesh(const std::filesystem::path& source, const std::filesystem::path& output, const Options& options, std::string& error);
+
+/**
+ * Convert an image into a Basis-encoded KTX2 texture with a full mip chain. KTX2 sources that are already encoded are
+ * copied as they are.
+ * @return false, with error set, if the source could not be cooked.
+ */
+bool cook_image(const std::filesystem::path& source, const std::filesystem::path& output, const Options& options, std::string& error);
+
+}
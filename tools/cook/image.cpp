@@ -0,0 +1,150 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <vector>
+#include <ktx.h>
+#include <stb_image.h>
+#include <stb_image_resize2.h>
+#include <vulkan/vulkan_core.h>
+#include "cook.h"
+
+namespace twogame::cook {
+
+namespace {
+
+    // Data that isn't colour is stored linearly. Texture names say which is which.
+    constexpr std::array LINEAR_SUFFIXES = { "_n", "_normal", "_mr", "_orm", "_rough", "_metal", "_ao" };
+
+    bool is_linear(const std::filesystem::path& source)
+    {
+        std::string stem = source.stem().string();
+        for (auto it = LINEAR_SUFFIXES.begin(); it != LINEAR_SUFFIXES.end(); ++it) {
+            if (stem.ends_with(*it))
+                return true;
+        }
+        return false;
+    }
+
+    struct Level {
+        uint32_t width, height;
+        std::vector<uint8_t> pixels; // RGBA8
+    };
+
+    bool load_ktx2(const std::filesystem::path& source, const std::filesystem::path& output, Level& base, bool& copied, std::string& error)
+    {
+        ktxTexture2* texture;
+        if (ktxTexture2_CreateFromNamedFile(source.string().c_str(), KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT, &texture) != KTX_SUCCESS) {
+            error = "cannot read KTX2";
+            return false;
+        }
+
+        bool ok = true;
+        if (ktxTexture2_NeedsTranscoding(texture) || texture->supercompressionScheme != KTX_SS_NONE) {
+            // Already encoded. The runtime can't generate mipmaps, so only a texture that doesn't need them will do.
+            if (texture->generateMipmaps) {
+                error = "encoded KTX2 asks for generated mipmaps";
+                ok = false;
+            } else if (ktxTexture_WriteToNamedFile(ktxTexture(texture), output.string().c_str()) != KTX_SUCCESS) {
+                error = "cannot write " + output.string();
+                ok = false;
+            }
+            copied = true;
+        } else if (texture->vkFormat == VK_FORMAT_R8G8B8A8_UNORM || texture->vkFormat == VK_FORMAT_R8G8B8A8_SRGB) {
+            ktx_size_t offset;
+            ktxTexture_GetImageOffset(ktxTexture(texture), 0, 0, 0, &offset);
+            base.width = texture->baseWidth;
+            base.height = texture->baseHeight;
+            base.pixels.assign(texture->pData + offset, texture->pData + offset + ktxTexture_GetImageSize(ktxTexture(texture), 0));
+        } else {
+            error = "unsupported KTX2 format";
+            ok = false;
+        }
+        ktxTexture_Destroy(ktxTexture(texture));
+        return ok;
+    }
+
+}
+
+bool cook_image(const std::filesystem::path& source, const std::filesystem::path& output, const Options& options, std::string& error)
+{
+    Level base;
+    std::string ext = source.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (ext == ".ktx2") {
+        bool copied = false;
+        if (load_ktx2(source, output, base, copied, error) == false)
+            return false;
+        if (copied)
+            return true;
+    } else {
+        int width, height, channels;
+        stbi_uc* pixels = stbi_load(source.string().c_str(), &width, &height, &channels, STBI_rgb_alpha);
+        if (pixels == nullptr) {
+            error = stbi_failure_reason();
+            return false;
+        }
+        base.width = width;
+        base.height = height;
+        base.pixels.assign(pixels, pixels + size_t(width) * height * 4);
+        stbi_image_free(pixels);
+    }
+
+    // Each level is filtered down from the base, rather than from the level before it.
+    bool linear = is_linear(source);
+    std::vector<Level> levels;
+    levels.push_back(std::move(base));
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const Level& top = levels.front();
+        Level next;
+        next.width = std::max(1U, levels.back().width / 2);
+        next.height = std::max(1U, levels.back().height / 2);
+        next.pixels.resize(size_t(next.width) * next.height * 4);
+        if (linear)
+            stbir_resize_uint8_linear(top.pixels.data(), top.width, top.height, 0, next.pixels.data(), next.width, next.height, 0, STBIR_RGBA);
+        else
+            stbir_resize_uint8_srgb(top.pixels.data(), top.width, top.height, 0, next.pixels.data(), next.width, next.height, 0, STBIR_RGBA);
+        levels.push_back(std::move(next));
+    }
+
+    ktxTextureCreateInfo info {};
+    info.vkFormat = linear ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R8G8B8A8_SRGB;
+    info.baseWidth = levels[0].width;
+    info.baseHeight = levels[0].height;
+    info.baseDepth = 1;
+    info.numDimensions = 2;
+    info.numLevels = levels.size();
+    info.numLayers = 1;
+    info.numFaces = 1;
+    info.isArray = KTX_FALSE;
+    info.generateMipmaps = KTX_FALSE;
+
+    ktxTexture2* texture;
+    if (ktxTexture2_Create(&info, KTX_TEXTURE_CREATE_ALLOC_STORAGE, &texture) != KTX_SUCCESS) {
+        error = "cannot create KTX2";
+        return false;
+    }
+    for (uint32_t level = 0; level < levels.size(); level++)
+        ktxTexture_SetImageFromMemory(ktxTexture(texture), level, 0, 0, levels[level].pixels.data(), levels[level].pixels.size());
+
+    // Files are cooked one per thread already, so the encoder stays single-threaded.
+    ktxBasisParams params {};
+    params.structSize = sizeof(params);
+    params.uastc = options.etc1s ? KTX_FALSE : KTX_TRUE;
+    params.threadCount = 1;
+    params.normalMap = linear && (source.stem().string().ends_with("_n") || source.stem().string().ends_with("_normal"));
+    ktx_error_code_e result = ktxTexture2_CompressBasisEx(texture, &params);
+    if (result == KTX_SUCCESS && params.uastc)
+        result = ktxTexture2_DeflateZstd(texture, 18);
+    if (result == KTX_SUCCESS)
+        result = ktxTexture_WriteToNamedFile(ktxTexture(texture), output.string().c_str());
+    ktxTexture_Destroy(ktxTexture(texture));
+    if (result != KTX_SUCCESS) {
+        error = ktxErrorString(result);
+        return false;
+    }
+    return true;
+}
+
+}
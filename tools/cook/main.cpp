@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "cook.h"
+
+// Cooks a content directory into the formats the runtime loads: glTF and OBJ meshes into mesh containers (.tgm), and
+// PNG, JPEG, TGA and KTX2 images into mipmapped, Basis-encoded KTX2. The output mirrors the layout of the content
+// directory.
+//
+// Cooking is incremental: a file is only cooked again if it is newer than its output, or if the cooker or its options
+// changed since the last complete run. Files are cooked in parallel, one per thread.
+//
+// Usage: twogame-cook <content dir> <output dir> [--jobs N] [--force] [--etc1s]
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// Bump whenever the output of either cooker changes, so that existing outputs get rebuilt.
+constexpr int COOK_VERSION = 2;
+constexpr std::string_view STAMP_NAME = ".cook-stamp";
+
+enum class Kind {
+    Mesh,
+    Image,
+};
+
+struct Task {
+    fs::path source, output;
+    Kind kind;
+};
+
+bool classify(const fs::path& source, Kind& kind)
+{
+    std::string ext = source.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (ext == ".gltf" || ext == ".glb" || ext == ".obj")
+        kind = Kind::Mesh;
+    else if (ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".tga" || ext == ".ktx2")
+        kind = Kind::Image;
+    else
+        return false;
+    return true;
+}
+
+std::string read_stamp(const fs::path& path)
+{
+    std::ifstream in(path);
+    std::string stamp;
+    std::getline(in, stamp);
+    return stamp;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    twogame::cook::Options options;
+    std::vector<std::string_view> positional;
+    size_t jobs = std::max(1U, std::thread::hardware_concurrency());
+    bool force = false;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::max(1ULL, std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--force") {
+            force = true;
+        } else if (arg == "--etc1s") {
+            options.etc1s = true;
+        } else if (arg.starts_with("--") == false) {
+            positional.push_back(arg);
+        } else {
+            positional.clear();
+            break;
+        }
+    }
+    if (positional.size() != 2) {
+        std::fprintf(stderr, "usage: %s <content dir> <output dir> [--jobs N] [--force] [--etc1s]\n", argv[0]);
+        return 2;
+    }
+
+    fs::path content_dir = positional[0], output_dir = positional[1];
+    std::error_code ec;
+    if (fs::is_directory(content_dir, ec) == false) {
+        std::fprintf(stderr, "%s is not a directory\n", content_dir.string().c_str());
+        return 2;
+    }
+    fs::create_directories(output_dir, ec);
+
+    // Anything cooked by a different version or with different options is stale. The stamp is removed until the run
+    // completes, so an interrupted run doesn't leave those outputs looking current.
+    char stamp[64];
+    std::snprintf(stamp, sizeof(stamp), "twogame-cook %d%s", COOK_VERSION, options.etc1s ? " etc1s" : "");
+    fs::path stamp_path = output_dir / STAMP_NAME;
+    if (read_stamp(stamp_path) != stamp) {
+        force = true;
+        fs::remove(stamp_path, ec);
+    }
+
+    std::vector<Task> tasks;
+    std::map<fs::path, fs::path> sources; // output -> the source that cooks to it
+    size_t total = 0, collisions = 0;
+    for (auto it = fs::recursive_directory_iterator(content_dir, ec); it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        Kind kind;
+        if (it->is_regular_file() == false || classify(it->path(), kind) == false)
+            continue;
+
+        Task& task = tasks.emplace_back();
+        task.source = it->path();
+        task.output = output_dir / fs::relative(it->path(), content_dir);
+        task.output.replace_extension(kind == Kind::Mesh ? ".tgm" : ".ktx2");
+        task.kind = kind;
+        total++;
+
+        // Sources that differ only in extension, like x.png and x.ktx2, would overwrite each other's output.
+        auto [claimed, inserted] = sources.emplace(task.output, task.source);
+        if (inserted == false) {
+            std::fprintf(stderr, "%s and %s both cook to %s\n", claimed->second.string().c_str(), task.source.string().c_str(), task.output.string().c_str());
+            collisions++;
+        }
+
+        fs::file_time_type output_time = fs::last_write_time(task.output, ec);
+        if (force == false && !ec && output_time >= it->last_write_time())
+            tasks.pop_back();
+    }
+    if (collisions > 0)
+        return 2;
+    std::printf("%zu of %zu files need cooking\n", tasks.size(), total);
+
+    // Biggest files first, so that one large file doesn't start last and hold up the end of the run.
+    std::vector<uintmax_t> sizes(tasks.size());
+    for (size_t i = 0; i < tasks.size(); i++)
+        sizes[i] = fs::file_size(tasks[i].source, ec);
+    std::vector<size_t> order(tasks.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&sizes](size_t left, size_t right) { return sizes[left] > sizes[right]; });
+
+    std::atomic_size_t next = 0, failures = 0;
+    std::mutex print_lock;
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1, std::memory_order_relaxed)) < order.size()) {
+            const Task& task = tasks[order[i]];
+            std::error_code ec;
+            fs::create_directories(task.output.parent_path(), ec);
+
+            // Cook to a temporary file, so that a failed or interrupted cook never leaves a current-looking output.
+            fs::path scratch = task.output;
+            scratch += ".tmp";
+            std::string error;
+            bool ok = task.kind == Kind::Mesh ? twogame::cook::cook_mesh(task.source, scratch, options, error)
+                                              : twogame::cook::cook_image(task.source, scratch, options, error);
+            if (ok) {
+                fs::rename(scratch, task.output, ec);
+                if (ec) {
+                    ok = false;
+                    error = ec.message();
+                }
+            }
+            if (ok == false) {
+                fs::remove(scratch, ec);
+                failures.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            std::lock_guard lock(print_lock);
+            if (ok)
+                std::printf("cooked %s\n", task.output.string().c_str());
+            else
+                std::fprintf(stderr, "failed %s: %s\n", task.source.string().c_str(), error.c_str());
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(jobs, tasks.size()); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    if (failures.load() > 0) {
+        std::fprintf(stderr, "%zu of %zu files failed to cook\n", failures.load(), tasks.size());
+        return 1;
+    }
+    std::ofstream(stamp_path) << stamp << '\n';
+    return 0;
+}
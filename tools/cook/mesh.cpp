@@ -0,0 +1,475 @@
+#define CGLTF_IMPLEMENTATION
+#define FAST_OBJ_IMPLEMENTATION
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <cgltf.h>
+#include <fast_obj.h>
+#include <meshoptimizer.h>
+#include <vulkan/vulkan_core.h>
+#include "cook.h"
+#include "mesh_generated.h"
+
+namespace twogame::cook {
+
+namespace {
+
+    // One triangle list with a single material. Streams are unpacked to float: 3 per position and normal, 2 per uv.
+    struct Primitive {
+        std::vector<float> positions, normals, uvs;
+        std::vector<uint32_t> indices;
+        uint32_t material;
+
+        inline size_t vertex_count() const { return positions.size() / 3; }
+    };
+
+    // The texture is relative to the mesh and already has the extension it is cooked to, or is empty if there is none.
+    struct MaterialSource {
+        std::string name, base_color_texture;
+    };
+
+    struct SourceMesh {
+        std::vector<Primitive> primitives;
+        std::vector<MaterialSource> materials;
+    };
+
+    struct CookedSubmesh {
+        uint32_t first_index, index_count;
+        int32_t vertex_offset;
+        uint32_t material;
+        schema::Bounds bounds;
+    };
+
+    struct Cooked {
+        std::vector<float> positions, normals, uvs;
+        std::vector<uint32_t> indices;
+        std::vector<CookedSubmesh> submeshes;
+        uint32_t max_submesh_vertices = 0;
+    };
+
+    constexpr uint64_t PAYLOAD_ALIGNMENT = 16;
+
+    inline uint64_t align(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    // Images are cooked next to their source with the extension swapped, so a material refers to what they become.
+    std::string cooked_texture(std::string_view source)
+    {
+        return std::filesystem::path(source).replace_extension(".ktx2").generic_string();
+    }
+
+    // Column-major 4x4 matrices, as glTF stores them: out = left * right.
+    void multiply(const float* left, const float* right, float* out)
+    {
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                float sum = 0.f;
+                for (int k = 0; k < 4; k++)
+                    sum += left[4 * k + r] * right[4 * c + k];
+                out[4 * c + r] = sum;
+            }
+        }
+    }
+
+    /** Move a primitive by the transform m. Normals go by the inverse transpose, and a mirroring m flips winding. */
+    void bake(Primitive& prim, const float* m)
+    {
+        // The cofactor matrix is the inverse transpose scaled by the determinant; normals are renormalized anyway.
+        float cofactor[9] = {
+            m[5] * m[10] - m[6] * m[9], m[6] * m[8] - m[4] * m[10], m[4] * m[9] - m[5] * m[8],
+            m[2] * m[9] - m[1] * m[10], m[0] * m[10] - m[2] * m[8], m[1] * m[8] - m[0] * m[9],
+            m[1] * m[6] - m[2] * m[5], m[2] * m[4] - m[0] * m[6], m[0] * m[5] - m[1] * m[4]
+        };
+        float determinant = m[0] * cofactor[0] + m[4] * cofactor[1] + m[8] * cofactor[2];
+        float sign = determinant < 0.f ? -1.f : 1.f;
+
+        for (size_t v = 0; v < prim.vertex_count(); v++) {
+            float* p = &prim.positions[3 * v];
+            float* n = &prim.normals[3 * v];
+            float position[3], normal[3];
+            for (int r = 0; r < 3; r++) {
+                position[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] + m[12 + r];
+                normal[r] = sign * (cofactor[3 * r] * n[0] + cofactor[3 * r + 1] * n[1] + cofactor[3 * r + 2] * n[2]);
+            }
+            float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            for (int r = 0; r < 3; r++) {
+                p[r] = position[r];
+                n[r] = length > 0.f ? normal[r] / length : 0.f;
+            }
+        }
+        if (determinant < 0.f) {
+            for (size_t i = 0; i + 2 < prim.indices.size(); i += 3)
+                std::swap(prim.indices[i + 1], prim.indices[i + 2]);
+        }
+    }
+
+    bool load_primitive(const cgltf_data* data, const cgltf_primitive& src, SourceMesh& mesh, uint32_t& default_material, Primitive& prim)
+    {
+        if (src.type != cgltf_primitive_type_triangles)
+            return false;
+
+        const cgltf_accessor *position = nullptr, *normal = nullptr, *uv = nullptr;
+        for (size_t a = 0; a < src.attributes_count; a++) {
+            if (src.attributes[a].type == cgltf_attribute_type_position)
+                position = src.attributes[a].data;
+            else if (src.attributes[a].type == cgltf_attribute_type_normal)
+                normal = src.attributes[a].data;
+            else if (src.attributes[a].type == cgltf_attribute_type_texcoord && src.attributes[a].index == 0)
+                uv = src.attributes[a].data;
+        }
+        if (position == nullptr)
+            return false;
+
+        size_t vertex_count = position->count;
+        prim.positions.resize(vertex_count * 3);
+        prim.normals.resize(vertex_count * 3, 0.f);
+        prim.uvs.resize(vertex_count * 2, 0.f);
+        cgltf_accessor_unpack_floats(position, prim.positions.data(), prim.positions.size());
+        if (normal)
+            cgltf_accessor_unpack_floats(normal, prim.normals.data(), prim.normals.size());
+        if (uv)
+            cgltf_accessor_unpack_floats(uv, prim.uvs.data(), prim.uvs.size());
+
+        if (src.indices) {
+            prim.indices.resize(src.indices->count);
+            for (size_t i = 0; i < prim.indices.size(); i++)
+                prim.indices[i] = cgltf_accessor_read_index(src.indices, i);
+        } else {
+            prim.indices.resize(vertex_count);
+            for (size_t i = 0; i < prim.indices.size(); i++)
+                prim.indices[i] = i;
+        }
+
+        if (src.material) {
+            prim.material = cgltf_material_index(data, src.material);
+        } else {
+            if (default_material == UINT32_MAX) {
+                default_material = mesh.materials.size();
+                mesh.materials.push_back({ "default", {} });
+            }
+            prim.material = default_material;
+        }
+        return true;
+    }
+
+    /** The node's EXT_mesh_gpu_instancing transforms, in its local space: just the identity if it has none. */
+    std::vector<std::array<float, 16>> instances_of(const cgltf_node* node)
+    {
+        std::vector<std::array<float, 16>> instances;
+        const cgltf_accessor *translation = nullptr, *rotation = nullptr, *scale = nullptr;
+        size_t count = 1;
+        if (node->has_mesh_gpu_instancing) {
+            for (size_t a = 0; a < node->mesh_gpu_instancing.attributes_count; a++) {
+                const cgltf_attribute& attribute = node->mesh_gpu_instancing.attributes[a];
+                if (std::strcmp(attribute.name, "TRANSLATION") == 0)
+                    translation = attribute.data;
+                else if (std::strcmp(attribute.name, "ROTATION") == 0)
+                    rotation = attribute.data;
+                else if (std::strcmp(attribute.name, "SCALE") == 0)
+                    scale = attribute.data;
+                else
+                    continue;
+                count = attribute.data->count;
+            }
+        }
+
+        // cgltf composes a node's TRS into a matrix; an instance is composed the same way.
+        for (size_t i = 0; i < count; i++) {
+            cgltf_node instance {};
+            instance.rotation[3] = 1.f;
+            instance.scale[0] = instance.scale[1] = instance.scale[2] = 1.f;
+            if (translation)
+                cgltf_accessor_read_float(translation, i, instance.translation, 3);
+            if (rotation)
+                cgltf_accessor_read_float(rotation, i, instance.rotation, 4);
+            if (scale)
+                cgltf_accessor_read_float(scale, i, instance.scale, 3);
+            cgltf_node_transform_local(&instance, instances.emplace_back().data());
+        }
+        return instances;
+    }
+
+    bool load_gltf(const std::filesystem::path& source, SourceMesh& mesh, std::string& error)
+    {
+        cgltf_options options {};
+        cgltf_data* data = nullptr;
+        if (cgltf_parse_file(&options, source.string().c_str(), &data) != cgltf_result_success) {
+            error = "cannot parse glTF";
+            return false;
+        }
+        if (cgltf_load_buffers(&options, data, source.string().c_str()) != cgltf_result_success) {
+            cgltf_free(data);
+            error = "cannot load glTF buffers";
+            return false;
+        }
+
+        for (size_t i = 0; i < data->materials_count; i++) {
+            const cgltf_material& src = data->materials[i];
+            MaterialSource& material = mesh.materials.emplace_back();
+            material.name = src.name ? src.name : "material" + std::to_string(i);
+            const cgltf_texture* texture = src.has_pbr_metallic_roughness ? src.pbr_metallic_roughness.base_color_texture.texture : nullptr;
+            // Images embedded in the file, or given as data: URIs, aren't cooked on their own, so they have no texture.
+            if (texture && texture->image && texture->image->uri && strncmp(texture->image->uri, "data:", 5) != 0) {
+                std::string uri = texture->image->uri;
+                uri.resize(cgltf_decode_uri(uri.data()));
+                material.base_color_texture = cooked_texture(uri);
+            }
+        }
+        uint32_t default_material = UINT32_MAX;
+
+        // A file without nodes is just a bag of meshes, each in its own space.
+        if (data->nodes_count == 0) {
+            for (size_t m = 0; m < data->meshes_count; m++) {
+                for (size_t p = 0; p < data->meshes[m].primitives_count; p++) {
+                    Primitive prim;
+                    if (load_primitive(data, data->meshes[m].primitives[p], mesh, default_material, prim))
+                        mesh.primitives.push_back(std::move(prim));
+                }
+            }
+            cgltf_free(data);
+            return true;
+        }
+
+        // Otherwise walk the scene, or every root node if there is none, and bake each use of a mesh into place.
+        std::vector<const cgltf_node*> stack;
+        const cgltf_scene* scene = data->scene ? data->scene : (data->scenes_count > 0 ? &data->scenes[0] : nullptr);
+        if (scene) {
+            for (size_t i = 0; i < scene->nodes_count; i++)
+                stack.push_back(scene->nodes[i]);
+        } else {
+            for (size_t i = 0; i < data->nodes_count; i++) {
+                if (data->nodes[i].parent == nullptr)
+                    stack.push_back(&data->nodes[i]);
+            }
+        }
+        while (stack.empty() == false) {
+            const cgltf_node* node = stack.back();
+            stack.pop_back();
+            for (size_t i = node->children_count; i-- > 0;)
+                stack.push_back(node->children[i]);
+            if (node->mesh == nullptr)
+                continue;
+
+            float world[16];
+            cgltf_node_transform_world(node, world);
+            std::vector<std::array<float, 16>> instances = instances_of(node);
+            for (auto it = instances.begin(); it != instances.end(); ++it) {
+                float transform[16];
+                multiply(world, it->data(), transform);
+                for (size_t p = 0; p < node->mesh->primitives_count; p++) {
+                    Primitive prim;
+                    if (load_primitive(data, node->mesh->primitives[p], mesh, default_material, prim) == false)
+                        continue;
+                    bake(prim, transform);
+                    mesh.primitives.push_back(std::move(prim));
+                }
+            }
+        }
+        cgltf_free(data);
+        return true;
+    }
+
+    bool load_obj(const std::filesystem::path& source, SourceMesh& mesh, std::string& error)
+    {
+        fastObjMesh* obj = fast_obj_read(source.string().c_str());
+        if (obj == nullptr) {
+            error = "cannot read OBJ";
+            return false;
+        }
+
+        // OBJ indexes each attribute separately. Emit every corner as its own vertex; they get welded later.
+        unsigned material_count = std::max(1U, obj->material_count);
+        std::vector<Primitive> by_material(material_count);
+        for (unsigned i = 0; i < material_count; i++) {
+            by_material[i].material = i;
+            MaterialSource& material = mesh.materials.emplace_back();
+            material.name = i < obj->material_count && obj->materials[i].name ? obj->materials[i].name : "default";
+            // Texture paths are resolved against the material library, which needn't sit next to the mesh.
+            if (i < obj->material_count && obj->materials[i].map_Kd) {
+                const fastObjTexture& texture = obj->textures[obj->materials[i].map_Kd];
+                material.base_color_texture = cooked_texture(std::filesystem::path(texture.path).lexically_relative(source.parent_path()).generic_string());
+            }
+        }
+
+        unsigned corner = 0;
+        for (unsigned f = 0; f < obj->face_count; f++) {
+            unsigned face_vertices = obj->face_vertices[f];
+            Primitive& prim = by_material[obj->material_count ? obj->face_materials[f] : 0];
+            for (unsigned k = 1; k + 1 < face_vertices; k++) {
+                for (unsigned v : { 0U, k, k + 1 }) {
+                    const fastObjIndex& index = obj->indices[corner + v];
+                    prim.indices.push_back(prim.vertex_count());
+                    prim.positions.insert(prim.positions.end(), obj->positions + 3 * index.p, obj->positions + 3 * index.p + 3);
+                    prim.normals.insert(prim.normals.end(), obj->normals + 3 * index.n, obj->normals + 3 * index.n + 3);
+                    prim.uvs.push_back(obj->texcoords[2 * index.t]);
+                    prim.uvs.push_back(1.f - obj->texcoords[2 * index.t + 1]); // OBJ puts v = 0 at the bottom
+                }
+            }
+            corner += face_vertices;
+        }
+        fast_obj_destroy(obj);
+
+        for (auto it = by_material.begin(); it != by_material.end(); ++it) {
+            if (it->indices.empty() == false)
+                mesh.primitives.push_back(std::move(*it));
+        }
+        return true;
+    }
+
+    void optimize(Primitive& prim)
+    {
+        size_t index_count = prim.indices.size(), vertex_count = prim.vertex_count();
+        meshopt_Stream streams[] = {
+            { prim.positions.data(), sizeof(float) * 3, sizeof(float) * 3 },
+            { prim.normals.data(), sizeof(float) * 3, sizeof(float) * 3 },
+            { prim.uvs.data(), sizeof(float) * 2, sizeof(float) * 2 },
+        };
+
+        // Weld identical vertices.
+        std::vector<unsigned int> remap(vertex_count);
+        size_t unique = meshopt_generateVertexRemapMulti(remap.data(), prim.indices.data(), index_count, vertex_count, streams, std::size(streams));
+        meshopt_remapIndexBuffer(prim.indices.data(), prim.indices.data(), index_count, remap.data());
+        std::vector<float> positions(unique * 3), normals(unique * 3), uvs(unique * 2);
+        meshopt_remapVertexBuffer(positions.data(), prim.positions.data(), vertex_count, sizeof(float) * 3, remap.data());
+        meshopt_remapVertexBuffer(normals.data(), prim.normals.data(), vertex_count, sizeof(float) * 3, remap.data());
+        meshopt_remapVertexBuffer(uvs.data(), prim.uvs.data(), vertex_count, sizeof(float) * 2, remap.data());
+
+        meshopt_optimizeVertexCache(prim.indices.data(), prim.indices.data(), index_count, unique);
+        meshopt_optimizeOverdraw(prim.indices.data(), prim.indices.data(), index_count, positions.data(), unique, sizeof(float) * 3, 1.05f);
+
+        // Lay vertices out in the order the index buffer first uses them.
+        remap.resize(unique);
+        unique = meshopt_optimizeVertexFetchRemap(remap.data(), prim.indices.data(), index_count, unique);
+        meshopt_remapIndexBuffer(prim.indices.data(), prim.indices.data(), index_count, remap.data());
+        prim.positions.resize(unique * 3);
+        prim.normals.resize(unique * 3);
+        prim.uvs.resize(unique * 2);
+        meshopt_remapVertexBuffer(prim.positions.data(), positions.data(), positions.size() / 3, sizeof(float) * 3, remap.data());
+        meshopt_remapVertexBuffer(prim.normals.data(), normals.data(), normals.size() / 3, sizeof(float) * 3, remap.data());
+        meshopt_remapVertexBuffer(prim.uvs.data(), uvs.data(), uvs.size() / 2, sizeof(float) * 2, remap.data());
+    }
+
+    schema::Bounds bounds_of(const float* positions, size_t vertex_count)
+    {
+        float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (size_t v = 0; v < vertex_count; v++) {
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], positions[3 * v + c]);
+                hi[c] = std::max(hi[c], positions[3 * v + c]);
+            }
+        }
+        if (vertex_count == 0)
+            return schema::Bounds();
+        return schema::Bounds(schema::Vec3(lo[0], lo[1], lo[2]), schema::Vec3(hi[0], hi[1], hi[2]));
+    }
+
+    std::vector<uint8_t> build_header(const SourceMesh& source, const Cooked& cooked, schema::IndexType index_type, uint64_t index_size, uint64_t payload_base)
+    {
+        uint64_t vertex_count = cooked.positions.size() / 3;
+        uint64_t normal_offset = align(vertex_count * sizeof(float) * 3, PAYLOAD_ALIGNMENT);
+        uint64_t uv_offset = normal_offset + align(vertex_count * sizeof(float) * 3, PAYLOAD_ALIGNMENT);
+        uint64_t vertex_size = uv_offset + vertex_count * sizeof(float) * 2;
+
+        flatbuffers::FlatBufferBuilder fbb;
+        std::vector<flatbuffers::Offset<schema::Stream>> streams;
+        streams.push_back(schema::CreateStream(fbb, schema::Semantic::Position, VK_FORMAT_R32G32B32_SFLOAT, sizeof(float) * 3, 0));
+        streams.push_back(schema::CreateStream(fbb, schema::Semantic::Normal, VK_FORMAT_R32G32B32_SFLOAT, sizeof(float) * 3, normal_offset));
+        streams.push_back(schema::CreateStream(fbb, schema::Semantic::TexCoord, VK_FORMAT_R32G32_SFLOAT, sizeof(float) * 2, uv_offset));
+        std::vector<flatbuffers::Offset<schema::Submesh>> submeshes;
+        for (auto it = cooked.submeshes.begin(); it != cooked.submeshes.end(); ++it)
+            submeshes.push_back(schema::CreateSubmesh(fbb, it->first_index, it->index_count, it->vertex_offset, it->material, &it->bounds));
+        std::vector<flatbuffers::Offset<schema::MaterialSlot>> materials;
+        for (auto it = source.materials.begin(); it != source.materials.end(); ++it) {
+            auto texture = it->base_color_texture.empty() ? 0 : fbb.CreateString(it->base_color_texture);
+            materials.push_back(schema::CreateMaterialSlot(fbb, fbb.CreateString(it->name), texture));
+        }
+
+        schema::Bounds bounds = bounds_of(cooked.positions.data(), vertex_count);
+        schema::Region vertex_data(payload_base, vertex_size);
+        schema::Region index_data(align(payload_base + vertex_size, PAYLOAD_ALIGNMENT), index_size);
+        auto root = schema::CreateMesh(fbb, vertex_count, fbb.CreateVector(streams), index_type, cooked.indices.size(),
+            fbb.CreateVector(submeshes), fbb.CreateVector(materials), &bounds, &vertex_data, &index_data);
+        fbb.FinishSizePrefixed(root, schema::MeshIdentifier());
+        return std::vector<uint8_t>(fbb.GetBufferPointer(), fbb.GetBufferPointer() + fbb.GetSize());
+    }
+
+}
+
+bool cook_mesh(const std::filesystem::path& source, const std::filesystem::path& output, const Options&, std::string& error)
+{
+    SourceMesh mesh;
+    std::string ext = source.extension().string();
+    bool loaded = (ext == ".obj" || ext == ".OBJ") ? load_obj(source, mesh, error) : load_gltf(source, mesh, error);
+    if (loaded == false)
+        return false;
+    if (mesh.primitives.empty()) {
+        error = "no triangles";
+        return false;
+    }
+
+    Cooked cooked;
+    for (auto it = mesh.primitives.begin(); it != mesh.primitives.end(); ++it) {
+        optimize(*it);
+        uint32_t vertex_count = it->vertex_count();
+        cooked.submeshes.push_back({
+            .first_index = static_cast<uint32_t>(cooked.indices.size()),
+            .index_count = static_cast<uint32_t>(it->indices.size()),
+            .vertex_offset = static_cast<int32_t>(cooked.positions.size() / 3),
+            .material = it->material,
+            .bounds = bounds_of(it->positions.data(), vertex_count),
+        });
+        cooked.max_submesh_vertices = std::max(cooked.max_submesh_vertices, vertex_count);
+        cooked.positions.insert(cooked.positions.end(), it->positions.begin(), it->positions.end());
+        cooked.normals.insert(cooked.normals.end(), it->normals.begin(), it->normals.end());
+        cooked.uvs.insert(cooked.uvs.end(), it->uvs.begin(), it->uvs.end());
+        cooked.indices.insert(cooked.indices.end(), it->indices.begin(), it->indices.end());
+    }
+
+    // Indices are relative to each submesh's base vertex, so they narrow as long as every submesh is small enough.
+    bool narrow = cooked.max_submesh_vertices <= UINT16_MAX + 1;
+    schema::IndexType index_type = narrow ? schema::IndexType::UInt16 : schema::IndexType::UInt32;
+    uint64_t index_size = cooked.indices.size() * (narrow ? sizeof(uint16_t) : sizeof(uint32_t));
+
+    // Regions are fixed-size structs, so the header is the same size however far along the payloads start.
+    std::vector<uint8_t> header = build_header(mesh, cooked, index_type, index_size, 0);
+    uint64_t payload_base = align(header.size(), PAYLOAD_ALIGNMENT);
+    header = build_header(mesh, cooked, index_type, index_size, payload_base);
+    if (align(header.size(), PAYLOAD_ALIGNMENT) != payload_base) {
+        error = "header size changed";
+        return false;
+    }
+
+    const schema::Mesh* root = schema::GetSizePrefixedMesh(header.data());
+    std::vector<uint8_t> payload(root->index_data()->offset() + index_size - payload_base, 0);
+    uint8_t* vertex_data = payload.data() + (root->vertex_data()->offset() - payload_base);
+    const auto* streams = root->streams();
+    std::memcpy(vertex_data + streams->Get(0)->offset(), cooked.positions.data(), cooked.positions.size() * sizeof(float));
+    std::memcpy(vertex_data + streams->Get(1)->offset(), cooked.normals.data(), cooked.normals.size() * sizeof(float));
+    std::memcpy(vertex_data + streams->Get(2)->offset(), cooked.uvs.data(), cooked.uvs.size() * sizeof(float));
+    uint8_t* index_data = payload.data() + (root->index_data()->offset() - payload_base);
+    if (narrow) {
+        for (size_t i = 0; i < cooked.indices.size(); i++) {
+            uint16_t index = cooked.indices[i];
+            std::memcpy(index_data + i * sizeof(index), &index, sizeof(index));
+        }
+    } else {
+        std::memcpy(index_data, cooked.indices.data(), index_size);
+    }
+
+    std::ofstream out(output, std::ios::binary | std::ios::trunc);
+    header.resize(payload_base, 0);
+    out.write(reinterpret_cast<const char*>(header.data()), header.size());
+    out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+    if (out.good() == false) {
+        error = "cannot write " + output.string();
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "pk2.h"
+
+// Builds a .pk2 pack from a directory, usually the output of twogame-cook. Every file is stored uncompressed: files of
+// a page or more start on a page boundary, everything else on a 16-byte boundary. Entry paths are relative to the
+// directory, and the pack is mounted under its own stem, so content/meshes/duck.tgm packed into data.pk2 is read as
+// /data/meshes/duck.tgm.
+//
+// Usage: twogame-pack <input dir> <output.pk2>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+constexpr uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+constexpr uint32_t END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06054b50;
+constexpr uint16_t ZIP_VERSION = 20;
+constexpr uint16_t ALIGNMENT_EXTRA_ID = 0xd935; // the extra field zipalign pads with
+constexpr uint16_t DOS_DATE = (1 << 5) | 1; // 1980-01-01, so that packing the same files gives the same pack
+constexpr size_t LOCAL_HEADER_SIZE = 30;
+
+struct Entry {
+    std::string name;
+    fs::path source;
+    uint64_t header_offset, data_offset, size;
+    uint32_t crc;
+};
+
+class Writer {
+    std::ofstream m_out;
+    uint64_t m_offset = 0;
+
+public:
+    Writer(const fs::path& path)
+        : m_out(path, std::ios::binary | std::ios::trunc)
+    {
+    }
+
+    inline bool good() const { return m_out.good(); }
+    inline uint64_t offset() const { return m_offset; }
+
+    void bytes(const void* data, size_t size)
+    {
+        m_out.write(static_cast<const char*>(data), size);
+        m_offset += size;
+    }
+
+    void zeros(size_t size)
+    {
+        static const std::array<char, 4096> zero {};
+        for (size_t written = 0; written < size; written += zero.size())
+            bytes(zero.data(), std::min(zero.size(), size - written));
+    }
+
+    inline void u16(uint16_t value) { bytes(&value, sizeof(value)); }
+    inline void u32(uint32_t value) { bytes(&value, sizeof(value)); }
+};
+
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = []() {
+        std::array<uint32_t, 256> table;
+        for (uint32_t i = 0; i < table.size(); i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return table;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void write_local_header(Writer& out, Entry& entry)
+{
+    // Pad with an extra field so the data lands on its boundary. The field needs four bytes of its own, so a gap
+    // smaller than that takes another whole boundary.
+    uint64_t alignment = entry.size >= twogame::pk2::PAGE_ALIGNMENT ? twogame::pk2::PAGE_ALIGNMENT : twogame::pk2::ENTRY_ALIGNMENT;
+    uint64_t unpadded = out.offset() + LOCAL_HEADER_SIZE + entry.name.size();
+    uint64_t padding = (alignment - unpadded % alignment) % alignment;
+    if (padding > 0 && padding < 4)
+        padding += alignment;
+
+    entry.header_offset = out.offset();
+    out.u32(LOCAL_HEADER_SIGNATURE);
+    out.u16(ZIP_VERSION);
+    out.u16(0); // flags
+    out.u16(0); // stored
+    out.u16(0); // time
+    out.u16(DOS_DATE);
+    out.u32(entry.crc);
+    out.u32(entry.size);
+    out.u32(entry.size);
+    out.u16(entry.name.size());
+    out.u16(padding);
+    out.bytes(entry.name.data(), entry.name.size());
+    if (padding > 0) {
+        out.u16(ALIGNMENT_EXTRA_ID);
+        out.u16(padding - 4);
+        out.zeros(padding - 4);
+    }
+    entry.data_offset = out.offset();
+}
+
+void write_central_header(Writer& out, const Entry& entry)
+{
+    out.u32(CENTRAL_HEADER_SIGNATURE);
+    out.u16(ZIP_VERSION); // made by
+    out.u16(ZIP_VERSION); // needed
+    out.u16(0);
+    out.u16(0);
+    out.u16(0);
+    out.u16(DOS_DATE);
+    out.u32(entry.crc);
+    out.u32(entry.size);
+    out.u32(entry.size);
+    out.u16(entry.name.size());
+    out.u16(0); // extra
+    out.u16(0); // comment
+    out.u16(0); // disk
+    out.u16(0); // internal attributes
+    out.u32(0); // external attributes
+    out.u32(entry.header_offset);
+    out.bytes(entry.name.data(), entry.name.size());
+}
+
+bool copy_file(Writer& out, const Entry& entry)
+{
+    std::ifstream in(entry.source, std::ios::binary);
+    std::vector<char> buffer(1 << 20);
+    uint64_t copied = 0;
+    while (copied < entry.size && in.read(buffer.data(), std::min<uint64_t>(buffer.size(), entry.size - copied))) {
+        out.bytes(buffer.data(), in.gcount());
+        copied += in.gcount();
+    }
+    return copied == entry.size;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::fprintf(stderr, "usage: %s <input dir> <output.pk2>\n", argv[0]);
+        return 2;
+    }
+    fs::path input_dir = argv[1], output = argv[2];
+    std::error_code ec;
+    if (fs::is_directory(input_dir, ec) == false) {
+        std::fprintf(stderr, "%s is not a directory\n", input_dir.string().c_str());
+        return 2;
+    }
+
+    std::vector<Entry> entries;
+    for (auto it = fs::recursive_directory_iterator(input_dir, ec); it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file() == false)
+            continue;
+        Entry& entry = entries.emplace_back();
+        entry.source = it->path();
+        entry.name = fs::relative(it->path(), input_dir).generic_string();
+        entry.size = it->file_size();
+        if (entry.name == twogame::pk2::INDEX_NAME || entry.name.ends_with(".cook-stamp"))
+            entries.pop_back();
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& left, const Entry& right) { return left.name < right.name; });
+
+    // The CRC has to be in the local header, before the data, so every file is read twice.
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        std::ifstream in(it->source, std::ios::binary);
+        std::vector<uint8_t> buffer(1 << 20);
+        it->crc = 0;
+        while (in.read(reinterpret_cast<char*>(buffer.data()), buffer.size()) || in.gcount() > 0)
+            it->crc = crc32(it->crc, buffer.data(), in.gcount());
+    }
+
+    Writer out(output);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        write_local_header(out, *it);
+        if (copy_file(out, *it) == false) {
+            std::fprintf(stderr, "failed to read %s\n", it->source.string().c_str());
+            return 1;
+        }
+    }
+
+    // The index goes in as one more stored entry. It doesn't list itself.
+    std::string names;
+    std::vector<twogame::pk2::IndexEntry> index_entries;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        twogame::pk2::IndexEntry& ie = index_entries.emplace_back();
+        ie.offset = it->data_offset;
+        ie.size = it->size;
+        ie.name_offset = names.size();
+        ie.name_size = it->name.size();
+        names += it->name;
+    }
+    twogame::pk2::IndexHeader index_header;
+    index_header.magic = twogame::pk2::INDEX_MAGIC;
+    index_header.version = twogame::pk2::VERSION;
+    index_header.entry_count = index_entries.size();
+    index_header.names_size = names.size();
+    std::vector<uint8_t> index(sizeof(index_header) + index_entries.size() * sizeof(twogame::pk2::IndexEntry) + names.size());
+    std::memcpy(index.data(), &index_header, sizeof(index_header));
+    std::memcpy(index.data() + sizeof(index_header), index_entries.data(), index_entries.size() * sizeof(twogame::pk2::IndexEntry));
+    std::memcpy(index.data() + sizeof(index_header) + index_entries.size() * sizeof(twogame::pk2::IndexEntry), names.data(), names.size());
+
+    Entry& index_entry = entries.emplace_back();
+    index_entry.name = twogame::pk2::INDEX_NAME;
+    index_entry.size = index.size();
+    index_entry.crc = crc32(0, index.data(), index.size());
+    write_local_header(out, index_entry);
+    out.bytes(index.data(), index.size());
+
+    uint64_t central_directory_offset = out.offset();
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+        write_central_header(out, *it);
+    uint64_t central_directory_size = out.offset() - central_directory_offset;
+
+    // No zip64: the offsets have to fit the classic 32-bit fields.
+    if (out.offset() > UINT32_MAX || entries.size() > UINT16_MAX) {
+        std::fprintf(stderr, "%s is too large for a pack\n", input_dir.string().c_str());
+        return 1;
+    }
+
+    twogame::pk2::Trailer trailer;
+    trailer.magic = twogame::pk2::TRAILER_MAGIC;
+    trailer.version = twogame::pk2::VERSION;
+    trailer.index_offset = index_entry.data_offset;
+    trailer.index_size = index_entry.size;
+    out.u32(END_OF_CENTRAL_DIRECTORY_SIGNATURE);
+    out.u16(0); // disk
+    out.u16(0); // disk with the central directory
+    out.u16(entries.size());
+    out.u16(entries.size());
+    out.u32(central_directory_size);
+    out.u32(central_directory_offset);
+    out.u16(sizeof(trailer));
+    out.bytes(&trailer, sizeof(trailer));
+
+    if (out.good() == false) {
+        std::fprintf(stderr, "failed to write %s\n", output.string().c_str());
+        return 1;
+    }
+    std::printf("packed %zu files into %s\n", entries.size() - 1, output.string().c_str());
+    return 0;
+}